@@ -0,0 +1,231 @@
+// For clock_gettime() and nanosleep(), we need _POSIX_C_SOURCE >= 199309L.
+// For gmtime_r(), we need _POSIX_C_SOURCE >= 199506L.
+#define _POSIX_C_SOURCE 199506L
+
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "strings.h"
+#include "system.h"
+
+#define CACHE_LINE_SIZE  64
+
+typedef struct Ring_entry Ring_entry;
+
+struct Ring_entry {
+    s64                     time;
+    s64                     duration;
+    s64                     num_bytes;
+    int                     status;
+    char                   *method;         // Not copied. In practice it's a string literal.
+    s32                     target_length;
+    char                    target[ACCESS_LOG_MAX_TARGET];
+};
+
+struct Access_ring {
+    // A single-producer, single-consumer queue. The thread that owns the ring adds at .head, and the logger thread
+    // takes from .tail. Both only ever increase. The entry for index i is i % ACCESS_LOG_RING_SIZE.
+    s64                     head;
+    u8                      padding1[CACHE_LINE_SIZE - sizeof(s64)];
+    s64                     tail;
+    u8                      padding2[CACHE_LINE_SIZE - sizeof(s64)];
+    s64                     num_dropped;    // Only the owner adds to this, but the logger reads it.
+
+    Ring_entry              entries[ACCESS_LOG_RING_SIZE];
+};
+
+// The ring this thread adds to, and the log it belongs to. If the log had no rings left, .current_ring is NULL.
+static __thread Access_log  *current_log  = NULL;
+static __thread Access_ring *current_ring = NULL;
+
+static Access_ring *get_ring(Access_log *log)
+// Get this thread's ring, claiming one the first time.
+{
+    if (current_log == log)  return current_ring;
+
+    s32 index = __atomic_fetch_add(&log->num_rings, 1, __ATOMIC_SEQ_CST);
+
+    Access_ring *ring = NULL;
+    if (index < ACCESS_LOG_MAX_RINGS) {
+        ring = New(Access_ring, log->context);
+        __atomic_store_n(&log->rings[index], ring, __ATOMIC_RELEASE);
+    }
+
+    current_log  = log;
+    current_ring = ring;
+
+    return ring;
+}
+
+bool add_access_record(Access_log *log, Access_record *record)
+// Add a record, timestamped now. Return false if we had to drop it.
+{
+    Access_ring *ring = get_ring(log);
+    if (!ring) {
+        __atomic_fetch_add(&log->num_dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    s64 head = ring->head; // Only we write it.
+    s64 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ACCESS_LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->num_dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    Ring_entry *entry = &ring->entries[head % ACCESS_LOG_RING_SIZE];
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    entry->time      = now.tv_sec*1000000 + now.tv_nsec/1000;
+    entry->duration  = record->duration;
+    entry->num_bytes = record->num_bytes;
+    entry->status    = record->status;
+    entry->method    = record->method;
+
+    entry->target_length = Min(strlen(record->target), ACCESS_LOG_MAX_TARGET);
+    memcpy(entry->target, record->target, entry->target_length);
+
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static void append_bytes(char_array *out, void *data, s64 size)
+{
+    array_reserve(out, round_up_pow2(out->count + size + 1));
+    memcpy(out->data + out->count, data, size);
+    out->count += size;
+}
+
+static void format_entry(Access_log *log, Ring_entry *entry, char_array *out)
+{
+    if (log->format == BINARY_LOG) {
+        u16 status        = entry->status;
+        u16 method_length = strlen(entry->method);
+        u16 target_length = entry->target_length;
+
+        append_bytes(out, &entry->time,      sizeof(s64));
+        append_bytes(out, &entry->duration,  sizeof(s64));
+        append_bytes(out, &entry->num_bytes, sizeof(s64));
+        append_bytes(out, &status,           sizeof(u16));
+        append_bytes(out, &method_length,    sizeof(u16));
+        append_bytes(out, &target_length,    sizeof(u16));
+        append_bytes(out, entry->method,     method_length);
+        append_bytes(out, entry->target,     target_length);
+        return;
+    }
+
+    time_t    seconds = entry->time/1000000;
+    struct tm date;
+    gmtime_r(&seconds, &date);
+
+    append_string(out, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %d %s %.*s %.3fms %ldB\n",
+                  date.tm_year + 1900, date.tm_mon + 1, date.tm_mday, date.tm_hour, date.tm_min, date.tm_sec,
+                  (int)(entry->time/1000 % 1000), entry->status, entry->method, (int)entry->target_length, entry->target,
+                  entry->duration/1000.0, entry->num_bytes);
+}
+
+static void write_all(s32 file_no, char *data, s64 size)
+{
+    while (size > 0) {
+        s64 num_written = write(file_no, data, size);
+        if (num_written < 0) {
+            if (errno == EINTR)  continue;
+
+            log_error("We couldn't write to the access log (%s).", get_last_error().string);
+            return;
+        }
+        data += num_written;
+        size -= num_written;
+    }
+}
+
+static void *logger_thread_routine(void *arg)
+{
+    Access_log *log = arg;
+
+    Memory_context *ctx = new_context(NULL);
+
+    char_array out = {.context = ctx};
+    array_reserve(&out, 64*1024);
+
+    if (log->format == BINARY_LOG) {
+        // Only start a file with the magic number. If we're appending to a binary log, it's already there.
+        bool at_start = (lseek(log->file_no, 0, SEEK_END) <= 0);
+        if (at_start)  append_bytes(&out, ACCESS_LOG_MAGIC, lengthof(ACCESS_LOG_MAGIC));
+    }
+
+    s64 num_dropped_reported = 0;
+
+    while (true) {
+        // Once we see .stopping, nobody is adding records any more, so this is the last time around.
+        bool stopping = __atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE);
+
+        s64 num_dropped = __atomic_load_n(&log->num_dropped, __ATOMIC_RELAXED);
+
+        s32 num_rings = Min(__atomic_load_n(&log->num_rings, __ATOMIC_SEQ_CST), ACCESS_LOG_MAX_RINGS);
+
+        for (s32 i = 0; i < num_rings; i++) {
+            Access_ring *ring = __atomic_load_n(&log->rings[i], __ATOMIC_ACQUIRE);
+            if (!ring)  continue; // The thread that claimed it hasn't finished making it.
+
+            s64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            s64 tail = ring->tail; // Only we write it.
+
+            for (s64 j = tail; j < head; j++)  format_entry(log, &ring->entries[j % ACCESS_LOG_RING_SIZE], &out);
+
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+            num_dropped += __atomic_load_n(&ring->num_dropped, __ATOMIC_RELAXED);
+        }
+
+        if (out.count)  write_all(log->file_no, out.data, out.count);
+        out.count = 0;
+
+        if (num_dropped > num_dropped_reported) {
+            log_error("The access log fell behind and dropped %ld records.", num_dropped - num_dropped_reported);
+            num_dropped_reported = num_dropped;
+        }
+
+        if (stopping)  break;
+
+        struct timespec interval = {0, ACCESS_LOG_INTERVAL*1000000};
+        nanosleep(&interval, NULL);
+    }
+
+    free_context(ctx);
+
+    return NULL;
+}
+
+Access_log *start_access_log(s32 file_no, enum Access_log_format format, Memory_context *context)
+// Start a logger thread that writes to file_no, which should already be open. We don't close it.
+{
+    Access_log *log = New(Access_log, context);
+
+    log->context = context;
+    log->file_no = file_no;
+    log->format  = format;
+
+    int r = pthread_create(&log->thread, NULL, logger_thread_routine, log);
+    if (r) {
+        Fatal("Thread creation failed (%s).", get_error_info(r).string);
+    }
+
+    return log;
+}
+
+void stop_access_log(Access_log *log)
+// Call this once every thread that adds records has finished.
+{
+    __atomic_store_n(&log->stopping, true, __ATOMIC_RELEASE);
+
+    int r = pthread_join(log->thread, NULL);
+    if (r) {
+        Fatal("Failed to join a thread (%s).", get_error_info(r).string);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef ACCESS_LOG_H_INCLUDED
+#define ACCESS_LOG_H_INCLUDED
+
+#include <pthread.h>
+
+#include "array.h"
+
+//
+// An Access_log writes a line (or a binary record) for each request without making the thread that handled the
+// request wait for stdio or a system call. Each thread that adds records gets a ring buffer of its own, and a logger
+// thread empties the rings every ACCESS_LOG_INTERVAL milliseconds and writes everything it found with one write().
+//
+//      Access_log *log = start_access_log(STDOUT_FILENO, TEXT_LOG, context);
+//
+//      Access_record record = {.duration = 1234, .num_bytes = 5678, .status = 200, .method = "GET", .target = "/"};
+//      bool added = add_access_record(log, &record);
+//
+//      stop_access_log(log); // Writes out whatever's left and joins the logger thread.
+//
+// If a thread's ring is full because the logger has fallen behind, add_access_record() drops the record and returns
+// false rather than wait. The logger reports how many it dropped.
+//
+// Records from the same thread come out in order, but records from different threads can be up to
+// ACCESS_LOG_INTERVAL milliseconds out of order. Sort by time if that matters.
+//
+// A text log has one line per request:
+//
+//      2026-10-16T09:30:01.123Z 200 GET /elections/1/districts.json 1.234ms 5678B
+//
+// A binary log is for offline analysis; see bin/scripts/access-log-dump. It starts with the 8 bytes
+// ACCESS_LOG_MAGIC, followed by the records one after another, each laid out like this (in native byte order):
+//
+//      s64 time;           // When we finished sending the reply, in microseconds since the Unix epoch.
+//      s64 duration;       // In microseconds, from the first byte of the request to the last byte of the reply.
+//      s64 num_bytes;      // The number of bytes we sent, including the header.
+//      u16 status;
+//      u16 method_length;
+//      u16 target_length;
+//      char method[method_length];
+//      char target[target_length]; // The path and query string.
+//
+typedef struct Access_log    Access_log;
+typedef struct Access_record Access_record;
+typedef struct Access_ring   Access_ring;
+
+#define ACCESS_LOG_MAGIC        "VMLOG\0\0\1"
+#define ACCESS_LOG_MAX_RINGS    64      // Threads beyond this many can't log. Their records count as dropped.
+#define ACCESS_LOG_RING_SIZE    1024    // Records per ring. A power of two.
+#define ACCESS_LOG_INTERVAL     50      // Milliseconds.
+#define ACCESS_LOG_MAX_TARGET   200     // We cut longer targets short.
+
+enum Access_log_format {TEXT_LOG=1, BINARY_LOG};
+
+struct Access_record {
+    s64                     duration;       // In microseconds.
+    s64                     num_bytes;
+    int                     status;
+    char                   *method;         // Not copied, so it should be a string literal.
+    char                   *target;         // The path and query string. add_access_record() copies it.
+};
+
+struct Access_log {
+    Memory_context         *context;
+
+    s32                     file_no;
+    enum Access_log_format  format;
+
+    Access_ring            *rings[ACCESS_LOG_MAX_RINGS];
+    s32                     num_rings;      // How many threads have claimed a ring.
+    s64                     num_dropped;    // Records dropped by threads that couldn't get a ring.
+
+    pthread_t               thread;
+    bool                    stopping;
+};
+
+Access_log *start_access_log(s32 file_no, enum Access_log_format format, Memory_context *context);
+bool add_access_record(Access_log *log, Access_record *record);
+void stop_access_log(Access_log *log);
+
+#endif // ACCESS_LOG_H_INCLUDED
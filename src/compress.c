@@ -0,0 +1,157 @@
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "compress.h"
+
+u8_array *gzip_compress(void *data, s64 size, int level, Memory_context *context)
+{
+    z_stream stream = {0};
+
+    // A windowBits of 15+16 asks zlib for a gzip header and trailer instead of a zlib one.
+    int r = deflateInit2(&stream, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    if (r != Z_OK)  return NULL;
+
+    u8_array *result = NewArray(result, context);
+    array_reserve(result, deflateBound(&stream, size));
+
+    stream.next_in   = data;
+    stream.avail_in  = size;
+    stream.next_out  = result->data;
+    stream.avail_out = result->limit;
+
+    r = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+
+    // Since we reserved deflateBound() bytes, deflate() should have finished in one call.
+    if (r != Z_STREAM_END) {
+        dealloc(result->data, context);
+        dealloc(result, context);
+        return NULL;
+    }
+
+    result->count = stream.total_out;
+
+    return result;
+}
+
+u8_array *brotli_compress(void *data, s64 size, int quality, Memory_context *context)
+{
+    // This is 0 if the input is too big for brotli. Check before we allocate anything.
+    u64 max_size = BrotliEncoderMaxCompressedSize(size);
+    if (!max_size)  return NULL;
+
+    u8_array *result = NewArray(result, context);
+    array_reserve(result, max_size);
+
+    size_t out_size = result->limit;
+    bool ok = BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, size, data, &out_size, result->data);
+    if (!ok) {
+        dealloc(result->data, context);
+        dealloc(result, context);
+        return NULL;
+    }
+
+    result->count = out_size;
+
+    return result;
+}
+
+struct Compressor {
+    Memory_context         *context;
+    enum Compression_format format;
+    z_stream                gzip;
+    BrotliEncoderState     *brotli;
+};
+
+// zlib and brotli let us supply their memory, so we give them the compressor's context.
+static void *alloc_for_zlib(void *context, unsigned num_items, unsigned item_size)  { return alloc(num_items, item_size, context); }
+static void  dealloc_for_zlib(void *context, void *data)                            { dealloc(data, context); }
+static void *alloc_for_brotli(void *context, size_t size)                           { return alloc(size, 1, context); }
+static void  dealloc_for_brotli(void *context, void *data)                          { if (data)  dealloc(data, context); }
+
+Compressor *create_compressor(enum Compression_format format, int level, Memory_context *context)
+// Return NULL if the compression library fails to start. All the compressor's memory comes from the context, so if
+// you're about to free the context anyway, you don't need to call free_compressor().
+{
+    Compressor *compressor = New(Compressor, context);
+
+    compressor->context = context;
+    compressor->format  = format;
+
+    if (format == GZIP) {
+        z_stream *stream = &compressor->gzip;
+
+        stream->zalloc = alloc_for_zlib;
+        stream->zfree  = dealloc_for_zlib;
+        stream->opaque = context;
+
+        int r = deflateInit2(stream, level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+        if (r != Z_OK)  return NULL;
+    } else {
+        assert(format == BROTLI);
+
+        compressor->brotli = BrotliEncoderCreateInstance(alloc_for_brotli, dealloc_for_brotli, context);
+        if (!compressor->brotli)  return NULL;
+
+        BrotliEncoderSetParameter(compressor->brotli, BROTLI_PARAM_QUALITY, level);
+    }
+
+    return compressor;
+}
+
+bool compress_more(Compressor *compressor, void *data, s64 size, bool finish, u8_array *out)
+// Return false if the compressor fails. Then the output is incomplete and you shouldn't use the compressor again.
+{
+    s64 MIN_SPACE = 4096; // How much room to make in the output before each call into the library.
+
+    if (compressor->format == GZIP) {
+        z_stream *stream = &compressor->gzip;
+
+        stream->next_in  = data;
+        stream->avail_in = size;
+
+        while (true) {
+            array_reserve(out, out->count + MIN_SPACE);
+
+            stream->next_out  = out->data + out->count;
+            stream->avail_out = out->limit - out->count;
+
+            int r = deflate(stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+            if (r == Z_STREAM_ERROR)  return false;
+
+            out->count = out->limit - stream->avail_out;
+
+            if (finish && r == Z_STREAM_END)  return true;
+            if (!finish && stream->avail_out > 0 && stream->avail_in == 0)  return true; // Z_SYNC_FLUSH is done when it doesn't fill the output.
+        }
+    } else {
+        BrotliEncoderOperation op = finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_FLUSH;
+
+        size_t   available_in = size;
+        u8 const *next_in     = data;
+
+        while (true) {
+            array_reserve(out, out->count + MIN_SPACE);
+
+            size_t available_out = out->limit - out->count;
+            u8    *next_out      = out->data + out->count;
+
+            bool ok = BrotliEncoderCompressStream(compressor->brotli, op, &available_in, &next_in, &available_out, &next_out, NULL);
+            if (!ok)  return false;
+
+            out->count = out->limit - available_out;
+
+            if (available_in == 0 && !BrotliEncoderHasMoreOutput(compressor->brotli)) {
+                if (!finish || BrotliEncoderIsFinished(compressor->brotli))  return true;
+            }
+        }
+    }
+}
+
+void free_compressor(Compressor *compressor)
+{
+    if (compressor->format == GZIP)  deflateEnd(&compressor->gzip);
+    else                             BrotliEncoderDestroyInstance(compressor->brotli);
+
+    dealloc(compressor, compressor->context);
+}
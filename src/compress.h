@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H_INCLUDED
+#define COMPRESS_H_INCLUDED
+
+#include "array.h"
+
+//
+// Compress a buffer in one go into a new array in the given context. Return NULL if the compressor fails.
+// The output is in the format you'd send with the corresponding HTTP content-encoding.
+//
+u8_array *gzip_compress(void *data, s64 size, int level, Memory_context *context);     // level: 1 (fast) to 9 (small).
+u8_array *brotli_compress(void *data, s64 size, int quality, Memory_context *context); // quality: 0 (fast) to 11 (small).
+
+//
+// To compress a body that arrives in pieces, use a Compressor. Each call to compress_more() appends to the output
+// everything needed to decode the input so far, so you can send each piece as soon as you have it. Pass finish=true
+// with the last piece. The compressor's memory all comes from the context you give it.
+//
+//      Compressor *compressor = create_compressor(BROTLI, 5, context);
+//
+//      compress_more(compressor, piece, piece_size, false, &output);
+//      ...
+//      compress_more(compressor, last_piece, last_piece_size, true, &output);
+//
+//      free_compressor(compressor);
+//
+typedef struct Compressor Compressor;
+
+enum Compression_format {GZIP=1, BROTLI};
+
+Compressor *create_compressor(enum Compression_format format, int level, Memory_context *context);
+bool compress_more(Compressor *compressor, void *data, s64 size, bool finish, u8_array *out);
+void free_compressor(Compressor *compressor);
+
+#endif // COMPRESS_H_INCLUDED
@@ -542,6 +542,22 @@ void reset_context(Memory_context *context)
     pthread_mutex_unlock(&c->mutex);
 }
 
+u64 get_context_size(Memory_context *context)
+// Return the number of bytes of backing memory a context holds, used or not. reset_context() keeps all of them.
+{
+    Memory_context *c = context;
+
+    u64 size = 0;
+
+    pthread_mutex_lock(&c->mutex);
+
+    for (s64 i = 0; i < c->buffer_count; i++)  size += c->buffers[i].size;
+
+    pthread_mutex_unlock(&c->mutex);
+
+    return size;
+}
+
 //
 // We expose check_context_integrity() for testing purposes. Since that function works by making
 // lots of assertions, we hide it behind this #ifndef, so we don't accidentally link a non-debug
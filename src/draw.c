@@ -1,6 +1,7 @@
 #include <math.h>
 
 #include "draw.h"
+#include "trace.h"
 
 void draw_polygon(Polygon *polygon, Vector3 colour, Vertex_array *out)
 {
@@ -30,6 +31,8 @@ void draw_path(Path *path, float width, Vector3 colour, Vertex_array *out)
     float g = colour.v[1];
     float b = colour.v[2];
 
+    s64 span = BeginSpan();
+
     for (s64 i = 0; i < path->count-1; i++) {
         //
         // Draw the line AB as a rectangle.
@@ -86,6 +89,8 @@ void draw_path(Path *path, float width, Vector3 colour, Vertex_array *out)
         *Add(out) = (Vertex){mitre[1].v[0], mitre[1].v[1], r, g, b};
         *Add(out) = (Vertex){mitre[2].v[0], mitre[2].v[1], r, g, b};
     }
+
+    EndSpan("draw_path", span);
 }
 
 Vertex_array *copy_verts_in_the_box(Vertex_array *verts, float min_x, float min_y, float max_x, float max_y, Memory_context *context) //|Deprecated
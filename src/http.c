@@ -1,19 +1,34 @@
 // For sigemptyset and sigaddset, we need to define _POSIX_C_SOURCE (as anything).
 // For pthread_sigmask, we need to define _POSIX_C_SOURCE >= 199506L.
+// For SO_REUSEPORT, we need to define _DEFAULT_SOURCE.
+// For POLLRDHUP, accept4(), sched_getaffinity() and pthread_setaffinity_np(), we need to define _GNU_SOURCE.
 #define _POSIX_C_SOURCE 199506L
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <signal.h>
 #include <sys/signalfd.h>
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "compress.h"
 #include "http.h"
+#include "scheduler.h"
 #include "strings.h"
 #include "system.h"
+#include "uring.h"
 
 typedef struct Task Task;
 
@@ -21,10 +36,11 @@ struct Task {
     enum {
         DEAL_WITH_A_CLIENT=1,
         REFRESH_FILE_TREE,
+        REVALIDATE_RESPONSE,
         TIME_TO_WIND_UP,
     }                       type;
     union {
-        // If the type is DEAL_WITH_A_CLIENT:
+        // If the type is DEAL_WITH_A_CLIENT or REVALIDATE_RESPONSE:
         Client             *client;
 
         // If the type is REFRESH_FILE_TREE:
@@ -32,64 +48,38 @@ struct Task {
     };
 };
 
-struct Task_queue {
-    pthread_mutex_t         mutex;
-    pthread_cond_t          ready;          // The server will broadcast when there are tasks.
+static __thread bool on_blocking_worker = false; // Whether the current thread is one of the server's blocking workers.
 
-    Array(Task);
-    Task                   *head;           // A pointer to the first element in the array that hasn't been taken from the queue. If it points to the element after the end of the array, the queue is empty.
-};
+// How long a client gets to send a request, or to take a reply it couldn't take all at once, before we start holding it
+// to Server.min_receive_rate or Server.min_send_rate. In milliseconds.
+#define RATE_GRACE_PERIOD   2000
 
-static Task_queue *create_queue(Memory_context *context)
+static bool is_too_slow(s64 num_bytes, s64 start_time, s64 min_rate)
+// Whether num_bytes since start_time (in milliseconds) is slower than min_rate bytes per second, allowing for the
+// grace period.
 {
-    Task_queue *queue = NewArray(queue, context);
-
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->ready, NULL);
+    if (!min_rate)  return false;
 
-    array_reserve(queue, 8);
-    queue->head = queue->data;
+    s64 elapsed = get_monotonic_time() - start_time;
+    if (elapsed <= RATE_GRACE_PERIOD)  return false;
 
-    return queue;
+    return num_bytes*1000 < min_rate*elapsed;
 }
 
-static void add_to_queue(Task_queue *queue, Task task)
+static s64 get_rate_deadline(s64 num_bytes, s64 start_time, s64 min_rate)
+// When num_bytes since start_time will become too slow for min_rate, if no more bytes come through. INT64_MAX if
+// min_rate is 0.
 {
-    Task_queue *q = queue;
-
-    pthread_mutex_lock(&q->mutex);
-
-    s64 head_index = q->head - q->data;
-    assert(0 <= head_index && head_index <= q->count);
-
-    bool queue_was_empty = (head_index == q->count);
-
-    if (q->count == q->limit && head_index > 0) {
-        // We're out of room in the array, but there's space to the left of the head. Shift the head back to the start of the array.
-        memmove(q->data, q->head, (q->count - head_index)*sizeof(q->data[0]));
-        q->count  -= head_index;
-        head_index = 0;
-    }
-
-    *Add(q) = task;
-    q->head = &q->data[head_index];
+    if (!min_rate)  return INT64_MAX;
 
-    if (queue_was_empty)  pthread_cond_broadcast(&q->ready);
-    pthread_mutex_unlock(&q->mutex);
+    return start_time + Max(RATE_GRACE_PERIOD, num_bytes*1000/min_rate) + 1;
 }
 
-static Task pop_queue(Task_queue *queue)
+static void start_request_clock(Client *client)
+// We've received the first bytes of a request.
 {
-    Task_queue *q = queue;
-
-    pthread_mutex_lock(&q->mutex);
-    while (q->head == &q->data[q->count])  pthread_cond_wait(&q->ready, &q->mutex);
-
-    Task task = *q->head;
-    q->head += 1;
-
-    pthread_mutex_unlock(&q->mutex);
-    return task;
+    client->timing.first_byte = get_monotonic_time_us();
+    client->start_time        = client->timing.first_byte/1000;
 }
 
 static bool receive_message(Client *client)
@@ -115,7 +105,9 @@ static bool receive_message(Client *client)
         int flags = MSG_NOSIGNAL;
         s64 recv_count = recv(client->socket, buffer, num_free_bytes, flags);
         if (recv_count > 0) {
-            // We have successfully received some bytes.
+            // We have successfully received some bytes. If they're the start of a request, start the clock.
+            if (message->count == 0)  start_request_clock(client);
+
             message->count += recv_count;
             assert(message->count < message->limit);
             message->data[message->count] = '\0';
@@ -133,19 +125,44 @@ static bool receive_message(Client *client)
         return false;
     }
 
+    // A request that's still arriving this slowly is probably someone trying to tie up our connections.
+    if (we_received_data && is_too_slow(message->count, client->start_time, client->server->min_receive_rate)) {
+        add_to_metric(client->server->metrics, client->server->metric_ids.slow_receives, 1);
+        client->phase = READY_TO_CLOSE;
+        return false;
+    }
+
     return we_received_data;
 }
 
-// These are the characters that we treat just like regular letters and numbers when we come across them
-// in paths and query strings. Everything else either has a special meaning or is not allowed.
-#define ALLOWED_URI_CHARS "-._~/,+"
+static void add_received_bytes(Client *client, u8 *data, s64 size)
+// In io_uring mode, the kernel receives into one of the reactor's buffers. Copy the bytes onto the client's message,
+// as if receive_message() had received them. Like receive_message(), set the client READY_TO_CLOSE if it's too slow.
+{
+    char_array *message = &client->message;
+
+    if (message->count == 0)  start_request_clock(client);
+
+    s64 limit = message->count + size + 1; // Leave room for a null byte.
+    if (limit > message->limit)  array_reserve(message, round_up_pow2(limit));
+
+    memcpy(&message->data[message->count], data, size);
+    message->count += size;
+    message->data[message->count] = '\0';
+
+    if (is_too_slow(message->count, client->start_time, client->server->min_receive_rate)) {
+        add_to_metric(client->server->metrics, client->server->metric_ids.slow_receives, 1);
+        client->phase = READY_TO_CLOSE;
+    }
+}
 
-static bool parse_request(Client *client)
-// Parse the message in client->message and save the result in client->request. If we successfully parse a request,
-// set client->phase to HANDLING_REQUEST and return true. If the request is invalid, fill out client->response, set
-// the phase to SENDING_REPLY and return true. Return false only if the request looks fine but incomplete.
+static bool parse_client_request(Client *client)
+// Parse the request at the start of client->message and save the result in client->request. If we successfully parse
+// a request, set client->phase to HANDLING_REQUEST and return true. If the request is invalid, fill out client->response,
+// set the phase to SENDING_REPLY and return true. Return false only if the request looks fine but incomplete.
+// Whenever we return true, we also set client->request_size, so the caller can remove the request from the message.
 {
-    Memory_context *ctx = client->context;
+    Request *request = &client->request;
 
     assert(client->phase == PARSING_REQUEST);
     assert(client->message.count);
@@ -153,164 +170,65 @@ static bool parse_request(Client *client)
     char *data = client->message.data;
     s64   size = client->message.count;
 
-    char *d = data; // A pointer to advance as we parse.
-
     // First, wait until we've received the whole header.
-    {
-        // We're storing the CRLF offsets as 16-bit integers, which means the header can't be longer than 32768 bytes.
-        // Since we don't parse POST requests yet, we'll just apply this limit to the request as a whole.
-        if (size > (s64)INT16_MAX) {
-            char static body[] = "The request is too large.\n";
-            client->response = (Response){413, .body=body, .size=lengthof(body)};
-            client->phase = SENDING_REPLY;
-            return true;
-        }
-
-        s16_array *offsets = &client->crlf_offsets;
-
-        // If we've previously noted some CRLF offsets, skip past the last one.
-        if (offsets->count > 0)  d = data + offsets->data[offsets->count-1] + 2;
-
-        bool full_header_received = false;
-        char *last_cr = NULL;
-        char *last_lf = NULL;
-
-        for (; d-data < size; d++) {
-            if (*d == '\r')  last_cr = d;
-            if (*d != '\n')  continue;
-            last_lf = d;
-            if (last_cr == last_lf-1) {
-                // We've found a CRLF.
-                s64 offset = last_cr - data;
-                assert(offset < (s64)INT16_MAX);
-                full_header_received = (offsets->count > 0 && offset == offsets->data[offsets->count-1] + 2);
-                if (full_header_received)  break; // Don't add the final CRLF to the offsets.
-                *Add(offsets) = (s16)offset;
-            }
-        }
+    s64 request_size = find_request_end(request, data, Min(size, client->server->max_request_size));
 
-        if (!full_header_received)  return false;
-    }
+    if (request_size <= 0) {
+        if (request_size == 0 && size < client->server->max_request_size)  return false;
 
-    d = data;
+        client->http_version = 0;
+        client->keep_alive   = false;
 
-    if (starts_with(d, "GET ")) {
-        client->request.method = GET;
-        d += 4;
-    } else {
-        char static body[] = "We only support GET requests!\n";
-        client->response = (Response){501, .body=body, .size=lengthof(body)};
+        if (request_size < 0) {
+            char static body[] = "The request has too many header lines.\n";
+            client->response = (Response){431, .body=body, .size=lengthof(body)};
+        } else {
+            char static body[] = "The request is too large.\n";
+            client->response = (Response){413, .body=body, .size=lengthof(body)};
+        }
+        client->request_size = size;
         client->phase = SENDING_REPLY;
         return true;
     }
 
-    //
-    // Parse the path and query string.
-    //
-    {
-        char_array  *path  = &client->request.path;
-        string_dict *query = &client->request.query_params;
-
-        char_array key   = {.context = ctx};
-        char_array value = {.context = ctx};
-
-        // At first we're reading the request path. If we come to a query string, our target alternates between a pending key and value.
-        char_array *target = path;
-
-        while (d-data < size) {
-            if (isalnum(*d) || Contains(ALLOWED_URI_CHARS, *d)) {
-                *Add(target) = *d;
-            } else if (*d == '%') {
-                if (d-data + 2 >= size)        break;
-                if (!isxdigit(d[1]))           break;
-                if (!isxdigit(d[2]))           break;
-                // It's a hex-encoded byte.
-                *Add(target) = (char)hex_to_byte(d[1], d[2]);
-                d += 2;
-            } else if (*d == '?') {
-                if (target != path)            break;
-                target = &key;
-            } else if (*d == '=') {
-                if (target != &key)            break;
-                if (key.count == 0)            break;
-                target = &value;
-            } else if (*d == '&' || *d == ' ') {
-                if (key.count) {
-                    // Add the previous key/value we were building.
-                    *Add(&key)   = '\0';
-                    *Add(&value) = '\0'; // If the query string has keys without values, we put empty strings for values.
-
-                    *Set(query, key.data) = value.data;
-
-                    key   = (char_array){.context = ctx};
-                    value = (char_array){.context = ctx};
-                }
-                if (*d == ' ')  break; // Success!
-                target = &key;
-            } else {
-                // There was an unexpected character.
-                break;
-            }
-            d += 1;
-        }
+    client->request_size = request_size;
 
-        if (*d != ' ') {
-            // We didn't finish at a space, which means we came to an unexpected character in the URI. But if managed
-            // to parse a path and we were onto a query string, we'll allow it and just disregard the query string.
-            if (path->count && target != path) {
-                // Advance to the next space character after the URI.
-                while (d-data < size) {
-                    d += 1;
-                    if (*d == ' ')  break;
-                }
-            } else {
-                // Otherwise, the request is bunk.
-                char_array message = {.context = ctx};
-                append_string(&message, "The request had an unexpected character at index %ld: ", d-data);
-                append_string(&message, isalnum(*d) ? "'%c'.\n" : "\\x%02x.\n", *d);
-
-                client->response = (Response){400, .body = message.data, message.count};
-                client->phase = SENDING_REPLY;
-                return true;
-            }
-        }
-        assert(*d == ' ');
-        d += 1;
+    int status = parse_request(request, data, request_size, client->context);
 
-        *Add(path) = '\0';
-        path->count -= 1;
-    }
+    client->http_version = request->http_version;
+    client->keep_alive   = request->keep_alive;
 
-    if (starts_with(d, "HTTP/1.0")) {
-        client->http_version = HTTP_VERSION_1_0;
-    } else if (starts_with(d, "HTTP/1.1")) {
-        client->http_version = HTTP_VERSION_1_1;
-        client->keep_alive   = true; // Connection: keep-alive is the default in version 1.1.
-    } else {
-        char static body[] = "Unsupported HTTP version.\n";
-        client->response = (Response){505, .body=body, .size=lengthof(body)};
+    if (status) {
+        client->response = (Response){status, .body=request->error, .size=strlen(request->error)};
         client->phase = SENDING_REPLY;
         return true;
     }
 
-    for (s64 i = 0; i < client->crlf_offsets.count-1; i++) {
-        char *line = data + (s64)client->crlf_offsets.data[i] + 2;
-        char *eol  = data + (s64)client->crlf_offsets.data[i+1];
+    client->phase = HANDLING_REQUEST;  // Success.
+    return true;
+}
+
+static u32 get_peer_address(s32 socket)
+// The IPv4 address a connected socket's connection came from, in host byte order, or 0 if we can't tell.
+{
+    struct sockaddr_in peer      = {0};
+    socklen_t          peer_size = sizeof(peer);
 
-        // Normalise the header in place.
-        for (char *c = line; c < eol; c++)  *c = tolower(*c);
+    int r = getpeername(socket, (struct sockaddr *)&peer, &peer_size);
+    if (r == -1)  return 0;
 
-        if (starts_with(line, "connection:")) {
-            char *value = trim_left(line + lengthof("connection:"), " \t");
-            if (starts_with(value, "keep-alive"))  client->keep_alive = true;
-            else if (starts_with(value, "close"))  client->keep_alive = false;
+    return ntohl(peer.sin_addr.s_addr);
+}
 
-            break; // For now, the only request header that we care about is "connection".
-        }
-    }
+static bool is_local_client(Client *client)
+// Check whether a client is connecting from the same machine, for Route_options.local_only.
+{
+    if (client->socket < 0)  return true; // It's a revalidation client. We made it ourselves.
 
-    client->phase = HANDLING_REQUEST;  // Success.
-    return true;
+    // In io_uring mode, we only look up the address when we accept a connection if we need it to count connections.
+    u32 address = client->address ? client->address : get_peer_address(client->socket);
+
+    return (address >> 24) == 127;
 }
 
 static Request_handler *find_request_handler(Server *server, Client *client)
@@ -325,6 +243,7 @@ static Request_handler *find_request_handler(Server *server, Client *client)
         Route *route = &server->routes.data[i];
 
         if (route->method != request->method)  continue;
+        if (route->options.local_only && !is_local_client(client))  continue;
 
         Match *match = run_regex(route->path_regex, request->path.data, request->path.count, client->context);
         if (match->success) {
@@ -338,74 +257,213 @@ static Request_handler *find_request_handler(Server *server, Client *client)
     return NULL;
 }
 
-static void print_response_headers(Client *client)
-// Print the headers into the client->reply_header buffer.
+Shared_buffer *create_shared_buffer(Memory_context *parent)
+// Make an empty buffer with one reference, which belongs to the caller. Fill in .bytes with the usual array functions.
 {
-    Response   *response     = &client->response;
-    char_array *reply_header = &client->reply_header;
+    Memory_context *context = new_context(parent);
 
-    array_reserve(reply_header, 128);
+    Shared_buffer *buffer = New(Shared_buffer, context);
+
+    buffer->context  = context;
+    buffer->bytes    = (u8_array){.context = context};
+    buffer->num_refs = 1;
+
+    return buffer;
+}
+
+void retain_shared_buffer(Shared_buffer *buffer)
+{
+    __atomic_add_fetch(&buffer->num_refs, 1, __ATOMIC_RELAXED);
+}
+
+void release_shared_buffer(Shared_buffer *buffer)
+// Once every reference is released, free the buffer. Don't change .bytes while anyone else might be reading them.
+{
+    int num_refs = __atomic_sub_fetch(&buffer->num_refs, 1, __ATOMIC_ACQ_REL);
+    if (num_refs == 0)  free_context(buffer->context);
+}
+
+void add_body_segment(Client *client, Response *response, void *data, s64 size, Shared_buffer *buffer)
+// Append a segment to a response body. If the data is in a shared buffer, pass the buffer too, and the segment will
+// take its own reference to it, which the server releases once it has sent the response. So a handler can assemble
+// a response from cached pieces without copying them.
+{
+    if (!response->segments.context)  response->segments = (Body_segment_array){.context = client->context};
+
+    if (buffer)  retain_shared_buffer(buffer);
+
+    *Add(&response->segments) = (Body_segment){data, size, buffer};
+    response->size += size;
+}
+
+static void release_segments(Response *response)
+{
+    for (s64 i = 0; i < response->segments.count; i++) {
+        Body_segment *segment = &response->segments.data[i];
+        if (segment->buffer)  release_shared_buffer(segment->buffer);
+        segment->buffer = NULL;
+    }
+}
+
+static void queue_reply(Client *client, Compressor *compressor)
+// Print the headers for client->response and add the response to the end of the client's queue of replies.
+// If the response is streamed, compressor is what compress_response() returned for it.
+{
+    Response *response = &client->response;
+
+    Reply *reply = Add(&client->replies);
+    *reply = (Reply){
+        .header      = {.context = client->context},
+        .response    = *response,
+        .request     = {client->request.method, client->request.path, client->request.query_params},
+        .route       = client->route,
+        .time_queued = get_monotonic_time_us(),
+        .chunk       = {.context = client->context},
+        .piece       = {.context = client->context},
+        .compressor  = compressor,
+    };
+
+    if (response->stream) {
+        // We send the headers first, with no body, and then make the chunks as the client takes them.
+        reply->response.body = NULL;
+        reply->response.size = 0;
+    }
+
+    char_array *header = &reply->header;
+    array_reserve(header, 128);
 
     char *version = "HTTP/1.0";
     if (client->http_version == HTTP_VERSION_1_1)  version = "HTTP/1.1";
 
-    append_string(reply_header, "%s %d\r\n", version, response->status);
+    append_string(header, "%s %d\r\n", version, response->status);
 
     // Add our own headers first.
     if (client->http_version == HTTP_VERSION_1_0 && client->keep_alive) {
-        append_string(reply_header, "connection: keep-alive\r\n");
+        append_string(header, "connection: keep-alive\r\n");
     } else if (client->http_version == HTTP_VERSION_1_1 && !client->keep_alive) {
-        append_string(reply_header, "connection: close\r\n");
+        append_string(header, "connection: close\r\n");
     }
-    append_string(reply_header, "content-length: %ld\r\n", response->size);
+    if (response->stream)             append_string(header, "transfer-encoding: chunked\r\n");
+    else if (response->status != 304) append_string(header, "content-length: %ld\r\n", response->size); // A 304 has no body.
 
     // Add the headers provided by the request handler.
     for (s64 i = 0; i < response->headers.count; i++) {
         char *key   = response->headers.keys[i];
         char *value = response->headers.vals[i];
         //|Todo: Make sure the handler didn't duplicate any of the headers we added.
-        append_string(reply_header, "%s: %s\r\n", key, value);
+        append_string(header, "%s: %s\r\n", key, value);
     }
-    append_string(reply_header, "\r\n");
+    append_string(header, "\r\n");
 }
 
-static bool send_reply(Client *client)
-// Return true if we successfully send the full reply. If sending would block, return false.
+//|Temporary: Until we put the File_tree_accessor stuff into its own module.
+void refresh_file_tree(File_tree_accessor *accessor);
+bool release_file_tree(File_tree_resource *resource);
+void free_file_tree_resource(File_tree_resource *resource);
+
+static bool send_replies(Client *client)
+// Return true if we successfully send all the queued replies. If sending would block, return false.
 // If there is an error, set client->phase to READY_TO_CLOSE and return false.
 {
     //
-    // Our reply is split across two buffers: client.reply_header and client.response.body. We keep them
-    // separate because the body is created first (by the request handler) and the header comes after that.
-    // So if we wanted to put them both into one buffer, we'd have to copy the body.
+    // Each reply is split across at least two buffers: reply.header and the body. We keep them separate because the
+    // body is created first (by the request handler) and the header comes after that. So if we wanted to put them
+    // both into one buffer, we'd have to copy the body. For the same reason, a body made of segments stays in
+    // segments. Instead we gather all the buffers of all the queued replies into one sendmsg() call (like writev(),
+    // but we can pass MSG_NOSIGNAL).
+    //
+    // If a reply's body is a file, we send it with sendfile() so the bytes go straight from the page cache to the
+    // socket. That splits the gathering: first we send the buffers before the file, then the file, then the rest.
     //
-    char_array *reply_header   = &client->reply_header;
-    Response   *response       = &client->response;
-    s64        *num_bytes_sent = &client->num_bytes_sent;
-
-    s64 full_reply_size = reply_header->count + response->size;
-    assert(*num_bytes_sent < full_reply_size);
-
-    while (*num_bytes_sent < full_reply_size) {
-        void *data_to_send      = NULL;
-        s64   num_bytes_to_send = 0;
-        if (*num_bytes_sent < reply_header->count) {
-            // We're still sending the response header.
-            data_to_send      = reply_header->data  + *num_bytes_sent;
-            num_bytes_to_send = reply_header->count - *num_bytes_sent;
+    Reply_array *replies        = &client->replies;
+    s64         *num_bytes_sent = &client->num_bytes_sent;
+
+    s64 full_size = 0;
+    for (s64 i = 0; i < replies->count; i++)  full_size += replies->data[i].header.count + replies->data[i].response.size;
+    assert(*num_bytes_sent < full_size);
+
+    // List every buffer in order. A file is a buffer with no data, and its entry in files[] is set.
+    s64 max_buffers = 0;
+    for (s64 i = 0; i < replies->count; i++)  max_buffers += 2 + replies->data[i].response.segments.count;
+
+    struct iovec *buffers     = New(max_buffers, struct iovec, client->context);
+    File_node   **files       = New(max_buffers, File_node *, client->context);
+    s64           num_buffers = 0;
+
+    for (s64 i = 0; i < replies->count; i++) {
+        Reply    *reply    = &replies->data[i];
+        Response *response = &reply->response;
+
+        buffers[num_buffers++] = (struct iovec){reply->header.data, reply->header.count};
+
+        if (response->file) {
+            files[num_buffers] = response->file;
+            buffers[num_buffers++] = (struct iovec){NULL, response->size};
+        } else if (response->segments.count) {
+            for (s64 j = 0; j < response->segments.count; j++) {
+                Body_segment *segment = &response->segments.data[j];
+                buffers[num_buffers++] = (struct iovec){segment->data, segment->size};
+            }
         } else {
-            // We're sending the response body.
-            s64 body_sent = *num_bytes_sent - reply_header->count;
+            buffers[num_buffers++] = (struct iovec){response->body, response->size};
+        }
+    }
+    assert(num_buffers <= max_buffers);
+
+    struct iovec *iov = New(num_buffers, struct iovec, client->context);
+
+    while (*num_bytes_sent < full_size) {
+        // Fill out the iovecs with whatever we haven't sent yet, up to the first file.
+        s64        num_iovecs  = 0;
+        File_node *file        = NULL;
+        s64        file_offset = 0;
+        s64        skip        = *num_bytes_sent;
+
+        for (s64 i = 0; i < num_buffers && num_iovecs < UIO_MAXIOV; i++) {
+            s64 size = buffers[i].iov_len;
 
-            data_to_send      = response->body + body_sent;
-            num_bytes_to_send = response->size - body_sent;
+            if (skip >= size) {
+                skip -= size;
+                continue;
+            }
+            if (files[i]) {
+                file        = files[i];
+                file_offset = skip;
+                break;
+            }
+            iov[num_iovecs].iov_base = (u8 *)buffers[i].iov_base + skip;
+            iov[num_iovecs].iov_len  = size - skip;
+            num_iovecs += 1;
+            skip = 0;
         }
-        assert(data_to_send);
-        assert(num_bytes_to_send > 0);
+        assert(num_iovecs > 0 || file);
 
-        int flags = MSG_NOSIGNAL;
-        s64 send_count = send(client->socket, data_to_send, num_bytes_to_send, flags);
+        s64 send_count;
+        if (num_iovecs) {
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = num_iovecs};
+
+            int flags = MSG_NOSIGNAL;
+            if (file)  flags |= MSG_MORE; // Let the kernel put the start of the file in the same packet.
+
+            send_count = sendmsg(client->socket, &msg, flags);
+        } else {
+            off_t offset = file_offset;
+            send_count = sendfile(client->socket, get_file_handle(file), &offset, file->size - file_offset);
+
+            if (send_count == 0) {
+                // The file must have shrunk since we read the file tree. We've already promised the client a
+                // content-length, so all we can do is hang up.
+                log_error("The file %s is shorter than we thought.", file->path.data);
+                client->phase = READY_TO_CLOSE;
+                return false;
+            }
+        }
         if (send_count < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)  break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // From now on the client is what's holding us up, so start timing it.
+                if (!client->send_rate.start)  client->send_rate.start = get_monotonic_time();
+                break;
+            }
 
             log_error("We failed to send to a client socket (%s).", get_last_error().string);
             client->phase = READY_TO_CLOSE;
@@ -414,16 +472,82 @@ static bool send_reply(Client *client)
         assert(send_count > 0);
 
         *num_bytes_sent += send_count;
+        if (client->send_rate.start)  client->send_rate.num_bytes += send_count;
+
+        add_to_metric(client->server->metrics, client->server->metric_ids.bytes_sent, send_count);
     }
 
-    // Return false if we've partially sent our reply.
-    if (*num_bytes_sent < full_reply_size)  return false;
+    dealloc(iov, client->context);
+    dealloc(files, client->context);
+    dealloc(buffers, client->context);
+
+    // Return false if we've partially sent our replies. If the client has been taking them too slowly, give up on it,
+    // so that it doesn't keep the replies in memory for as long as it likes.
+    if (*num_bytes_sent < full_size) {
+        if (is_too_slow(client->send_rate.num_bytes, client->send_rate.start, client->server->min_send_rate)) {
+            add_to_metric(client->server->metrics, client->server->metric_ids.slow_sends, 1);
+            client->phase = READY_TO_CLOSE;
+        }
+        return false;
+    }
 
-    // We've fully sent our reply. Success!
-    assert(*num_bytes_sent == full_reply_size);
+    // We've fully sent our replies. Success!
+    assert(*num_bytes_sent == full_size);
     return true;
 }
 
+static void stop_stream(Client *client, Response *response)
+// We won't send the rest of a streamed response, e.g. because the client hung up. Call the streamer one last time
+// with the request cancelled, so it can let go of anything it holds outside the client's context. See Response.stream.
+{
+    client->cancelled = true;
+
+    u8_array discard = {.context = client->context};
+    (*response->stream)(client, response->stream_data, &discard);
+}
+
+static void release_replies(Client *client)
+// Let go of anything the queued replies refer to outside the client's context. Call this before the client's
+// context is reset or freed.
+{
+    for (s64 i = 0; i < client->replies.count; i++) {
+        Reply    *reply    = &client->replies.data[i];
+        Response *response = &reply->response;
+
+        if (response->stream && !reply->finished)  stop_stream(client, response);
+
+        if (response->file_tree) {
+            bool should_clean_up = release_file_tree(response->file_tree);
+            if (should_clean_up)  free_file_tree_resource(response->file_tree);
+
+            response->file_tree = NULL;
+        }
+
+        release_segments(response);
+    }
+}
+
+static void init_request(Client *client)
+// Reset the fields that describe the current request, ready to parse the next one.
+{
+    Memory_context *context = client->context;
+
+    client->request_size         = 0;
+
+    client->request              = (Request){0};
+    client->request.path         = (char_array){.context = context};
+    client->request.query_params = (string_dict){.context = context};
+
+    client->route                = NULL;
+    client->route_match          = NULL;
+
+    client->response             = (Response){0};
+    client->response.headers     = (string_dict){.context = context};
+
+    // We leave client->http_version and client->keep_alive alone until we've received the whole of the next request,
+    // because they still describe the last request we parsed.
+}
+
 static void init_client(Server *server, Client *client, Memory_context *context, s32 socket, s64 start_time)
 {
     *client                   = (Client){0};
@@ -434,27 +558,120 @@ static void init_client(Server *server, Client *client, Memory_context *context,
     client->socket            = socket;
     client->phase             = PARSING_REQUEST;
 
+    client->timer.data        = client;
+
     client->message           = (char_array){.context = context};
-    client->crlf_offsets      = (s16_array){.context = context};
+    client->replies           = (Reply_array){.context = context};
 
-    client->request.path      = (char_array){.context = context};
-    client->request.query_params = (string_dict){.context = context};
+    init_request(client);
+}
+
+//
+// Rather than free a client when we close its connection, we reset its context and put it in a pool, so the next
+// connection can have it. The context keeps its buffers, so a new connection usually costs no allocator work at all,
+// and in particular doesn't take the lock on the server's context. The main thread has a pool, and each reactor has
+// its own. Only the pool's owner may touch it.
+//
+#define CLIENT_POOL_SIZE            256             // The most closed clients a pool holds on to.
+#define CLIENT_POOL_MAX_RETAINED    (64*1024)       // We free rather than pool a client whose context has grown beyond this many bytes.
+
+static Client *take_client(Client_pool *pool)
+// Return a closed client from the pool, or a new one if the pool is empty. Either way, the caller should pass it
+// to init_client() along with client->context.
+{
+    Client *client = pool->first;
+
+    if (client) {
+        pool->first  = client->next_in_pool;
+        pool->count -= 1;
+    } else {
+        client = New(Client, pool->context);
+        client->context = new_context(pool->context);
+    }
+
+    return client;
+}
+
+static void give_back_client(Client_pool *pool, Client *client)
+// Put a client we've finished with in the pool, unless the pool is full or the client's context has got too big.
+{
+    if (pool->count >= CLIENT_POOL_SIZE || get_context_size(client->context) > CLIENT_POOL_MAX_RETAINED) {
+        free_context(client->context);
+        dealloc(client, pool->context);
+        return;
+    }
+
+    reset_context(client->context);
+
+    client->next_in_pool = pool->first;
+    pool->first          = client;
+    pool->count         += 1;
+}
+
+static bool admit_connection(Server *server, s32 socket, u32 address)
+// Count a new connection against Server.max_connections_per_ip. If its address already has as many connections as
+// we allow, close it and return false. The counts are shared by every thread that accepts connections, so the limit
+// holds for the whole server, however many reactors the connections land on.
+{
+    if (!server->max_connections_per_ip)  return true;
+
+    pthread_mutex_lock(&server->connections_per_ip.mutex);
 
-    client->response.headers  = (string_dict){.context = context};
+    s32  count    = *Get(&server->connections_per_ip.counts, address);
+    bool admitted = (count < server->max_connections_per_ip);
+    if (admitted)  *Set(&server->connections_per_ip.counts, address) = count + 1;
 
-    client->reply_header      = (char_array){.context = context};
+    pthread_mutex_unlock(&server->connections_per_ip.mutex);
+
+    if (!admitted) {
+        close(socket);
+        add_to_metric(server->metrics, server->metric_ids.connections_rejected, 1);
+    }
+
+    return admitted;
+}
+
+static void release_connection(Server *server, u32 address)
+// Undo admit_connection() when we close a connection. We only keep addresses with open connections, so the map stays
+// as small as it can.
+{
+    if (!server->max_connections_per_ip)  return;
+
+    pthread_mutex_lock(&server->connections_per_ip.mutex);
+
+    s32 count = *Get(&server->connections_per_ip.counts, address);
+    assert(count > 0);
+
+    if (count == 1)  Delete(&server->connections_per_ip.counts, address);
+    else             *Set(&server->connections_per_ip.counts, address) = count - 1;
+
+    pthread_mutex_unlock(&server->connections_per_ip.mutex);
 }
 
+static void give_up_turn(Client *client);
+
 static void close_and_delete_client(Server *server, Client *client)
 {
+    cancel_timer(&server->timers, &client->timer);
+
+    // A client streaming a reply keeps its turn until the reply has gone. If it's closed first, pass the turn on.
+    if (client->admission.has_turn)  give_up_turn(client);
+
+    // Closing the socket also removes it from the epoll interest list.
     int r = close(client->socket);
     if (r == -1) {
         Fatal("We couldn't close a client socket (%s).", get_last_error().string);
     }
 
+    release_replies(client);
+    if (client->trace)  discard_trace(client->trace);
+
+    add_to_metric(server->metrics, server->metric_ids.open_connections, -1);
+    release_connection(server, client->address);
+
     Delete(&server->clients, client->socket);
-    free_context(client->context);
-    dealloc(client, server->context);
+    Delete(&server->watched_clients, client->socket);
+    give_back_client(&server->client_pool, client);
 }
 
 static char_array *encode_query_string(string_dict *query, Memory_context *context)
@@ -496,489 +713,3652 @@ static char_array *encode_query_string(string_dict *query, Memory_context *conte
     return result;
 }
 
-void refresh_file_tree(File_tree_accessor *accessor); //|Temporary: Until we put the File_tree_accessor stuff into its own module.
 
-static void *worker_thread_routine(void *arg)
-// The worker thread's main loop.
+static bool accepts_encoding(Request *request, char *encoding)
+// Check whether the request's accept-encoding headers list an encoding without ruling it out with q=0.
 {
-    Server *server = arg;
-    Task_queue *queue = server->task_queue;
-
-    while (true)
-    {
-        Task task = pop_queue(queue);
-
-        if (task.type == TIME_TO_WIND_UP)  break;
-
-        if (task.type == REFRESH_FILE_TREE) {
-            refresh_file_tree(task.file_tree_accessor);
-            continue;
-        }
-
-        assert(task.type == DEAL_WITH_A_CLIENT); //|Cleanup: From here to the end of the loop should be its own function.
-        Client *client = task.client;
-
-        if (client->phase == PARSING_REQUEST) {
-            bool received = receive_message(client);
-
-            if (received)  parse_request(client); //|Cleanup: We don't use the return value now, so maybe change the parse_request() function signature.
-        }
-
-        if (client->phase == HANDLING_REQUEST) {
-            Request_handler *handler = find_request_handler(server, client);
-            if (!handler)  handler = &serve_404;
-
-            // Run the handler.
-            client->response = (*handler)(client);
-            assert(client->response.status);
+    s64 length = strlen(encoding);
 
-            client->phase = SENDING_REPLY;
-        }
+    Header *header = NULL;
+    while ((header = get_header(request, "accept-encoding", header))) {
+        char *item = header->value;
+        char *end  = header->value + header->value_size;
 
-        if (client->phase == SENDING_REPLY) {
-            if (!client->reply_header.count)  print_response_headers(client);
+        while (item < end) {
+            while (item < end && (*item == ' ' || *item == '\t'))  item += 1;
 
-            bool success = send_reply(client);
+            char *item_end = item;
+            while (item_end < end && *item_end != ',')  item_end += 1;
 
-            if (success) {
-                s64 current_time = get_monotonic_time();
+            char *name_end = item;
+            while (name_end < item_end && !Contains("; \t", *name_end))  name_end += 1;
 
-                { // |Cleanup: This logging bit in general.
-                    Memory_context *ctx = client->context;
-                    Request *req = &client->request;
-                    char *method = req->method == GET ? "GET" : req->method == POST ? "POST" : "UNKNOWN!!";
-                    char *path   = req->path.count ? req->path.data : "";
-                    char *query  = req->query_params.count ? encode_query_string(&req->query_params, ctx)->data : "";
-                    s64 ms = current_time - client->start_time; //|Fixme: The fact that we use the client->start_time here results in inaccurate logging about how long requests take, because browsers leave connections open for a long time in between requests. Instead we should be using the time when we received the first byte of the request.
-                    printf("[%d] %s %s%s %ldms\n", client->response.status, method, path, query, ms);
-                    fflush(stdout);
-                }
+            if (name_end - item == length && !memcmp(item, encoding, length)) {
+                // Look through the parameters for a quality value.
+                double quality = 1;
+                for (char *param = name_end; param < item_end; param += 1) {
+                    if (*param != ';')  continue;
 
-                if (client->keep_alive) {
-                    // Reset the client and prepare to receive more data on the socket.
-                    reset_context(client->context);
-                    init_client(server, client, client->context, client->socket, current_time);
-                } else {
-                    client->phase = READY_TO_CLOSE;
+                    char *q = param+1;
+                    while (q < item_end && (*q == ' ' || *q == '\t'))  q += 1;
+                    if (item_end - q > 2 && starts_with(q, "q="))  quality = strtod(q+2, NULL);
                 }
+                return quality > 0;
             }
-        }
-
-        if (client->phase == READY_TO_CLOSE) {
-            // Do nothing. The main thread will close the client socket and free memory.
-        }
 
-        // Write the client pointer to the worker pipe to let the server know we're done with it.
-        {
-            s64 num_bytes_written = write(server->worker_pipe[1], &client, sizeof(client));
-            if (num_bytes_written == -1) {
-                Fatal("We couldn't write to the worker pipe (%s).", get_last_error().string);
-            } //|Todo: Repeat if we were interrupted before writing the full thing?
+            item = item_end + 1;
         }
     }
 
-    return NULL;
+    return false;
 }
 
-Server *create_server(u32 address, u16 port, Memory_context *context)
+static void encode_shared_response(Client *client, enum Compression_format format, char *encoding);
+
+static Compressor *compress_response(Client *client)
+// If the client's route asks for compression and the client accepts it, replace the response body with a compressed
+// copy. We prefer brotli to gzip because it's smaller at the same speed. If the response is streamed, we can't compress
+// the body yet, so instead return a Compressor for the stream. Otherwise return NULL. If the response is shared, we
+// only compress it if no other client has wanted the same encoding before.
 {
-    Server *server = New(Server, context);
+    Response *response = &client->response;
+    Route    *route    = client->route;
 
-    server->context = context;
-    server->address = address;
-    server->port    = port;
+    if (!route || !route->options.compression_level)  return NULL;
+    if (response->status != 200)                      return NULL;
 
-    server->socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server->socket < 0) {
-        Fatal("Couldn't get a socket (%s).", get_last_error().string);
+    if (!response->stream) {
+        if (response->file)                                             return NULL;
+        if (!response->body && !response->segments.count)               return NULL;
+        if (response->size < client->server->min_compression_size)     return NULL;
     }
 
-    // Set SO_REUSEADDR because we want to run this program frequently during development.
-    // Otherwise the kernel holds onto our address/port combo after our program finishes.
-    int r = setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
-    if (r < 0) {
-        Fatal("Couldn't set socket options (%s).", get_last_error().string);
-    }
+    if (!response->headers.context)  response->headers = (string_dict){.context = client->context};
 
-    set_blocking(server->socket, false);
+    if (IsSet(&response->headers, "content-encoding"))  return NULL; // The handler has encoded the body itself.
 
-    struct sockaddr_in socket_addr = {
-        .sin_family   = AF_INET,
-        .sin_port     = htons(server->port),
-        .sin_addr     = {htonl(server->address)},
-    };
+    // Whether or not this client gets a compressed body, the response depends on accept-encoding.
+    *Set(&response->headers, "vary") = "accept-encoding";
 
-    r = bind(server->socket, (struct sockaddr const *)&socket_addr, sizeof(socket_addr));
-    if (r < 0) {
-        Fatal("Couldn't bind socket (%s).", get_last_error().string);
-    }
+    int level = route->options.compression_level; // Brotli's quality goes up to 11, but 1-9 mean roughly the same as gzip's levels.
 
-    int QUEUE_LENGTH = 32;
-    r = listen(server->socket, QUEUE_LENGTH);
-    if (r < 0) {
-        Fatal("Couldn't listen on socket (%s).", get_last_error().string);
-    }
+    enum Compression_format format;
+    char *encoding;
 
-    printf("Listening on http://%d.%d.%d.%d:%d...\n", address>>24, address>>16&0xff, address>>8&0xff, address&0xff, port);
+    if (accepts_encoding(&client->request, "br")) {
+        format   = BROTLI;
+        encoding = "br";
+    } else if (accepts_encoding(&client->request, "gzip")) {
+        format   = GZIP;
+        encoding = "gzip";
+    } else {
+        return NULL;
+    }
 
-    // Create a file descriptor to handle SIGINT.
-    sigset_t signal_mask;
-    sigemptyset(&signal_mask);
-    sigaddset(&signal_mask, SIGINT);
+    if (response->stream) {
+        Compressor *compressor = create_compressor(format, level, client->context);
+        if (compressor)  *Set(&response->headers, "content-encoding") = encoding;
 
-    r = pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
-    if (r) {
-        Fatal("Couldn't mask SIGINT (%s).", get_error_info(r).string);
+        return compressor;
     }
 
-    server->interrupt_handle = signalfd(-1, &signal_mask, SFD_NONBLOCK);
-    if (server->interrupt_handle == -1) {
-        Fatal("Couldn't create a file descriptor to handle SIGINT (%s).", get_last_error().string);
+    if (client->shared_response) {
+        encode_shared_response(client, format, encoding);
+        return NULL;
     }
 
-    server->routes = (Route_array){.context = context};
-
-    server->clients = (Client_map){.context = context, .binary_mode = true};
+    void *body = response->body;
 
-    server->task_queue = create_queue(context);
+    if (response->segments.count == 1) {
+        body = response->segments.data[0].data; // No need to copy.
+    } else if (response->segments.count > 1) {
+        // Join the segments up. The compressor has to read every byte anyway, so the copy costs little in comparison.
+        // Whether or not compression pays off, we send the joined copy instead of the segments from now on.
+        u8_array joined = {.context = client->context};
+        array_reserve(&joined, response->size);
 
-    server->worker_threads = (pthread_t_array){.context = context};
-    int NUM_WORKER_THREADS = 4; //|Todo: Make this configurable or find out how many processors the computer has.
-    for (int i = 0; i < NUM_WORKER_THREADS; i++) {
-        int r = pthread_create(Add(&server->worker_threads), NULL, worker_thread_routine, server);
-        if (r) {
-            Fatal("Thread creation failed (%s).", get_error_info(r).string);
+        for (s64 i = 0; i < response->segments.count; i++) {
+            Body_segment *segment = &response->segments.data[i];
+            memcpy(joined.data + joined.count, segment->data, segment->size);
+            joined.count += segment->size;
         }
+        assert(joined.count == response->size);
+
+        release_segments(response);
+        response->segments.count = 0;
+
+        body = response->body = joined.data;
     }
 
-    r = pipe(server->worker_pipe);
-    if (r == -1) { //|Consistency: (== -1) or (< 0)?
-        Fatal("Couldn't create a pipe (%s).", get_last_error().string);
+    u8_array *compressed = NULL;
+    if (format == BROTLI)  compressed = brotli_compress(body, response->size, level, client->context);
+    else                   compressed = gzip_compress(body, response->size, level, client->context);
+
+    if (compressed && compressed->count < response->size) {
+        release_segments(response);
+        response->segments.count = 0;
+
+        response->body = compressed->data;
+        response->size = compressed->count;
+        *Set(&response->headers, "content-encoding") = encoding;
     }
 
-    return server;
+    return NULL;
 }
 
-void add_route(Server *server, enum HTTP_method method, char *path_pattern, Request_handler *handler)
+static void collect_stream(Client *client)
+// Turn a streamed response into a normal one by running the streamer to the end. We do this for HTTP/1.0 clients,
+// which don't understand chunked encoding.
 {
-    //|Todo: Check the server phase. You can't add routes once the server's started.
+    Response *response = &client->response;
 
-    Regex *regex = compile_regex(path_pattern, server->context);
-    assert(regex);
+    u8_array body = {.context = client->context};
+    while ((*response->stream)(client, response->stream_data, &body)) {}
 
-    *Add(&server->routes) = (Route){method, regex, handler};
+    response->body   = body.data;
+    response->size   = body.count;
+    response->stream = NULL;
 }
 
-#ifndef FILE_TREE_STUFF_WHICH_WE_WILL_PROBABLY_PUT_INTO_ITS_OWN_MODULE
-//typedef struct File_tree_accessor File_tree_accessor;
-typedef struct File_tree_resource File_tree_resource;
-
-struct File_tree_accessor {
-    Memory_context     *context;
+static int compare_strings(void const *a, void const *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
 
-    char               *directory;
+static char *get_request_key(Client *client, bool with_query)
+// Identify a request by its method, path and (if with_query) query string, for sharing responses between requests.
+// We sort the query parameters by name, so that ?x0=1&y0=2 and ?y0=2&x0=1 share a response.
+{
+    Request        *request = &client->request;
+    Memory_context *ctx     = client->context;
+
+    char *query = "";
+    if (with_query && request->query_params.count) {
+        string_dict *params = &request->query_params;
+
+        string_array names = {.context = ctx};
+        for (s64 i = 0; i < params->count; i++)  *Add(&names) = params->keys[i];
+
+        qsort_array(&names, compare_strings);
+
+        string_dict sorted = {.context = ctx};
+        for (s64 i = 0; i < names.count; i++)  *Set(&sorted, names.data[i]) = *Get(params, names.data[i]);
+
+        query = encode_query_string(&sorted, ctx)->data;
+    }
+
+    return get_string(ctx, "%d %s%s", request->method, request->path.data, query).data;
+}
+
+static string_dict copy_string_dict(string_dict *dict, Memory_context *context)
+{
+    string_dict result = {.context = context};
+
+    for (s64 i = 0; i < dict->count; i++) {
+        char *value = dict->vals[i];
+        *Set(&result, dict->keys[i]) = copy_string(value, strlen(value), context).data;
+    }
+
+    return result;
+}
+
+static void collect_body(Client *client, Response *response, u8_array *out)
+// Append a response's whole body to an array, whether it's a stream, segments or one buffer. Release its segments.
+{
+    assert(!response->file);
+
+    if (response->stream) {
+        while ((*response->stream)(client, response->stream_data, out)) {}
+    } else if (response->segments.count) {
+        for (s64 i = 0; i < response->segments.count; i++) {
+            Body_segment *segment = &response->segments.data[i];
+
+            array_reserve(out, out->count + segment->size);
+            memcpy(out->data + out->count, segment->data, segment->size);
+            out->count += segment->size;
+        }
+        release_segments(response);
+        response->segments.count = 0;
+    } else if (response->size) {
+        array_reserve(out, out->count + response->size);
+        memcpy(out->data + out->count, response->body, response->size);
+        out->count += response->size;
+    }
+}
+
+//
+// Shared responses. When several clients get the same response, by waiting for an identical request or from the
+// response cache, they share a Shared_response. It keeps the body in each encoding a client has asked for, so we
+// compress it once for each encoding rather than once for each client. See encode_shared_response().
+//
+struct Shared_response {
+    Memory_context     *context;        // Contains the struct itself and .headers.
+    int                 num_refs;       // Only modify this atomically.
 
+    int                 status;
+    string_dict         headers;
+
+    // The mutex protects the encodings. We don't compress while holding it, so two clients can end up compressing
+    // the body at the same time, in which case the second one to finish throws its copy away.
     pthread_mutex_t     mutex;
-    File_tree_resource *resource;
+    Shared_buffer      *identity;
+    Shared_buffer      *gzip;           // NULL until a client wants it. If compressing didn't make the body smaller, the same as .identity.
+    Shared_buffer      *brotli;         // Likewise.
 };
 
-struct File_tree_resource {
-    // A child context of the accessor's context. It contains everything to do with
-    // this resource including the resource struct itself.
-    Memory_context     *context;
+static Shared_response *create_shared_response(Client *client, Response *response)
+// Make a shared response from a handler's response, with one reference, which belongs to the caller. We move the body
+// out of the handler's response, so don't use it afterwards.
+{
+    Memory_context *context = new_context(NULL);
 
-    struct {
-        pthread_mutex_t     mutex;
-        int                 value;
-    }                   num_refs;
+    Shared_response *shared = New(Shared_response, context);
 
-    File_node          *file_tree;
-    s64                 time_created;
+    shared->context  = context;
+    shared->num_refs = 1;
+    shared->status   = response->status;
+    shared->headers  = copy_string_dict(&response->headers, context);
+    shared->identity = create_shared_buffer(NULL);
 
-    // The first thread to notice that a resource has expired sets update_pending = true
-    // to let other threads know that it is taking responsibility for the update.
-    struct {
-        pthread_mutex_t     mutex;
-        bool                value;
-    }                   update_pending;
+    pthread_mutex_init(&shared->mutex, NULL);
+
+    collect_body(client, response, &shared->identity->bytes);
+
+    return shared;
+}
+
+static void retain_shared_response(Shared_response *shared)
+{
+    __atomic_add_fetch(&shared->num_refs, 1, __ATOMIC_RELAXED);
+}
+
+static void release_shared_response(Shared_response *shared)
+// Once every reference is released, free the shared response. Clients still sending its body hold their own
+// references to the buffers, so those live on.
+{
+    int num_refs = __atomic_sub_fetch(&shared->num_refs, 1, __ATOMIC_ACQ_REL);
+    if (num_refs)  return;
+
+    // Each encoding holds a reference to its buffer, even when it's the identity buffer.
+    if (shared->gzip)    release_shared_buffer(shared->gzip);
+    if (shared->brotli)  release_shared_buffer(shared->brotli);
+    release_shared_buffer(shared->identity);
+
+    pthread_mutex_destroy(&shared->mutex);
+    free_context(shared->context);
+}
+
+static Response make_shared_response(Client *client, Shared_response *shared)
+// Make a response for a client from a shared one, and remember where it came from in client->shared_response, so
+// that compress_response() can reuse the encodings other clients have made. The body becomes a segment that holds a
+// reference to the identity buffer, so we don't copy it.
+{
+    assert(!client->shared_response);
+
+    retain_shared_response(shared);
+    client->shared_response = shared;
+
+    Response response = {shared->status};
+
+    response.headers = copy_string_dict(&shared->headers, client->context);
+
+    Shared_buffer *body = shared->identity;
+    if (body->bytes.count)  add_body_segment(client, &response, body->bytes.data, body->bytes.count, body);
+
+    return response;
+}
+
+static void drop_shared_response(Client *client)
+// Let go of the shared response the client's response came from, if any. The body segments keep what we're sending.
+{
+    if (!client->shared_response)  return;
+
+    release_shared_response(client->shared_response);
+    client->shared_response = NULL;
+}
+
+static void encode_shared_response(Client *client, enum Compression_format format, char *encoding)
+// Replace the body of a client's shared response with the encoding the client wants. If no one has wanted that
+// encoding before, compress the body and keep the result for the clients after us.
+{
+    Shared_response *shared   = client->shared_response;
+    Response        *response = &client->response;
+
+    Shared_buffer **encoded = (format == BROTLI) ? &shared->brotli : &shared->gzip;
+    Shared_buffer  *body    = NULL;
+
+    pthread_mutex_lock(&shared->mutex);
+    {
+        body = *encoded;
+        if (body)  retain_shared_buffer(body);
+    }
+    pthread_mutex_unlock(&shared->mutex);
+
+    if (!body) {
+        u8_array *identity = &shared->identity->bytes;
+        int       level    = client->route->options.compression_level;
+
+        body = create_shared_buffer(NULL);
+
+        u8_array *compressed = NULL;
+        if (format == BROTLI)  compressed = brotli_compress(identity->data, identity->count, level, body->context);
+        else                   compressed = gzip_compress(identity->data, identity->count, level, body->context);
+
+        if (compressed && compressed->count < identity->count) {
+            body->bytes = *compressed;
+        } else {
+            release_shared_buffer(body);
+            body = shared->identity;
+            retain_shared_buffer(body);
+        }
+
+        pthread_mutex_lock(&shared->mutex);
+        {
+            if (*encoded) {
+                // Another client got there first.
+                release_shared_buffer(body);
+                body = *encoded;
+            } else {
+                *encoded = body;
+            }
+            retain_shared_buffer(body);
+        }
+        pthread_mutex_unlock(&shared->mutex);
+    }
+
+    if (body != shared->identity) {
+        release_segments(response);
+        response->segments.count = 0;
+        response->size           = 0;
+
+        add_body_segment(client, response, body->bytes.data, body->bytes.count, body);
+        *Set(&response->headers, "content-encoding") = encoding;
+    }
+
+    release_shared_buffer(body);
+}
+
+struct Flight {
+    // A request on a .coalesce route that we're handling right now, and that identical requests can wait on.
+    Memory_context         *context;        // Contains the struct itself.
+    Shared_response        *response;       // The leader's response, once the flight is done. The flight holds a reference to it.
+    char                   *key;            // In the leader's context, so only use it while the leader is running the handler or its stream.
+
+    // These are protected by server->flights.mutex.
+    bool                    done;
+    Client                 *followers;      // The clients parked on the flight, linked by client.coalescing.next. See park_follower().
+    int                     num_refs;       // One for the leader, plus one for each follower, including those that haven't parked yet.
+
+    // If the handler streams its body, the flight is done as soon as the handler returns, and the followers share the
+    // stream as the leader makes it. See lead_flight_stream(). These are protected by the mutex too.
+    bool                    streamed;
+    int                     status;         // The leader's response's status and headers. Only set if .streamed.
+    string_dict             headers;        // In .context.
+    u8_array                stream;         // What the leader's streamer has made so far. In .context.
+    bool                    finished;       // The leader's streamer has finished, so .stream is the whole body.
+    bool                    failed;         // The leader went away before its streamer finished.
 };
 
-File_tree_resource *acquire_file_tree(File_tree_accessor *accessor)
+typedef struct Flight_cursor Flight_cursor;
+struct Flight_cursor {
+    // The stream_data of a streamed response from a flight. See lead_flight_stream() and follow_flight_stream().
+    Flight                 *flight;         // NULL once we've let go of the flight.
+    Body_streamer          *stream;         // The leader's own streamer, which the leader's cursor wraps.
+    void                   *stream_data;
+    s64                     offset;         // How much of flight.stream a follower has passed on so far.
+};
+
+static void wake_reactor_client(Client *client);
+
+static void wake_client(Client *client)
+// Send a parked client to be dealt with again: to a worker, or in reactor mode, to its own reactor.
+{
+    Server *server = client->server;
+
+    if (server->use_reactors)  wake_reactor_client(client);
+    else                       push_task(server->scheduler, (Task){DEAL_WITH_A_CLIENT, .client=client});
+}
+
+static void leave_flight(Client *client, Flight *flight)
+// Let go of a flight. The last one out frees it.
+{
+    Server *server   = client->server;
+    bool    last_one = false;
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        flight->num_refs -= 1;
+        last_one = (flight->num_refs == 0);
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    if (last_one) {
+        if (flight->response)  release_shared_response(flight->response);
+        free_context(flight->context);
+    }
+}
+
+static void wake_followers(Client *followers)
+{
+    while (followers) {
+        Client *next = followers->coalescing.next;
+        wake_client(followers);
+        followers = next;
+    }
+}
+
+static void publish_to_flight(Client *client, Flight *flight, u8 *data, s64 size, bool finished, bool failed)
+// Add a piece the leader's streamer has made to a streamed flight, and wake the followers to pass it on. Once the
+// stream has finished or failed, take the flight out of the dict, so that the next identical request starts afresh.
+{
+    Server *server    = client->server;
+    Client *followers = NULL;
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        if (size) {
+            array_reserve(&flight->stream, round_up_pow2(flight->stream.count + size));
+            memcpy(flight->stream.data + flight->stream.count, data, size);
+            flight->stream.count += size;
+        }
+
+        flight->finished = finished;
+        flight->failed   = failed;
+
+        // If our client hung up, is_request_cancelled() may have taken the flight out of the dict already.
+        if ((finished || failed) && *Get(&server->flights.dict, flight->key) == flight) {
+            Delete(&server->flights.dict, flight->key);
+        }
+
+        followers         = flight->followers;
+        flight->followers = NULL;
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    wake_followers(followers);
+}
+
+static bool lead_flight_stream(Client *client, void *data, u8_array *out)
+// The leader's streamer for a streamed flight. Run the handler's streamer, and publish each piece it makes to the
+// followers as well as sending it to our own client. If we stop early, the followers' replies end early too.
+{
+    Flight_cursor *cursor = data;
+    Flight        *flight = cursor->flight;
+
+    s64  start = out->count;
+    bool more  = (*cursor->stream)(client, cursor->stream_data, out);
+
+    // If the streamer stopped because our client hung up, the body is incomplete.
+    bool failed = client->cancelled;
+
+    publish_to_flight(client, flight, out->data + start, out->count - start, !more && !failed, failed);
+
+    if (!more || failed) {
+        client->coalescing.leading = NULL;
+        cursor->flight = NULL;
+        leave_flight(client, flight);
+    }
+
+    return more && !failed;
+}
+
+static bool follow_flight_stream(Client *client, void *data, u8_array *out)
+// A follower's streamer for a streamed flight. Pass on whatever the leader has made since we last looked, which may
+// be nothing. If so, advance_client() parks the client until the leader makes more. See park_follower(). If the
+// leader went away part way, we can't finish the body, so we give up as if our own client had hung up.
+{
+    Server        *server = client->server;
+    Flight_cursor *cursor = data;
+    Flight        *flight = cursor->flight;
+    bool           more   = true;
+
+    if (client->cancelled) {
+        // We're stopping early. See stop_stream().
+        cursor->flight = NULL;
+        leave_flight(client, flight);
+        return false;
+    }
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        s64 num_bytes = flight->stream.count - cursor->offset;
+
+        if (num_bytes) {
+            array_reserve(out, round_up_pow2(out->count + num_bytes));
+            memcpy(out->data + out->count, flight->stream.data + cursor->offset, num_bytes);
+            out->count     += num_bytes;
+            cursor->offset += num_bytes;
+        }
+
+        if (flight->failed) {
+            client->cancelled = true;
+            more = false;
+        } else if (flight->finished) {
+            more = false;
+        }
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    if (!more) {
+        cursor->flight = NULL;
+        leave_flight(client, flight);
+    }
+
+    return more;
+}
+
+static bool has_more_to_follow(Flight *flight, Flight_cursor *cursor)
+// Check whether a follower's streamer has anything to do: pass on more of the stream, or end it. Only call this while
+// holding server->flights.mutex.
+{
+    return cursor->offset < flight->stream.count || flight->finished || flight->failed;
+}
+
+static bool can_follow_stream(Client *client, Flight_cursor *cursor)
+{
+    Server *server = client->server;
+    bool    result = false;
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        result = has_more_to_follow(cursor->flight, cursor);
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    return result;
+}
+
+static Response coalesce_request(Client *client, Request_handler *handler)
+// Run the handler, unless we're already handling an identical request. In that case, set the client
+// WAITING_FOR_FLIGHT and return an empty response. Once the thread dealing with the client has let go of it,
+// park_follower() adds it to the flight's followers, without tying up the thread. When the handler finishes, the
+// leader wakes the followers, which come back here with the flight in client.coalescing.following and share its
+// response.
+//
+// If the handler streams its body, the followers share the stream instead, piece by piece as the leader's streamer
+// makes it. See lead_flight_stream(). The flight stays in the dict until the stream has finished, and keeps
+// everything the streamer has made, so a request that arrives part way starts from the beginning. The followers go
+// at the pace of the leader's client, and if the leader's client goes away before the stream has finished, the
+// followers' replies end early, as the leader's does.
+{
+    Server *server = client->server;
+    Flight *flight = client->coalescing.following;
+
+    if (!flight) {
+        char *key    = get_request_key(client, true);
+        bool  leader = false;
+
+        pthread_mutex_lock(&server->flights.mutex);
+        {
+            flight = *Get(&server->flights.dict, key);
+
+            if (flight && client->socket < 0) {
+                // It's a revalidation client, which has no socket to park, so it runs the handler alone.
+                flight = NULL;
+            } else if (flight) {
+                flight->num_refs += 1;
+            } else {
+                Memory_context *context = new_context(NULL);
+
+                flight = New(Flight, context);
+                flight->context  = context;
+                flight->key      = key;
+                flight->num_refs = 1;
+
+                *Set(&server->flights.dict, key) = flight;
+                leader = true;
+            }
+        }
+        pthread_mutex_unlock(&server->flights.mutex);
+
+        if (!flight)  return (*handler)(client);
+
+        if (!leader) {
+            client->coalescing.following = flight;
+            client->phase = WAITING_FOR_FLIGHT;
+            return (Response){0};
+        }
+
+        client->coalescing.leading = flight;
+
+        Response response = (*handler)(client);
+
+        if (response.stream) {
+            // Keep leading the flight until the stream has finished. We keep our reference to it in the cursor.
+            flight->streamed = true;
+            flight->status   = response.status;
+            flight->headers  = copy_string_dict(&response.headers, flight->context);
+            flight->stream   = (u8_array){.context = flight->context};
+
+            Flight_cursor *cursor = New(Flight_cursor, client->context);
+            cursor->flight      = flight;
+            cursor->stream      = response.stream;
+            cursor->stream_data = response.stream_data;
+
+            response.stream      = &lead_flight_stream;
+            response.stream_data = cursor;
+
+            Client *followers = NULL;
+
+            pthread_mutex_lock(&server->flights.mutex);
+            {
+                flight->done      = true;
+                followers         = flight->followers;
+                flight->followers = NULL;
+            }
+            pthread_mutex_unlock(&server->flights.mutex);
+
+            wake_followers(followers);
+
+            return response;
+        }
+
+        client->coalescing.leading = NULL;
+
+        Shared_response *shared    = create_shared_response(client, &response);
+        Client          *followers = NULL;
+
+        pthread_mutex_lock(&server->flights.mutex);
+        {
+            // If our client hung up, is_request_cancelled() has already taken the flight out of the dict, and someone
+            // else may have started a new one for the same key.
+            if (*Get(&server->flights.dict, key) == flight)  Delete(&server->flights.dict, key);
+
+            flight->response = shared; // The flight takes our reference.
+            flight->done     = true;
+            followers        = flight->followers;
+        }
+        pthread_mutex_unlock(&server->flights.mutex);
+
+        wake_followers(followers);
+    }
+
+    client->coalescing.following = NULL;
+
+    if (flight->streamed) {
+        // Follow the stream. Our reference to the flight goes to the cursor.
+        Flight_cursor *cursor = New(Flight_cursor, client->context);
+        cursor->flight = flight;
+
+        Response response = {flight->status};
+        response.headers     = copy_string_dict(&flight->headers, client->context);
+        response.stream      = &follow_flight_stream;
+        response.stream_data = cursor;
+
+        return response;
+    }
+
+    Response response = make_shared_response(client, flight->response);
+
+    leave_flight(client, flight);
+
+    return response;
+}
+
+static bool park_follower(Client *client)
+// Add a client to the followers of a flight. Return true if we did, in which case we must not touch the client again.
+// Return false if there's something for the client to do already, in which case it can carry on.
+//
+// A client WAITING_FOR_FLIGHT waits for the flight coalesce_request() found for it to be done. If the flight is
+// streamed, an HTTP/1.0 client waits for the whole stream, since we'd collect it anyway. See collect_stream(). A
+// client WAITING_FOR_STREAM is sending a streamed reply from a flight, and has passed on everything the leader has
+// made so far. It waits for the leader to make more.
+{
+    Server        *server = client->server;
+    Flight        *flight = client->coalescing.following;
+    Flight_cursor *cursor = NULL;
+    bool           parked = false;
+
+    if (client->phase == WAITING_FOR_STREAM) {
+        cursor = client->replies.data[client->replies.count-1].response.stream_data;
+        flight = cursor->flight;
+    }
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        bool ready = true;
+        if (cursor)                 ready = has_more_to_follow(flight, cursor);
+        else if (!flight->done)     ready = false;
+        else if (flight->streamed)  ready = (client->http_version == HTTP_VERSION_1_1 || flight->finished || flight->failed);
+
+        if (!ready) {
+            client->coalescing.next = flight->followers;
+            flight->followers       = client;
+            parked = true;
+        }
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    return parked;
+}
+
+static Response run_handler(Client *client, Request_handler *handler)
+{
+    if (client->route && client->route->options.coalesce)  return coalesce_request(client, handler);
+
+    return (*handler)(client);
+}
+
+bool is_request_cancelled(Client *client)
+// Return true if the client has hung up, in which case we won't send the response, so the handler can give up. This
+// is the cancellation token for handlers that do a lot of work, like drawing tiles: call it between steps. It costs
+// a system call, so not in a tight loop.
+//
+// If the client is leading a flight that other requests are waiting on, they still want the response, so we carry on.
+// Otherwise we take the flight out of the dict, so that no one joins it to get a half-finished response.
+{
+    if (client->cancelled)   return true;
+    if (client->socket < 0)  return false; // It's a revalidation client, so there's nobody to hang up.
+
+    struct pollfd poll_fd = {client->socket, POLLRDHUP};
+
+    int r = poll(&poll_fd, 1, 0);
+    if (r <= 0)  return false;
+
+    if (!(poll_fd.revents & (POLLRDHUP|POLLHUP|POLLERR)))  return false;
+
+    if (client->coalescing.leading) {
+        Server *server = client->server;
+        Flight *flight = client->coalescing.leading;
+
+        bool someone_is_waiting = false;
+
+        pthread_mutex_lock(&server->flights.mutex);
+        {
+            someone_is_waiting = (flight->num_refs > 1);
+            if (!someone_is_waiting)  Delete(&server->flights.dict, flight->key);
+        }
+        pthread_mutex_unlock(&server->flights.mutex);
+
+        if (someone_is_waiting)  return false;
+    }
+
+    client->cancelled = true;
+
+    return true;
+}
+
+static void record_route_phase(Server *server, Route *route, s32 phase, s64 microseconds)
+// Add a measurement to the histogram for a phase of a route. If route is NULL, the request didn't match one.
+{
+    s32 first_metric = route ? route->phase_metrics : server->metric_ids.unrouted_phases;
+
+    record_value(server->metrics, first_metric + phase, microseconds);
+}
+
+void record_phase(Client *client, s32 phase, s64 microseconds)
+// Add a measurement to the histogram for a phase of the client's route. The phase is a Builtin_phase or the ID that
+// add_phase() returned.
+{
+    assert(0 <= phase && phase < client->server->phase_names.count);
+
+    record_route_phase(client->server, client->route, phase, microseconds);
+}
+
+static void record_arrival(Client *client, s64 parse_start, s64 parse_end, s64 route_end)
+// Record the phases up to finding the request's route.
+{
+    Server *server = client->server;
+
+    if (!server->use_reactors)  record_phase(client, QUEUE_PHASE, client->timing.queue_wait);
+
+    // If the request arrived with the previous one, there's no telling how long it took to receive.
+    if (client->timing.first_byte)  record_phase(client, RECEIVE_PHASE, parse_start - client->timing.first_byte);
+
+    record_phase(client, PARSE_PHASE, parse_end - parse_start);
+    record_phase(client, ROUTE_PHASE, route_end - parse_end);
+
+    client->timing.queue_wait = 0;
+}
+
+//
+// The response cache. Routes opt in with Route_options.cache_ttl. All threads share one cache, which keeps the most
+// recently used responses up to a total of Server.response_cache_size bytes.
+//
+// Each entry is a Shared_response, so a hit costs a few reference counts and a copy of the headers, and the body stays
+// alive for the clients still sending it after the entry is evicted or replaced. We compress the body the first time
+// a client wants each encoding, and keep it in the entry for the next client, so a hit doesn't compress anything.
+// The entry's size grows with each encoding. We count that on the entry's next hit.
+//
+// When an entry is stale, the first thread to notice sets .update_pending and pushes a REVALIDATE_RESPONSE task,
+// just like serve_files() does when a file tree expires. Until the task replaces the entry, everyone keeps getting
+// the stale response.
+//
+typedef struct Cache_entry Cache_entry;
+typedef Dict(Cache_entry *) Cache_entry_dict;
+
+struct Cache_entry {
+    Memory_context     *context;        // A child of the cache's context. Contains the entry itself and .key.
+
+    Cache_entry        *newer;          // The entries form a list in order of when they were last used.
+    Cache_entry        *older;
+
+    char               *key;
+    Shared_response    *response;       // The entry holds one reference to this.
+    s64                 size;           // How many bytes we count this entry as using. See get_cache_entry_size().
+
+    s64                 time_created;
+    bool                update_pending;
+};
+
+struct Response_cache {
+    Memory_context     *context;
+
+    // The mutex protects everything below it, including the entries.
+    pthread_mutex_t     mutex;
+    Cache_entry_dict    entries;        // Keyed by get_request_key().
+    Cache_entry        *newest;
+    Cache_entry        *oldest;
+    s64                 total_size;
+};
+
+static Response_cache *create_response_cache(Memory_context *context)
+{
+    Response_cache *cache = New(Response_cache, context);
+
+    cache->context = new_context(context);
+    cache->entries = (Cache_entry_dict){.context = cache->context};
+
+    pthread_mutex_init(&cache->mutex, NULL);
+
+    return cache;
+}
+
+static void unlink_cache_entry(Response_cache *cache, Cache_entry *entry)
+// Take an entry out of the usage list. The caller must hold the cache's mutex.
+{
+    if (entry->newer)  entry->newer->older = entry->older;
+    else               cache->newest       = entry->older;
+
+    if (entry->older)  entry->older->newer = entry->newer;
+    else               cache->oldest       = entry->newer;
+
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void push_cache_entry(Response_cache *cache, Cache_entry *entry)
+// Put an entry at the front of the usage list. The caller must hold the cache's mutex.
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+
+    if (cache->newest)  cache->newest->newer = entry;
+    else                cache->oldest        = entry;
+
+    cache->newest = entry;
+}
+
+static void remove_cache_entry(Response_cache *cache, Cache_entry *entry)
+// Remove an entry from the cache and free it. The caller must hold the cache's mutex.
+{
+    unlink_cache_entry(cache, entry);
+    Delete(&cache->entries, entry->key);
+
+    cache->total_size -= entry->size;
+
+    release_shared_response(entry->response);
+    free_context(entry->context);
+}
+
+static s64 get_cache_entry_size(Shared_response *shared)
+// Count the body of a cached response in each encoding we've made so far, plus roughly what an entry costs besides.
+{
+    s64 HEADERS_SIZE = 512;
+
+    s64 size = HEADERS_SIZE + shared->identity->bytes.count;
+
+    pthread_mutex_lock(&shared->mutex);
+    {
+        if (shared->gzip && shared->gzip != shared->identity)      size += shared->gzip->bytes.count;
+        if (shared->brotli && shared->brotli != shared->identity)  size += shared->brotli->bytes.count;
+    }
+    pthread_mutex_unlock(&shared->mutex);
+
+    return size;
+}
+
+static void free_response_cache(Response_cache *cache)
+{
+    while (cache->newest)  remove_cache_entry(cache, cache->newest);
+
+    pthread_mutex_destroy(&cache->mutex);
+    free_context(cache->context);
+}
+
+static Client *create_revalidation_client(Client *client)
+// Make a copy of a client's request that a worker can run the route handler on later, in the background, after the
+// client has gone. The copy has no socket. It has its own context, which revalidate_response() frees.
+{
+    Memory_context *context = new_context(NULL);
+
+    Client *copy = New(Client, context);
+    init_client(client->server, copy, context, -1, get_monotonic_time());
+
+    Request *request = &client->request;
+
+    copy->phase                = HANDLING_REQUEST;
+    copy->http_version         = HTTP_VERSION_1_1;
+    copy->request.method       = request->method;
+    copy->request.path         = copy_string(request->path.data, request->path.count, context);
+    copy->request.query_params = copy_string_dict(&request->query_params, context);
+    copy->route                = client->route;
+    copy->route_match          = run_regex(copy->route->path_regex, copy->request.path.data, copy->request.path.count, context);
+
+    // We don't copy the request headers, because the cached response has to suit any client.
+
+    return copy;
+}
+
+static bool serve_from_cache(Client *client, char *key)
+// If we have a cached response for the client's request, make it the client's response and return true.
+// If the response is stale, schedule a revalidation, unless another thread already has.
+{
+    Server         *server  = client->server;
+    Response_cache *cache   = server->response_cache;
+    Route_options  *options = &client->route->options;
+
+    s64  current_time = get_monotonic_time();
+    bool hit          = false;
+    bool we_should_update = false;
+
+    pthread_mutex_lock(&cache->mutex);
+    {
+        Cache_entry *entry = *Get(&cache->entries, key);
+
+        if (entry) {
+            s64 age = current_time - entry->time_created;
+
+            if (age > options->cache_ttl + options->cache_stale_time) {
+                // It's too stale to use.
+                remove_cache_entry(cache, entry);
+            } else {
+                client->response = make_shared_response(client, entry->response);
+                hit = true;
+
+                if (age > options->cache_ttl && !entry->update_pending) {
+                    entry->update_pending = true;
+                    we_should_update = true;
+                }
+
+                unlink_cache_entry(cache, entry);
+                push_cache_entry(cache, entry);
+
+                // Count any encodings that clients have added since we last looked. That might put us over budget.
+                s64 size = get_cache_entry_size(entry->response);
+                cache->total_size += size - entry->size;
+                entry->size        = size;
+
+                while (cache->total_size > server->response_cache_size)  remove_cache_entry(cache, cache->oldest);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (we_should_update) {
+        Scheduler *scheduler = options->blocking ? server->blocking_scheduler : server->scheduler;
+        push_task(scheduler, (Task){REVALIDATE_RESPONSE, .client=create_revalidation_client(client)});
+    }
+
+    return hit;
+}
+
+static bool store_response(Client *client, char *key, bool replace)
+// Put the client's response in the cache if it's the kind we can cache. If it isn't already a shared response, move
+// it into one and point the client's response at that, so the client and the cache share it. If the cache already has
+// a fresh response for the key, keep that one, unless replace is true. Return true if we stored the response.
+{
+    Server         *server   = client->server;
+    Response_cache *cache    = server->response_cache;
+    Route_options  *options  = &client->route->options;
+    Response       *response = &client->response;
+
+    if (response->status != 200 || response->file)  return false;
+    if (client->cancelled)                           return false; // The handler probably gave up half way.
+
+    // Find or make the shared response, and take a reference to it for the entry.
+    Shared_response *shared = client->shared_response;
+
+    if (shared) {
+        // This is usually a coalesced response.
+        retain_shared_response(shared);
+    } else {
+        shared    = create_shared_response(client, response);
+        *response = make_shared_response(client, shared);
+    }
+
+    s64 size = get_cache_entry_size(shared);
+
+    bool too_big = size > server->response_cache_size;
+    if (options->cache_max_size && shared->identity->bytes.count > options->cache_max_size)  too_big = true;
+
+    if (too_big) {
+        release_shared_response(shared);
+        return false;
+    }
+
+    Memory_context *context = new_context(cache->context);
+
+    Cache_entry *entry = New(Cache_entry, context);
+
+    entry->context      = context;
+    entry->key          = copy_string(key, strlen(key), context).data;
+    entry->response     = shared;
+    entry->size         = size;
+    entry->time_created = get_monotonic_time();
+
+    bool stored = true;
+
+    pthread_mutex_lock(&cache->mutex);
+    {
+        Cache_entry *old_entry = *Get(&cache->entries, key);
+
+        if (old_entry && !replace && entry->time_created - old_entry->time_created <= options->cache_ttl) {
+            stored = false;
+        } else {
+            if (old_entry)  remove_cache_entry(cache, old_entry);
+
+            *Set(&cache->entries, entry->key) = entry;
+            push_cache_entry(cache, entry);
+            cache->total_size += entry->size;
+
+            // Evict the least recently used entries until we're within budget.
+            while (cache->total_size > server->response_cache_size)  remove_cache_entry(cache, cache->oldest);
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (!stored) {
+        release_shared_response(shared);
+        free_context(context);
+    }
+
+    return stored;
+}
+
+static void serve_cached_response(Client *client, Request_handler *handler)
+// Set the client's response from the cache if we can. Otherwise run the handler and cache what it returns.
+{
+    char *key = get_request_key(client, !client->route->options.cache_ignores_query);
+
+    // A client that's been waiting for an identical request gets that request's response, whatever the cache has.
+    if (!client->coalescing.following && serve_from_cache(client, key))  return;
+
+    bool following = (client->coalescing.following != NULL);
+
+    client->response = run_handler(client, handler);
+
+    // The leader of the flight caches its response, so its followers don't have to.
+    if (client->phase == WAITING_FOR_FLIGHT || following)  return;
+
+    store_response(client, key, false);
+}
+
+static void revalidate_response(Client *client)
+// Run a route handler in the background to replace a stale cached response. client came from
+// create_revalidation_client().
+{
+    Server         *server = client->server;
+    Response_cache *cache  = server->response_cache;
+
+    char *key = get_request_key(client, !client->route->options.cache_ignores_query);
+
+    client->response = run_handler(client, client->route->handler);
+
+    bool stored = store_response(client, key, true);
+
+    if (!stored) {
+        // Let the next request try again.
+        pthread_mutex_lock(&cache->mutex);
+        {
+            Cache_entry *entry = *Get(&cache->entries, key);
+            if (entry)  entry->update_pending = false;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+
+    release_segments(&client->response);
+    drop_shared_response(client);
+    free_context(client->context);
+}
+
+//
+// Admission control. A route with Route_options.max_concurrency has that many turns to hand out. A request that
+// arrives when they're all taken joins the route's queue, unless the queue is full, in which case we turn it away
+// with a 503. A client in the queue is parked: no thread owns it and its socket isn't armed, so it doesn't hold up
+// requests for other routes. When a request gives up its turn, it passes the turn straight to the first client in
+// the queue and sends that client to a thread to deal with (a worker, or in reactor mode, the client's own reactor).
+//
+enum Admission {ADMITTED=1, MUST_WAIT, REJECTED};
+
+static bool has_cached_response(Client *client)
+// Check whether serve_cached_response() would find a usable response for the client, without counting it as a use.
+{
+    Response_cache *cache   = client->server->response_cache;
+    Route_options  *options = &client->route->options;
+
+    char *key = get_request_key(client, !options->cache_ignores_query);
+
+    bool result = false;
+
+    pthread_mutex_lock(&cache->mutex);
+    {
+        Cache_entry *entry = *Get(&cache->entries, key);
+        if (entry)  result = (get_monotonic_time() - entry->time_created <= options->cache_ttl + options->cache_stale_time);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    return result;
+}
+
+static bool is_in_flight(Client *client)
+// Check whether coalesce_request() would wait for an identical request instead of running the handler.
+{
+    Server *server = client->server;
+    char   *key    = get_request_key(client, true);
+
+    bool result = false;
+
+    pthread_mutex_lock(&server->flights.mutex);
+    {
+        result = (*Get(&server->flights.dict, key) != NULL);
+    }
+    pthread_mutex_unlock(&server->flights.mutex);
+
+    return result;
+}
+
+static enum Admission admit_request(Client *client)
+// Decide whether the client can run its route's handler now. If it must wait, reserve it a place in the route's queue,
+// which it takes in park_client() once the thread dealing with it lets go. But if the client already has replies
+// queued, don't reserve a place, because it should send those before it starts waiting.
+{
+    Route *route = client->route;
+
+    if (!route || !route->options.max_concurrency)  return ADMITTED;
+    if (client->admission.has_turn)                 return ADMITTED;
+
+    // Requests that won't run the handler don't need a turn. If the cached response or the identical request is gone
+    // by the time we look for it, we run the handler without a turn, so the route can briefly go over its limit.
+    if (client->coalescing.following)                              return ADMITTED;
+    if (route->options.cache_ttl && has_cached_response(client))  return ADMITTED;
+    if (route->options.coalesce && is_in_flight(client))          return ADMITTED;
+
+    enum Admission result;
+
+    pthread_mutex_lock(&route->admission.mutex);
+    {
+        if (route->admission.num_running < route->options.max_concurrency) {
+            route->admission.num_running += 1;
+            client->admission.has_turn = true;
+            result = ADMITTED;
+        } else if (route->admission.num_waiting < route->options.max_queue) {
+            if (!client->replies.count)  route->admission.num_waiting += 1;
+            result = MUST_WAIT;
+        } else {
+            result = REJECTED;
+        }
+    }
+    pthread_mutex_unlock(&route->admission.mutex);
+
+    return result;
+}
+
+static bool needs_blocking_worker(Client *client)
+// Whether to hand the client over to the blocking pool to run its route's handler.
+{
+    Route *route = client->route;
+
+    if (!route || !route->options.blocking || on_blocking_worker)  return false;
+
+    // As with turns, requests that won't run the handler can stay where they are.
+    if (client->coalescing.following)                              return false;
+    if (route->options.cache_ttl && has_cached_response(client))  return false;
+    if (route->options.coalesce && is_in_flight(client))          return false;
+
+    return true;
+}
+
+static bool park_client(Client *client)
+// Put a client in its route's queue, in the place admit_request() reserved for it. Return true if we did, in which
+// case we must not touch the client again. Return false if a turn came free in the meantime, in which case the client
+// has it now.
+{
+    Route *route  = client->route;
+    bool   parked = false;
+
+    pthread_mutex_lock(&route->admission.mutex);
+    {
+        if (route->admission.num_running < route->options.max_concurrency) {
+            route->admission.num_waiting -= 1;
+            route->admission.num_running += 1;
+            client->admission.has_turn = true;
+        } else {
+            client->admission.next = NULL;
+
+            if (route->admission.last)  route->admission.last->admission.next = client;
+            else                        route->admission.first = client;
+            route->admission.last = client;
+
+            parked = true;
+        }
+    }
+    pthread_mutex_unlock(&route->admission.mutex);
+
+    return parked;
+}
+
+static void give_up_turn(Client *client)
+// Give up the client's turn on its route. If anyone is waiting, pass the turn on to them.
+{
+    Route  *route  = client->route;
+    Client *next   = NULL;
+
+    assert(client->admission.has_turn);
+    client->admission.has_turn = false;
+
+    pthread_mutex_lock(&route->admission.mutex);
+    {
+        next = route->admission.first;
+
+        if (next) {
+            route->admission.first = next->admission.next;
+            if (!route->admission.first)  route->admission.last = NULL;
+
+            route->admission.num_waiting -= 1;
+            next->admission.has_turn = true;
+        } else {
+            route->admission.num_running -= 1;
+        }
+    }
+    pthread_mutex_unlock(&route->admission.mutex);
+
+    if (next)  wake_client(next);
+}
+
+static Response make_busy_response(Client *client)
+// Turn a request away because its route's queue is full.
+{
+    char static body[] = "We're busy. Please try again in a moment.\n";
+
+    Response response = {503, .body = body, .size = lengthof(body)};
+
+    int retry_after = Max(client->route->options.retry_after, 1);
+
+    response.headers = (string_dict){.context = client->context};
+    *Set(&response.headers, "retry-after") = get_string(client->context, "%d", retry_after).data;
+
+    return response;
+}
+
+static bool make_next_chunk(Client *client, Reply *reply)
+// Get the next piece of a streamed reply from its streamer and make it the reply's body, framed for chunked
+// encoding. Return false if we can't finish the reply, because the compressor failed or the client hung up.
+{
+    Response *response = &reply->response;
+    u8_array *chunk    = &reply->chunk;
+
+    assert(response->stream && !reply->finished);
+
+    // We've sent the previous chunk, so we can reuse its buffer. Leave room at the front for the chunk size.
+    int MAX_SIZE_LINE = 18; // 16 hex digits and a CRLF.
+
+    chunk->count = 0;
+    array_reserve(chunk, 64*1024);
+    chunk->count = MAX_SIZE_LINE;
+
+    // Keep calling the streamer until it gives us something or finishes.
+    while (chunk->count == MAX_SIZE_LINE && !reply->finished) {
+        // A follower of a streamed flight can't get ahead of the leader. If it has passed on everything the leader has
+        // made so far, the chunk is empty, and advance_client() parks the client until there's more.
+        if (response->stream == &follow_flight_stream && !can_follow_stream(client, response->stream_data))  break;
+
+        if (reply->compressor) {
+            reply->piece.count = 0;
+            reply->finished = !(*response->stream)(client, response->stream_data, &reply->piece);
+
+            bool ok = compress_more(reply->compressor, reply->piece.data, reply->piece.count, reply->finished, chunk);
+            if (!ok) {
+                log_error("We failed to compress a streamed response.");
+                return false;
+            }
+        } else {
+            reply->finished = !(*response->stream)(client, response->stream_data, chunk);
+        }
+    }
+
+    // If the streamer stopped because the client hung up, the body is incomplete. Don't finish it as if it weren't.
+    if (client->cancelled)  return false;
+
+    s64 num_bytes = chunk->count - MAX_SIZE_LINE;
+    u8 *start     = chunk->data + MAX_SIZE_LINE;
+
+    if (num_bytes) {
+        char size_line[32];
+        int  length = snprintf(size_line, sizeof(size_line), "%lx\r\n", num_bytes);
+        assert(length <= MAX_SIZE_LINE);
+
+        start -= length;
+        memcpy(start, size_line, length);
+
+        *Add(chunk) = '\r';
+        *Add(chunk) = '\n';
+    }
+
+    if (reply->finished) {
+        // The last chunk is empty.
+        char last_chunk[] = "0\r\n\r\n";
+        for (int i = 0; i < lengthof(last_chunk); i++)  *Add(chunk) = last_chunk[i];
+
+        if (!num_bytes)  start = chunk->data + MAX_SIZE_LINE;
+    }
+
+    // We've already sent all of the previous body, so take it off the count.
+    client->num_bytes_sent -= response->size;
+
+    response->body = start;
+    response->size = (chunk->data + chunk->count) - start;
+
+    reply->num_chunk_bytes += response->size;
+
+    return true;
+}
+
+static void handle_requests(Client *client)
+// Parse and handle as many complete requests as we have in client->message, queueing a reply for each one. If we
+// queue any replies, set client->phase to SENDING_REPLY. Otherwise leave it at PARSING_REQUEST.
+{
+    Server *server = client->server;
+
+    int MAX_QUEUED_REPLIES = 16; // Don't let a client that pipelines lots of requests make us hold lots of responses in memory.
+
+    while (client->message.count && client->replies.count < MAX_QUEUED_REPLIES) {
+        assert(client->phase == PARSING_REQUEST);
+
+        if (!client->trace) {
+            client->trace = maybe_start_trace(server->tracer);
+            current_trace = client->trace;
+        }
+
+        s64 parse_start = get_monotonic_time_us();
+        s64 parse_span  = BeginSpan();
+
+        bool complete = parse_client_request(client);
+        if (!complete)  break;
+
+        EndSpan("parse_request", parse_span);
+
+        s64 parse_end = get_monotonic_time_us();
+
+        if (client->phase == HANDLING_REQUEST) {
+            s64 route_span = BeginSpan();
+
+            Request_handler *handler = find_request_handler(server, client);
+            if (!handler)  handler = &serve_404;
+
+            EndSpan("find_request_handler", route_span);
+
+            s64 route_end = get_monotonic_time_us();
+
+            // The request may have waited a while for a thread or a turn. If the client has given up on it since,
+            // don't bother handling it.
+            if (is_request_cancelled(client)) {
+                if (client->admission.has_turn)  give_up_turn(client);
+                if (client->coalescing.following) {
+                    leave_flight(client, client->coalescing.following);
+                    client->coalescing.following = NULL;
+                }
+                client->phase = READY_TO_CLOSE;
+                return;
+            }
+
+            if (needs_blocking_worker(client)) {
+                if (client->replies.count) {
+                    // Send the replies we have first. We'll come back to this request when they've gone.
+                    init_request(client);
+                    client->phase = PARSING_REQUEST;
+                    break;
+                }
+
+                // Leave the request in the message. A blocking worker will parse it again and run it.
+                client->phase = WAITING_FOR_WORKER;
+                return;
+            }
+
+            // If the client already has a turn, it's been waiting for one, and we've parsed this request before. The
+            // same goes for a client that's been waiting for an identical request, except that it doesn't need a turn.
+            bool resumed   = client->admission.has_turn;
+            bool following = (client->coalescing.following != NULL);
+
+            enum Admission admission = admit_request(client);
+
+            if (admission == MUST_WAIT) {
+                if (client->replies.count) {
+                    // Send the replies we have first. We'll come back to this request when they've gone.
+                    init_request(client);
+                    client->phase = PARSING_REQUEST;
+                    break;
+                }
+
+                record_arrival(client, parse_start, parse_end, route_end);
+                client->timing.turn_requested = route_end;
+
+                // Leave the request in the message. We'll parse it again when it's our turn.
+                client->phase = WAITING_FOR_TURN;
+                return;
+            }
+
+            // A follower's wait counts towards the handler phase, as the leader's handler does.
+            s64 handler_start = following ? client->timing.handler_start : get_monotonic_time_us();
+            s64 handler_span  = BeginSpan();
+
+            if (resumed)          record_phase(client, ADMISSION_PHASE, handler_start - client->timing.turn_requested);
+            else if (!following)  record_arrival(client, parse_start, parse_end, route_end);
+
+            if (admission == REJECTED) {
+                client->response = make_busy_response(client);
+            } else {
+                // Run the handler.
+                if (client->route && client->route->options.cache_ttl)  serve_cached_response(client, handler);
+                else                                                    client->response = run_handler(client, handler);
+            }
+
+            if (client->phase == WAITING_FOR_FLIGHT) {
+                // An identical request is running the handler, and we'll share its response. We don't need a turn
+                // for that. Leave the request in the message. We'll parse it again when the response is ready.
+                if (client->admission.has_turn)  give_up_turn(client);
+                client->timing.handler_start = handler_start;
+                EndSpan("handler", handler_span);
+                return;
+            }
+            assert(client->response.status);
+
+            bool http_1_0 = (client->http_version != HTTP_VERSION_1_1);
+            if (client->response.stream && http_1_0 && !client->cancelled)  collect_stream(client);
+
+            // A streamer does the work of making the body as we send it, so a streamed reply keeps the client's turn
+            // until it has gone. See advance_client().
+            if (client->admission.has_turn && (!client->response.stream || client->cancelled))  give_up_turn(client);
+
+            record_phase(client, HANDLER_PHASE, get_monotonic_time_us() - handler_start);
+            EndSpan("handler", handler_span);
+
+            if (client->cancelled) {
+                // The client hung up while the handler was running, and the handler gave up.
+                if (client->response.stream)  stop_stream(client, &client->response);
+                release_segments(&client->response);
+                drop_shared_response(client);
+                client->phase = READY_TO_CLOSE;
+                return;
+            }
+        }
+
+        Compressor *compressor = compress_response(client);
+        drop_shared_response(client);
+
+        queue_reply(client, compressor);
+
+        // Remove the request from the front of the message.
+        char_array *message = &client->message;
+        assert(0 < client->request_size && client->request_size <= message->count);
+        message->count -= client->request_size;
+        memmove(message->data, message->data + client->request_size, message->count);
+        message->data[message->count] = '\0';
+
+        if (!client->keep_alive)  break; // Don't bother with anything after a request that asks us to close the connection.
+
+        if (client->response.stream)  break; // Any more replies would have to wait behind the stream anyway.
+
+        init_request(client);
+        client->phase = PARSING_REQUEST;
+    }
+
+    if (client->replies.count)  client->phase = SENDING_REPLY;
+}
+
+static void log_replies(Client *client)
+// Record the send phase and write an access log record for each of the replies we've just finished sending.
+{
+    Server *server = client->server;
+
+    s64 current_time_us = get_monotonic_time_us();
+
+    // If the request came in with the previous one, we don't know when its first byte arrived, so count from when we
+    // started on it.
+    s64 start_time_us = client->timing.first_byte ? client->timing.first_byte : client->start_time*1000;
+
+    for (s64 i = 0; i < client->replies.count; i++) {
+        Reply *reply = &client->replies.data[i];
+
+        record_route_phase(server, reply->route, SEND_PHASE, current_time_us - reply->time_queued);
+
+        enum HTTP_method  req_method = reply->request.method;
+        char_array       *req_path   = &reply->request.path;
+        string_dict      *req_query  = &reply->request.query_params;
+
+        char *method = req_method == GET ? "GET" : req_method == POST ? "POST" : "UNKNOWN!!";
+        char *path   = req_path->count ? req_path->data : "";
+        char *query  = req_query->count ? encode_query_string(req_query, client->context)->data : "";
+
+        char target[ACCESS_LOG_MAX_TARGET+1];
+        snprintf(target, sizeof(target), "%s%s", path, query);
+
+        s64 body_size = reply->response.stream ? reply->num_chunk_bytes : reply->response.size;
+
+        Access_record record = {
+            .duration  = current_time_us - start_time_us,
+            .num_bytes = reply->header.count + body_size,
+            .status    = reply->response.status,
+            .method    = method,
+            .target    = target,
+        };
+
+        bool added = add_access_record(server->access_log, &record);
+        if (!added)  add_to_metric(server->metrics, server->metric_ids.access_log_dropped, 1);
+
+        if (client->trace && i == client->replies.count-1) {
+            // A trace covers everything since the client's first request in this batch, so if it pipelined several,
+            // say how many.
+            char_array name = get_string(client->context, "%s %s", method, target);
+            if (client->replies.count > 1)  append_string(&name, " (the last of %ld pipelined requests)", client->replies.count);
+
+            finish_trace(client->trace, name.data);
+            client->trace = NULL;
+        }
+    }
+}
+
+static void reset_client(Client *client, s64 current_time)
+// Reset a keep-alive client after we've sent all its replies. Keep any bytes we've received of pipelined requests
+// that we haven't handled yet.
+{
+    char_array *message = &client->message;
+
+    // The leftover bytes live in the client's context, which we're about to reset, so copy them somewhere else first.
+    // Pipelined GET requests are small, so usually they fit on the stack.
+    char  stack_buffer[4096];
+    char *leftover = stack_buffer;
+    s64   num_leftover = message->count;
+
+    Memory_context *tmp_ctx = NULL;
+    if (num_leftover > countof(stack_buffer)) {
+        tmp_ctx  = new_context(NULL);
+        leftover = alloc(num_leftover, sizeof(char), tmp_ctx);
+    }
+    memcpy(leftover, message->data, num_leftover);
+
+    Reactor *reactor = client->reactor;
+    u32      address = client->address;
+
+    release_replies(client);
+    reset_context(client->context);
+    init_client(client->server, client, client->context, client->socket, current_time);
+
+    client->reactor = reactor;
+    client->address = address;
+
+    if (num_leftover) {
+        array_reserve(message, num_leftover+1);
+        memcpy(message->data, leftover, num_leftover);
+        message->count = num_leftover;
+        message->data[num_leftover] = '\0';
+    }
+
+    if (tmp_ctx)  free_context(tmp_ctx);
+}
+
+static bool advance_client(Client *client)
+// The part of deal_with_client() after it has received from the socket. Call this directly if you've already put what
+// arrived on the socket into client.message, as the io_uring reactors do.
+{
+    while (true) {
+        if (client->phase == PARSING_REQUEST)  handle_requests(client);
+
+        if (client->phase == WAITING_FOR_TURN) {
+            bool parked = park_client(client);
+            if (parked)  return false;
+
+            // A turn came free in the meantime, and we have it.
+            init_request(client);
+            client->phase = PARSING_REQUEST;
+            continue;
+        }
+
+        if (client->phase == WAITING_FOR_FLIGHT) {
+            bool parked = park_follower(client);
+            if (parked)  return false;
+
+            // The identical request has finished, so its response is ready. Parse our request again and share it.
+            init_request(client);
+            client->phase = PARSING_REQUEST;
+            continue;
+        }
+
+        if (client->phase == WAITING_FOR_STREAM) {
+            bool parked = park_follower(client);
+            if (parked)  return false;
+
+            // The leader of the flight has made more of the stream, so pass it on.
+            Reply *last_reply = &client->replies.data[client->replies.count-1];
+
+            bool ok = make_next_chunk(client, last_reply);
+            if (!ok) {
+                client->phase = READY_TO_CLOSE;
+                break;
+            }
+            client->phase = last_reply->response.size ? SENDING_REPLY : WAITING_FOR_STREAM;
+            continue;
+        }
+
+        if (client->phase == WAITING_FOR_WORKER) {
+            client->timing.queued = get_monotonic_time_us();
+            push_task(client->server->blocking_scheduler, (Task){DEAL_WITH_A_CLIENT, .client=client});
+            return false;
+        }
+
+        if (client->phase != SENDING_REPLY)  break; // We're waiting for the rest of a request.
+
+        s64 send_span = BeginSpan();
+
+        bool success = send_replies(client);
+
+        EndSpan("send_replies", send_span);
+
+        if (!success)  break; // We're waiting for the socket to be writable, or there was an error.
+
+        // A streamed reply is always the last in the queue. If it isn't finished, get its next chunk and keep sending.
+        Reply *last_reply = &client->replies.data[client->replies.count-1];
+        if (last_reply->response.stream && !last_reply->finished) {
+            bool ok = make_next_chunk(client, last_reply);
+            if (!ok) {
+                client->phase = READY_TO_CLOSE;
+                break;
+            }
+            // An empty chunk means we're following a streamed flight and have to wait for its leader.
+            if (!last_reply->response.size)  client->phase = WAITING_FOR_STREAM;
+            continue;
+        }
+
+        if (client->admission.has_turn)  give_up_turn(client); // The stream is done.
+
+        log_replies(client);
+
+        if (!client->keep_alive) {
+            client->phase = READY_TO_CLOSE;
+            break;
+        }
+
+        // Reset the client and prepare to receive more data on the socket.
+        reset_client(client, get_monotonic_time());
+
+        // If the client pipelined more requests than we handled, go around again. We have to deal with them now,
+        // because the bytes have already been read from the socket, so epoll won't tell us about them.
+        if (!client->message.count)  break;
+    }
+
+    if (client->phase == READY_TO_CLOSE) {
+        // Do nothing. Whoever owns the client's socket will close it and free memory.
+    }
+
+    return true;
+}
+
+static bool deal_with_client(Client *client)
+// Advance a client through as many phases as we can without blocking. When we return true, the client is either
+// waiting to receive more of its request, waiting for its socket to be writable, or READY_TO_CLOSE. Return false if
+// the client has to wait for a turn on a busy route, in which case it's in the route's queue and we must not touch
+// it again. Whoever gives up the next turn will send it back here. Likewise if it's waiting for an identical request
+// to finish, or for the leader of one to make more of a stream, whose leader sends it back. advance_client() checks
+// what it was waiting for and carries on. Also return false if we've handed the client to the blocking pool, which
+// sends it back here on one of its workers.
+{
+    if (client->phase == WAITING_FOR_TURN) {
+        // We've been given a turn. Parse the request again and this time run it.
+        assert(client->admission.has_turn);
+        init_request(client);
+        client->phase = PARSING_REQUEST;
+    } else if (client->phase == WAITING_FOR_WORKER) {
+        // We're a blocking worker. Parse the request again and this time run it.
+        assert(on_blocking_worker);
+        init_request(client);
+        client->phase = PARSING_REQUEST;
+    } else if (client->phase == PARSING_REQUEST) {
+        bool received = receive_message(client);
+        if (!received)  return true;
+    }
+
+    return advance_client(client);
+}
+
+static enum Interest get_interest(Client *client)
+// What a client needs next from its socket, given its phase.
+{
+    if (client->phase == PARSING_REQUEST)  return WANT_TO_READ;
+    if (client->phase == SENDING_REPLY)    return WANT_TO_WRITE;
+
+    assert(client->phase == READY_TO_CLOSE);
+    return WANT_TO_CLOSE;
+}
+
+static void push_completion(Client **completions, s32 completion_handle, Client *client, enum Interest interest)
+// Hand a client back to the thread that owns its socket: the main thread, or in reactor mode, the client's reactor.
+// The completion channel is a lock-free stack of clients with an eventfd as a doorbell. We only ring the doorbell if
+// the stack was empty, because otherwise the owner is already due to take the whole stack, including our client.
+// After this, we must not touch the client again.
+{
+    client->completion.interest = interest;
+
+    Client *head = __atomic_load_n(completions, __ATOMIC_RELAXED);
+    do {
+        client->completion.next = head;
+    } while (!__atomic_compare_exchange_n(completions, &head, client, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        s64 num_bytes_written = write(completion_handle, &(u64){1}, sizeof(u64));
+        if (num_bytes_written != sizeof(u64)) {
+            Fatal("We couldn't ring the completion doorbell (%s).", get_last_error().string);
+        }
+    }
+}
+
+static Client *take_completions(Client **completions, s32 completion_handle)
+// Take every client that has been handed back since we last checked. Return them as a linked list (via
+// client.completion.next) in the order they were handed back.
+{
+    // Reset the doorbell before we take the stack. If we did it the other way around, a worker could push onto the
+    // empty stack and ring the doorbell in between, and we would clear its ring without seeing its client.
+    u64 num_rings;
+    s64 num_bytes_read = read(completion_handle, &num_rings, sizeof(num_rings));
+    if (num_bytes_read != sizeof(num_rings) && !(num_bytes_read == -1 && errno == EAGAIN)) {
+        Fatal("We couldn't read the completion doorbell (%s).", get_last_error().string);
+    }
+
+    Client *stack = __atomic_exchange_n(completions, NULL, __ATOMIC_ACQUIRE);
+
+    // The stack is newest-first. Reverse it.
+    Client *list = NULL;
+    while (stack) {
+        Client *next = stack->completion.next;
+        stack->completion.next = list;
+        list  = stack;
+        stack = next;
+    }
+
+    return list;
+}
+
+static void run_worker(Server *server, Scheduler *scheduler)
+// A worker thread's main loop. It takes tasks from the scheduler until it's time to wind up.
+{
+    attach_to_scheduler(scheduler, true);
+
+    while (true)
+    {
+        Task task;
+        pop_task(scheduler, &task);
+
+        if (task.type == TIME_TO_WIND_UP)  break;
+
+        if (task.type == REFRESH_FILE_TREE) {
+            refresh_file_tree(task.file_tree_accessor);
+            continue;
+        }
+        if (task.type == REVALIDATE_RESPONSE) {
+            revalidate_response(task.client);
+            continue;
+        }
+
+        assert(task.type == DEAL_WITH_A_CLIENT);
+        Client *client = task.client;
+
+        if (client->timing.queued) {
+            client->timing.queue_wait += get_monotonic_time_us() - client->timing.queued;
+            client->timing.queued      = 0;
+        }
+
+        current_trace = client->trace;
+
+        bool still_ours = deal_with_client(client);
+
+        current_trace = NULL;
+
+        if (!still_ours)  continue; // It's waiting for a turn on a busy route, an identical request or a blocking worker. Someone else will pass it on.
+
+        // Let the thread that owns the client's socket know we're done with the client. In reactor mode, that's
+        // the client's reactor (only blocking workers get clients in reactor mode).
+        if (client->reactor)  wake_reactor_client(client);
+        else                  push_completion(&server->completions, server->completion_handle, client, get_interest(client));
+    }
+}
+
+static void *worker_thread_routine(void *arg)
+{
+    Server *server = arg;
+
+    run_worker(server, server->scheduler);
+
+    return NULL;
+}
+
+static void *blocking_worker_routine(void *arg)
+{
+    Server *server = arg;
+
+    on_blocking_worker = true;
+    run_worker(server, server->blocking_scheduler);
+
+    return NULL;
+}
+
+static s32 open_listening_socket(Server *server, bool reuse_port)
+// Create a non-blocking socket bound to the server's address and port, and start listening on it. If reuse_port is
+// true, set SO_REUSEPORT so that several sockets can share the port and the kernel will balance connections between them.
+{
+    s32 sock = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        Fatal("Couldn't get a socket (%s).", get_last_error().string);
+    }
+
+    // Set SO_REUSEADDR because we want to run this program frequently during development.
+    // Otherwise the kernel holds onto our address/port combo after our program finishes.
+    int r = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (r < 0) {
+        Fatal("Couldn't set socket options (%s).", get_last_error().string);
+    }
+
+    if (reuse_port) {
+        r = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int));
+        if (r < 0) {
+            Fatal("Couldn't set SO_REUSEPORT (%s).", get_last_error().string);
+        }
+    }
+
+    if (server->defer_accept) {
+        // Don't wake us up for a connection until its request starts arriving, or until this many seconds have passed.
+        r = setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &(int){server->defer_accept}, sizeof(int));
+        if (r < 0) {
+            Fatal("Couldn't set TCP_DEFER_ACCEPT (%s).", get_last_error().string);
+        }
+    }
+
+    struct sockaddr_in socket_addr = {
+        .sin_family   = AF_INET,
+        .sin_port     = htons(server->port),
+        .sin_addr     = {htonl(server->address)},
+    };
+
+    r = bind(sock, (struct sockaddr const *)&socket_addr, sizeof(socket_addr));
+    if (r < 0) {
+        Fatal("Couldn't bind socket (%s).", get_last_error().string);
+    }
+
+    // The kernel silently caps the backlog at net.core.somaxconn.
+    r = listen(sock, server->listen_backlog);
+    if (r < 0) {
+        Fatal("Couldn't listen on socket (%s).", get_last_error().string);
+    }
+
+    return sock;
+}
+
+// Each thread that accepts connections keeps a file descriptor in reserve, so that when we run out, it can still
+// accept a connection in order to close it. See accept_connection().
+static __thread s32 spare_file_no = -1;
+
+static void reserve_spare_file()
+{
+    if (spare_file_no < 0)  spare_file_no = open("/dev/null", O_RDONLY|O_CLOEXEC);
+}
+
+static void release_spare_file()
+{
+    if (spare_file_no >= 0)  close(spare_file_no);
+    spare_file_no = -1;
+}
+
+#define MAX_ACCEPTS_PER_WAKEUP  64 // So that a flood of new connections can't hold up the clients we already have.
+
+static s32 accept_connection(Server *server, s32 listening_socket, u32 *address)
+// Take the next connection from a listening socket's backlog and return its socket, which is already non-blocking.
+// Set *address to the address it came from. Return -1 once the backlog is empty.
+//
+// If we've run out of file descriptors, the connections would sit in the backlog, and because the listening socket
+// is level-triggered, epoll would keep waking us up about them. So we turn them away instead: we free our spare file
+// descriptor, accept a connection with it, close the connection straight away and take the spare back.
+{
+    static __thread bool shedding = false; // Whether we've logged that we're turning connections away.
+
+    while (true) {
+        struct sockaddr_in peer      = {0};
+        socklen_t          peer_size = sizeof(peer);
+
+        s32 sock = accept4(listening_socket, (struct sockaddr *)&peer, &peer_size, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (sock >= 0) {
+            shedding = false;
+            *address = ntohl(peer.sin_addr.s_addr);
+            return sock;
+        }
+
+        switch (errno) {
+            case EAGAIN:
+                return -1;
+            case EMFILE:
+            case ENFILE:
+                if (spare_file_no < 0) {
+                    log_error("We're out of file descriptors, and we couldn't reserve one to turn connections away with.");
+                    return -1;
+                }
+                if (!shedding) {
+                    log_error("We're out of file descriptors, so we're turning connections away (%s).", get_last_error().string);
+                    shedding = true;
+                }
+
+                close(spare_file_no);
+                spare_file_no = -1;
+
+                sock = accept4(listening_socket, NULL, NULL, SOCK_CLOEXEC);
+                if (sock >= 0) {
+                    close(sock);
+                    add_to_metric(server->metrics, server->metric_ids.connections_shed, 1);
+                }
+
+                reserve_spare_file();
+
+                // accept() claims a file descriptor before it looks at the backlog, so it fails with EMFILE even when
+                // there's nothing to accept. This second call is the one that tells us whether we're done.
+                if (sock < 0)  return -1;
+                continue;
+            case ECONNABORTED:
+            case EINTR:
+            case EPROTO:
+                // The connection went away before we got to it, or a signal interrupted us, or it was a protocol error
+                // that accept() passes on from the new socket. None of those are about the listening socket.
+                continue;
+            default:
+                // Anything else (like ENOBUFS, or EBADF if the socket is broken) won't clear up if we try again
+                // straight away. Log it and try again next time, rather than spin.
+                log_error("We couldn't accept a connection (%s).", get_last_error().string);
+                return -1;
+        }
+    }
+}
+
+Server *create_server(u32 address, u16 port, Memory_context *context)
+// Set up a server with default settings. The caller can change the settings on the struct before calling start_server().
+{
+    Server *server = New(Server, context);
+
+    server->context = context;
+    server->address = address;
+    server->port    = port;
+
+    server->use_reactors = false;
+    server->use_io_uring = false;
+    server->min_compression_size = 1024;
+
+    server->socket = -1; // start_server() opens the listening socket(s).
+
+    server->listen_backlog   = SOMAXCONN;
+    server->defer_accept     = 1;
+    server->max_request_size = 64*1024;
+
+    // Create a file descriptor to handle SIGINT.
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGINT);
+
+    int r = pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+    if (r) {
+        Fatal("Couldn't mask SIGINT (%s).", get_error_info(r).string);
+    }
+
+    server->interrupt_handle = signalfd(-1, &signal_mask, SFD_NONBLOCK);
+    if (server->interrupt_handle == -1) {
+        Fatal("Couldn't create a file descriptor to handle SIGINT (%s).", get_last_error().string);
+    }
+
+    server->routes = (Route_array){.context = context};
+
+    server->clients         = (Client_map){.context = context, .binary_mode = true};
+    server->watched_clients = (Client_map){.context = context, .binary_mode = true};
+    server->connections_per_ip.counts = (Address_count_map){.context = context, .binary_mode = true};
+    server->client_pool     = (Client_pool){.context = context};
+
+    server->epoll_handle = epoll_create1(0);
+    if (server->epoll_handle == -1) {
+        Fatal("Couldn't create an epoll instance (%s).", get_last_error().string);
+    }
+
+    server->worker_threads   = (pthread_t_array){.context = context};
+    server->blocking_threads = (pthread_t_array){.context = context};
+
+    server->completions = NULL;
+
+    pthread_mutex_init(&server->flights.mutex, NULL);
+    pthread_mutex_init(&server->connections_per_ip.mutex, NULL);
+    server->flights.dict = (Flight_dict){.context = context};
+
+    server->response_cache_size = 64*1024*1024;
+
+    server->idle_timeout    = 15000;
+    server->header_timeout  = 10000;
+    server->send_timeout    = 15000;
+
+    server->min_receive_rate = 256;
+    server->min_send_rate    = 1024;
+
+    server->access_log_path   = NULL;
+    server->access_log_format = TEXT_LOG;
+    server->trace_path          = NULL;
+    server->response_cache      = create_response_cache(context);
+
+    server->completion_handle = eventfd(0, EFD_NONBLOCK);
+    if (server->completion_handle == -1) {
+        Fatal("Couldn't create an eventfd (%s).", get_last_error().string);
+    }
+
+    server->metrics = create_metrics(context);
+    server->tracer  = create_tracer(context);
+
+    server->metric_ids.open_connections   = add_metric(server->metrics, GAUGE, "http_open_connections", NULL, "How many client connections are open.");
+    server->metric_ids.connections        = add_metric(server->metrics, COUNTER, "http_connections_total", NULL, "How many client connections we've accepted.");
+    server->metric_ids.connections_shed   = add_metric(server->metrics, COUNTER, "http_connections_shed_total", NULL, "How many connections we've closed as soon as we accepted them, because we were out of file descriptors.");
+    server->metric_ids.connections_rejected = add_metric(server->metrics, COUNTER, "http_connections_rejected_total", NULL, "How many connections we've closed as soon as we accepted them, because their address already had as many open as we allow.");
+    server->metric_ids.slow_receives      = add_metric(server->metrics, COUNTER, "http_slow_clients_total", "direction=\"receive\"", "How many connections we've closed because the client was sending a request or taking a reply too slowly.");
+    server->metric_ids.slow_sends         = add_metric(server->metrics, COUNTER, "http_slow_clients_total", "direction=\"send\"", "How many connections we've closed because the client was sending a request or taking a reply too slowly.");
+    server->metric_ids.bytes_sent         = add_metric(server->metrics, COUNTER, "http_sent_bytes_total", NULL, "How many bytes we've sent to clients, including headers.");
+    server->metric_ids.access_log_dropped = add_metric(server->metrics, COUNTER, "http_access_log_dropped_total", NULL, "How many access log records we've dropped because the log fell behind.");
+    server->metric_ids.active_workers     = add_metric(server->metrics, GAUGE, "http_active_workers", "pool=\"cpu\"", "How many worker threads are taking tasks. The rest are parked.");
+    server->metric_ids.active_blocking_workers = add_metric(server->metrics, GAUGE, "http_active_workers", "pool=\"blocking\"", "How many worker threads are taking tasks. The rest are parked.");
+
+    // These have to be in the same order as enum Builtin_phase.
+    char *builtin_phases[] = {"queue", "receive", "parse", "route", "admission", "handler", "send"};
+    assert(countof(builtin_phases) == NUM_BUILTIN_PHASES);
+
+    server->phase_names = (string_array){.context = context};
+    for (int i = 0; i < NUM_BUILTIN_PHASES; i++)  *Add(&server->phase_names) = builtin_phases[i];
+
+    return server;
+}
+
+void add_route_(Server *server, enum HTTP_method method, char *path_pattern, Request_handler *handler, Route_options options)
+{
+    //|Todo: Check the server phase. You can't add routes once the server's started.
+
+    Regex *regex = compile_regex(path_pattern, server->context);
+    assert(regex);
+
+    *Add(&server->routes) = (Route){method, path_pattern, regex, handler, .options = options};
+}
+
+s32 add_phase(Server *server, char *name)
+// Add a phase for handlers to time with record_phase(), e.g. database queries. Every route gets a histogram for it.
+// Call this before start_server().
+{
+    *Add(&server->phase_names) = name;
+
+    return server->phase_names.count - 1;
+}
+
+static char *escape_label_value(char *value, Memory_context *context)
+// Prometheus label values are in double quotes, with backslashes, quotes and newlines escaped.
+{
+    char_array result = {.context = context};
+    array_reserve(&result, round_up_pow2(strlen(value) + 1));
+
+    for (char *c = value; *c; c++) {
+        if (*c == '\\' || *c == '"')  *Add(&result) = '\\';
+
+        if (*c == '\n')  append_string(&result, "\\n");
+        else             *Add(&result) = *c;
+    }
+    *Add(&result) = '\0';
+
+    return result.data;
+}
+
+static s32 add_phase_metrics(Server *server, char *route_name)
+// Register the phase histograms for a route. Return the ID of the first.
+{
+    Memory_context *ctx = server->context;
+
+    char *route = escape_label_value(route_name, ctx);
+
+    s32 first_metric = -1;
+
+    for (s64 i = 0; i < server->phase_names.count; i++) {
+        char *labels = get_string(ctx, "route=\"%s\",phase=\"%s\"", route, server->phase_names.data[i]).data;
+
+        s32 metric = add_metric(server->metrics, HISTOGRAM, "http_phase_duration_seconds", labels, "How long requests spend in each phase, by route.");
+        if (i == 0)  first_metric = metric;
+    }
+
+    return first_metric;
+}
+
+#ifndef FILE_TREE_STUFF_WHICH_WE_WILL_PROBABLY_PUT_INTO_ITS_OWN_MODULE
+//typedef struct File_tree_accessor File_tree_accessor;
+typedef struct Asset         Asset;
+typedef struct Asset_variant Asset_variant;
+typedef Dict(Asset *)        Asset_dict;
+typedef Array(File_node *)   File_list;
+
+// When we read files with io_uring, we read up to this many at once.
+#define FILE_READ_BATCH     64
+
+struct File_tree_accessor {
+    Memory_context     *context;
+
+    char               *directory;
+    bool                use_io_uring;   // Read the files with io_uring, a batch at a time. See read_files_with_uring().
+
+    pthread_mutex_t     mutex;
+    File_tree_resource *resource;
+};
+
+struct File_tree_resource {
+    // A child context of the accessor's context. It contains everything to do with
+    // this resource including the resource struct itself.
+    Memory_context     *context;
+
+    struct {
+        pthread_mutex_t     mutex;
+        int                 value;
+    }                   num_refs;
+
+    File_node          *file_tree;
+    s64                 time_created;
+
+    Asset_dict          assets;         // The cached contents of the files in the tree, keyed by path. Each asset is also on its File_node's .user_data, which is how request handlers find it, since a Dict isn't safe to read from several threads at once.
+
+    // The first thread to notice that a resource has expired sets update_pending = true
+    // to let other threads know that it is taking responsibility for the update.
+    struct {
+        pthread_mutex_t     mutex;
+        bool                value;
+    }                   update_pending;
+};
+
+struct Asset_variant {
+    char               *encoding;       // The value for the content-encoding header, or NULL for the identity encoding.
+    u8_array            bytes;          // Empty if this encoding isn't worth it.
+    char               *etag;           // Each encoding gets its own strong ETag, because the bytes differ.
+};
+
+// An Asset is a file from a file tree held in memory with everything we need to serve it. Assets are reference-counted
+// because, if the file doesn't change, the next File_tree_resource reuses the asset instead of reading and compressing
+// the file again. See refresh_file_tree().
+struct Asset {
+    Memory_context     *context;        // A child context of the accessor's context, containing the asset struct itself.
+    int                 num_refs;       // Only modify this atomically.
+
+    s64                 size;           // The file's size and mtime when we read it, according to its File_node.
+    s64                 modified_time;
+
+    char               *content_type;   // NULL if we don't know.
+    char               *last_modified;  // The mtime formatted for the last-modified header.
+
+    Asset_variant       identity;
+    Asset_variant       gzip;
+    Asset_variant       brotli;
+};
+
+static char *get_content_type(char *path)
+// Guess a file's content type from its extension. Return NULL if we don't know.
+{
+    char *file_extension = strrchr(path, '.');
+    if (!file_extension || strchr(file_extension, '/'))  return NULL;
+
+    file_extension += 1;
+
+    if (!strcmp(file_extension, "html"))   return "text/html";
+    if (!strcmp(file_extension, "js"))     return "text/javascript";
+    if (!strcmp(file_extension, "json"))   return "application/json";
+    if (!strcmp(file_extension, "css"))    return "text/css";
+    if (!strcmp(file_extension, "svg"))    return "image/svg+xml";
+    if (!strcmp(file_extension, "ttf"))    return "font/ttf";
+    if (!strcmp(file_extension, "woff2"))  return "font/woff2";
+
+    return NULL;
+}
+
+static Asset *make_asset(File_node *file, u8_array *bytes, Memory_context *ctx)
+// Make an asset from a file's contents, which should be in the asset's own context, ctx.
+{
+    Asset *asset = New(Asset, ctx);
+
+    asset->context       = ctx;
+    asset->num_refs      = 1;
+    asset->size          = file->size;
+    asset->modified_time = file->modified_time;
+    asset->content_type  = get_content_type(file->path.data);
+
+    {
+        time_t seconds = file->modified_time/1000000000;
+        struct tm tm;
+        gmtime_r(&seconds, &tm);
+
+        char buffer[64];
+        strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        asset->last_modified = copy_string(buffer, strlen(buffer), ctx).data;
+    }
+
+    u64 hash = hash_bytes(bytes->data, bytes->count);
+
+    asset->identity = (Asset_variant){NULL, *bytes, get_string(ctx, "\"%016lx\"", hash).data};
+
+    // Only compress text. Fonts like woff2 are already compressed.
+    char *type = asset->content_type;
+    bool is_text = type && (starts_with(type, "text/") || !strcmp(type, "application/json") || !strcmp(type, "image/svg+xml"));
+
+    if (is_text) {
+        // We compress each file only when it changes, so use the slowest, smallest settings.
+        u8_array *gzip = gzip_compress(bytes->data, bytes->count, 9, ctx);
+        if (gzip && gzip->count < bytes->count) {
+            asset->gzip = (Asset_variant){"gzip", *gzip, get_string(ctx, "\"%016lx-gz\"", hash).data};
+        }
+
+        u8_array *brotli = brotli_compress(bytes->data, bytes->count, 11, ctx);
+        if (brotli && brotli->count < bytes->count) {
+            asset->brotli = (Asset_variant){"br", *brotli, get_string(ctx, "\"%016lx-br\"", hash).data};
+        }
+    }
+
+    return asset;
+}
+
+static void release_asset(Asset *asset)
+{
+    int num_refs = __atomic_sub_fetch(&asset->num_refs, 1, __ATOMIC_ACQ_REL);
+    if (num_refs == 0)  free_context(asset->context);
+}
+
+static bool read_files_with_uring(File_list *files, Memory_context **contexts, u8_array **contents)
+// Read each of the files into memory, in its own context, setting contents[i] to files[i]'s contents, or NULL if we
+// couldn't read it. Rather than read the files one after another, we hand the kernel a batch of reads at a time and it
+// does them in parallel. Return false if we couldn't set up a ring, in which case we haven't read anything.
+{
+    Uring ring;
+    bool ok = init_uring(&ring, FILE_READ_BATCH);
+    if (!ok)  return false;
+
+    // Each file has one read in flight at a time, so a batch no bigger than the SQ always fits in it.
+    s64 batch_size = Min(FILE_READ_BATCH, ring.num_sqes);
+
+    for (s64 start = 0; start < files->count; start += batch_size) {
+        s64 end = Min(files->count, start + batch_size);
+
+        s32 file_nos[FILE_READ_BATCH];
+        s64 num_in_flight = 0;
+
+        for (s64 i = start; i < end; i++) {
+            File_node *file = files->data[i];
+
+            contents[i] = NULL;
+
+            s32 file_no = open(file->path.data, O_RDONLY|O_CLOEXEC);
+            file_nos[i-start] = file_no;
+            if (file_no < 0)  continue;
+
+            u8_array *bytes = NewArray(bytes, contexts[i]);
+            array_reserve(bytes, file->size+1);
+            contents[i] = bytes;
+
+            prep_read(get_sqe(&ring), file_no, bytes->data, file->size, 0, i);
+            num_in_flight += 1;
+        }
+
+        while (num_in_flight) {
+            submit_and_wait(&ring, 1, -1);
+
+            struct io_uring_cqe *cqe;
+            while ((cqe = peek_cqe(&ring))) {
+                s64 i      = cqe->user_data;
+                s32 result = cqe->res;
+                advance_cqe(&ring);
+
+                File_node *file  = files->data[i];
+                u8_array  *bytes = contents[i];
+
+                if (result < 0) {
+                    contents[i] = NULL;
+                    num_in_flight -= 1;
+                    continue;
+                }
+
+                bytes->count += result;
+
+                if (result > 0 && bytes->count < file->size) {
+                    // A short read. Ask for the rest.
+                    prep_read(get_sqe(&ring), file_nos[i-start], bytes->data + bytes->count, file->size - bytes->count, bytes->count, i);
+                    continue;
+                }
+
+                // We've read the whole file, or come to its end early because it's shrunk since we looked at it, in
+                // which case load_assets() drops it.
+                num_in_flight -= 1;
+            }
+        }
+
+        for (s64 i = 0; i < end - start; i++) {
+            if (file_nos[i] >= 0)  close(file_nos[i]);
+        }
+    }
+
+    free_uring(&ring);
+
+    return true;
+}
+
+static void load_assets(File_tree_resource *resource, File_list *files, File_tree_accessor *accessor)
+// Read the files into memory and make assets of them. If we can't read a file, it doesn't get an asset, and
+// serve_files() falls back to sending it from disk.
+{
+    if (!files->count)  return;
+
+    Memory_context *temp = new_context(accessor->context);
+
+    Memory_context **contexts = New(files->count, Memory_context *, temp);
+    u8_array       **contents = New(files->count, u8_array *, temp);
+
+    for (s64 i = 0; i < files->count; i++)  contexts[i] = new_context(accessor->context);
+
+    bool read_all = accessor->use_io_uring && read_files_with_uring(files, contexts, contents);
+    if (!read_all) {
+        for (s64 i = 0; i < files->count; i++)  contents[i] = load_binary_file(files->data[i]->path.data, contexts[i]);
+    }
+
+    for (s64 i = 0; i < files->count; i++) {
+        File_node *file = files->data[i];
+
+        // The asset's headers go by file->size. If the file has changed size since we looked at it, wait for the
+        // next file tree, which will have the new size.
+        if (contents[i] && contents[i]->count != file->size)  contents[i] = NULL;
+
+        if (!contents[i]) {
+            free_context(contexts[i]);
+            continue;
+        }
+
+        Asset *asset = make_asset(file, contents[i], contexts[i]);
+
+        *Set(&resource->assets, file->path.data) = asset;
+        file->user_data = asset;
+    }
+
+    free_context(temp);
+}
+
+static void add_assets(File_tree_resource *resource, File_node *node, File_tree_resource *old_resource, File_list *to_load)
+// Attach an asset to each regular file under the node. Reuse the old resource's assets for files that haven't changed.
+// Add the other files to to_load, unless they're too big to keep in memory.
+{
+    if (node->type == DIRECTORY) {
+        for (s64 i = 0; i < node->children.count; i++)  add_assets(resource, &node->children.data[i], old_resource, to_load);
+        return;
+    }
+    if (node->type != REGULAR_FILE)  return;
+
+    Asset *asset = NULL;
+
+    if (old_resource) {
+        Asset *old_asset = *Get(&old_resource->assets, node->path.data);
+        if (old_asset && old_asset->size == node->size && old_asset->modified_time == node->modified_time) {
+            __atomic_add_fetch(&old_asset->num_refs, 1, __ATOMIC_RELAXED);
+            asset = old_asset;
+        }
+    }
+
+    if (!asset) {
+        s64 MAX_ASSET_SIZE = 8*1024*1024;
+        if (node->size <= MAX_ASSET_SIZE)  *Add(to_load) = node;
+        return;
+    }
+
+    *Set(&resource->assets, node->path.data) = asset;
+    node->user_data = asset;
+}
+
+File_tree_resource *acquire_file_tree(File_tree_accessor *accessor)
+{
+    File_tree_resource *resource = NULL;
+
+    pthread_mutex_lock(&accessor->mutex);
+    {
+        // Now that we've locked the accessor's mutex, we know that the resource the accessor points
+        // to is valid and cannot be deleted while we hold the mutex. This is true because:
+        // - A resource will not be deallocated until its .num_refs reaches 0.
+        // - Every resource has its .num_refs initialised to 1 before any accessor points to it.
+        // - Every thread that accesses a resource increments .num_refs before decrementing it.
+        // - The one exception to the above point is the routine responsible for updating an
+        //   accessor's resource, which also locks the accessor's mutex and changes the accessor's
+        //   pointer before decrementing the old resource's .num_refs.
+        resource = accessor->resource;
+
+        // Increment .num_refs so the resource stays valid after we unlock the accessor's mutex.
+        pthread_mutex_lock(&resource->num_refs.mutex);
+        {
+            resource->num_refs.value += 1;
+        }
+        pthread_mutex_unlock(&resource->num_refs.mutex);
+    }
+    pthread_mutex_unlock(&accessor->mutex);
+
+    return resource;
+}
+
+void free_file_tree_resource(File_tree_resource *resource)
+{
+    assert(resource->num_refs.value == 0);
+
+    pthread_mutex_destroy(&resource->num_refs.mutex);
+    pthread_mutex_destroy(&resource->update_pending.mutex);
+
+    close_file_handles(resource->file_tree);
+
+    for (s64 i = 0; i < resource->assets.count; i++)  release_asset(resource->assets.vals[i]);
+
+    free_context(resource->context);
+}
+
+bool release_file_tree(File_tree_resource *resource)
+// Return true if we were the last one to release the resource and hence must clean it up.
+{
+    int num_refs;
+    pthread_mutex_lock(&resource->num_refs.mutex);
+    {
+        resource->num_refs.value -= 1;
+        num_refs = resource->num_refs.value;
+    }
+    pthread_mutex_unlock(&resource->num_refs.mutex);
+
+    return (num_refs == 0);
+}
+
+void refresh_file_tree(File_tree_accessor *accessor)
+// Replace the current resource on the accessor. Clean up the old resource if no-one else has a reference to it.
+{
+    Memory_context *context = new_context(accessor->context);
+
+    File_tree_resource *resource = New(File_tree_resource, context);
+    resource->context = context;
+    pthread_mutex_init(&resource->update_pending.mutex, NULL);
+
+    resource->file_tree = get_file_tree(accessor->directory, context);
+
+    // Fill the asset cache. We can look at the accessor's current resource without acquiring it, because only this
+    // function ever releases the accessor's reference to it, and only one refresh runs at a time.
+    {
+        File_tree_resource *current_resource;
+        pthread_mutex_lock(&accessor->mutex);
+        current_resource = accessor->resource;
+        pthread_mutex_unlock(&accessor->mutex);
+
+        resource->assets = (Asset_dict){.context = context};
+
+        File_list to_load = {.context = context};
+        add_assets(resource, resource->file_tree, current_resource, &to_load);
+        load_assets(resource, &to_load, accessor);
+    }
+
+    resource->time_created = get_monotonic_time();//|Todo: Maybe take this as an arg.
+    pthread_mutex_init(&resource->num_refs.mutex, NULL);
+    resource->num_refs.value = 1;
+
+    // Put the resource on the accessor.
+    File_tree_resource *old_resource;
+    pthread_mutex_lock(&accessor->mutex);
+    {
+        old_resource = accessor->resource;
+        accessor->resource = resource;
+    }
+    pthread_mutex_unlock(&accessor->mutex);
+
+    if (!old_resource)  return; // This lets us also use this function to create a resource for the first time, assuming the accessor has already been initialised except for its resource member, which should be NULL.
+
+    bool should_clean_up = release_file_tree(old_resource);
+
+    if (should_clean_up)  free_file_tree_resource(old_resource);
+}
+
+File_tree_accessor *create_file_tree_accessor(char *directory, bool use_io_uring, Memory_context *context)
+{
+    Memory_context *sub_context = new_context(context); // |Memory
+
+    File_tree_accessor *accessor = New(File_tree_accessor, sub_context);
+    accessor->context      = sub_context;
+    accessor->use_io_uring = use_io_uring;
+    pthread_mutex_init(&accessor->mutex, NULL);
+
+    // Copy the directory path, sans the trailing slash if there is one.
+    {
+        int length = strlen(directory);
+        if (directory[length-1] == '/')  length -= 1;
+
+        accessor->directory = copy_string(directory, length, context).data;
+    }
+
+    refresh_file_tree(accessor);
+
+    return accessor;
+}
+#endif
+
+void add_file_route(Server *server, char *path_pattern, char *directory)
+// Add a route to serve files under a given directory.
+//
+// We might want to make this more flexible later: directory could be a single file (which, if it won't change, we could just keep in memory for the program's lifetime!---that will mean extending the concept of a "shared resource"). Also, the path_pattern could be like "files/(?<file_name>.*)"---that is, have a special capture group that gets taken as the file path rather than the full request path.
+{
+    Regex *regex = compile_regex(path_pattern, server->context);
+    assert(regex);
+
+    Route route = {GET, path_pattern, regex, &serve_files};
+
+    route.file_tree_accessor = create_file_tree_accessor(directory, server->use_io_uring, server->context);
+
+    //|Robustness: Assert the server hasn't started.
+    *Add(&server->routes) = route;
+}
+
+static void watch_file(Server *server, s32 file_no, u32 events)
+// Add a file descriptor to the main thread's epoll interest list.
+{
+    struct epoll_event event = {.events = events, .data.fd = file_no};
+
+    int r = epoll_ctl(server->epoll_handle, EPOLL_CTL_ADD, file_no, &event);
+    if (r == -1) {
+        Fatal("Couldn't add a file descriptor to the epoll interest list (%s).", get_last_error().string);
+    }
+}
+
+static void unwatch_file(Server *server, s32 file_no)
+{
+    int r = epoll_ctl(server->epoll_handle, EPOLL_CTL_DEL, file_no, NULL);
+    if (r == -1) {
+        Fatal("Couldn't remove a file descriptor from the epoll interest list (%s).", get_last_error().string);
+    }
+}
+
+static void arm_client_socket(s32 epoll_handle, Client *client, enum Interest interest, int op)
+// Arm a client's socket for the event it's waiting for. Client sockets are edge-triggered and one-shot: once
+// epoll reports an event, the socket is disarmed until we arm it again, so epoll can never hand us a client that
+// someone else currently owns. Re-arming with EPOLL_CTL_MOD makes the kernel check readiness again, so we don't miss
+// data that arrived while the client was disarmed. op is EPOLL_CTL_ADD the first time and EPOLL_CTL_MOD after that.
+{
+    struct epoll_event event = {.events = EPOLLET|EPOLLONESHOT, .data.fd = client->socket};
+
+    if (interest == WANT_TO_READ)        event.events |= EPOLLIN;
+    else if (interest == WANT_TO_WRITE)  event.events |= EPOLLOUT;
+    else  assert(!"Unexpected interest.");
+
+    int r = epoll_ctl(epoll_handle, op, client->socket, &event);
+    if (r == -1) {
+        Fatal("Couldn't arm a client socket (%s).", get_last_error().string);
+    }
+}
+
+static s64 get_client_deadline(Client *client, enum Interest interest, s64 current_time, s64 stop_deadline)
+// When to give up waiting for a client's socket. If the server is stopping, stop_deadline is when it gives up on all
+// open connections. Otherwise it's 0.
+{
+    Server *server = client->server;
+
+    s64 deadline;
+    if (interest == WANT_TO_WRITE) {
+        deadline = current_time + server->send_timeout;
+
+        // Don't wait for the socket to become writable to find out that the client is too slow. If it's reading
+        // slowly enough, the socket might never have room for more.
+        if (client->send_rate.start) {
+            deadline = Min(deadline, get_rate_deadline(client->send_rate.num_bytes, client->send_rate.start, server->min_send_rate));
+        }
+    } else if (client->message.count) {
+        deadline = client->start_time + server->header_timeout;
+        deadline = Min(deadline, get_rate_deadline(client->message.count, client->start_time, server->min_receive_rate));
+    } else {
+        deadline = current_time + server->idle_timeout;
+    }
+
+    if (stop_deadline)  deadline = Min(deadline, stop_deadline);
+
+    return deadline;
+}
+
+static void watch_client(Server *server, Client *client, enum Interest interest, bool first_time, s64 deadline)
+// Take ownership of a client on the main thread and wait for its socket to be ready, until the deadline.
+{
+    arm_client_socket(server->epoll_handle, client, interest, first_time ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+
+    set_timer(&server->timers, &client->timer, deadline);
+
+    assert(!IsSet(&server->watched_clients, client->socket));
+    *Set(&server->watched_clients, client->socket) = client;
+}
+
+static void run_reactors(Server *server, int num_reactors);
+
+static void open_access_log(Server *server)
+{
+    s32 file_no = STDOUT_FILENO;
+
+    if (server->access_log_path) {
+        file_no = open(server->access_log_path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+        if (file_no < 0) {
+            Fatal("We couldn't open the access log %s (%s).", server->access_log_path, get_last_error().string);
+        }
+    }
+
+    server->access_log = start_access_log(file_no, server->access_log_format, server->context);
+}
+
+static void close_access_log(Server *server)
+// Call this after every thread that handles clients has finished.
+{
+    stop_access_log(server->access_log);
+
+    if (server->access_log_path)  close(server->access_log->file_no);
+
+    server->access_log = NULL;
+}
+
+static void open_trace_file(Server *server)
+{
+    if (!server->trace_path)  return;
+
+    s32 file_no = open(server->trace_path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (file_no < 0) {
+        Fatal("We couldn't open the trace file %s (%s).", server->trace_path, get_last_error().string);
+    }
+
+    server->tracer->file_no = file_no;
+}
+
+static void close_trace_file(Server *server)
+// Call this after every thread that handles clients has finished.
+{
+    if (!server->trace_path)  return;
+
+    close(server->tracer->file_no);
+    server->tracer->file_no = -1;
+}
+
+static int get_num_available_cpus()
+// How many CPUs the process is allowed to run on.
+{
+    cpu_set_t cpus;
+
+    int r = sched_getaffinity(0, sizeof(cpus), &cpus);
+    if (r == -1) {
+        log_error("We couldn't get the CPUs we can run on (%s).", get_last_error().string);
+        return Max(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+
+    return Max(CPU_COUNT(&cpus), 1);
+}
+
+static void pin_thread(pthread_t thread, int index)
+// Pin a thread to the index-th of the CPUs the process is allowed to run on, wrapping around if there aren't enough.
+{
+    cpu_set_t allowed;
+
+    int r = sched_getaffinity(0, sizeof(allowed), &allowed);
+    if (r == -1) {
+        log_error("We couldn't get the CPUs we can run on (%s).", get_last_error().string);
+        return;
+    }
+
+    int target = index % CPU_COUNT(&allowed);
+    int cpu    = 0;
+
+    for (int n = -1; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed))  n += 1;
+        if (n == target)  break;
+    }
+
+    cpu_set_t just_one;
+    CPU_ZERO(&just_one);
+    CPU_SET(cpu, &just_one);
+
+    r = pthread_setaffinity_np(thread, sizeof(just_one), &just_one);
+    if (r) {
+        log_error("We couldn't pin a thread to CPU %d (%s).", cpu, get_error_info(r).string);
+    }
+}
+
+static void start_workers(Server *server, Scheduler *scheduler, pthread_t_array *threads, int num_threads, void *(*routine)(void *), bool pin, s32 metric_id)
+// Start a pool's worker threads. Only Server.min_active_workers of them are active to begin with, so that a burst of
+// work doesn't have to wait for the sizer, and size_worker_pool() unparks the others when there's work for them. The
+// metric is the pool's gauge of active workers.
+{
+    for (int i = 0; i < num_threads; i++) {
+        pthread_t *thread = Add(threads);
+
+        int r = pthread_create(thread, NULL, routine, server);
+        if (r) {
+            Fatal("Thread creation failed (%s).", get_error_info(r).string);
+        }
+
+        if (pin)  pin_thread(*thread, i);
+    }
+
+    int num_active = Min(num_threads, server->min_active_workers);
+
+    set_num_active_workers(scheduler, num_active);
+    add_to_metric(server->metrics, metric_id, num_active);
+}
+
+static void stop_workers(Scheduler *scheduler, pthread_t_array *threads)
+// Tell a pool's worker threads that it's time to wind up, and wait for them to finish.
+{
+    // Parked workers don't take tasks, so unpark them all first.
+    set_num_active_workers(scheduler, threads->count);
+
+    for (s64 i = 0; i < threads->count; i++)  push_task(scheduler, (Task){TIME_TO_WIND_UP});
+
+    for (s64 i = 0; i < threads->count; i++) {
+        int r = pthread_join(threads->data[i], NULL);
+        if (r) {
+            Fatal("Failed to join a thread (%s).", get_error_info(r).string);
+        }
+    }
+}
+
+//
+// A sizer thread keeps each pool's number of active workers in line with its load. Every SIZER_INTERVAL milliseconds
+// it looks at each pool. If tasks are waiting and none of the active workers is idle, it unparks a worker for each
+// waiting task, up to the size of the pool. If it has found an idle worker every time it has looked for the last
+// SIZER_PATIENCE looks, it parks a worker, down to Server.min_active_workers. So pools grow quickly and shrink slowly.
+//
+#define SIZER_INTERVAL      10
+#define SIZER_PATIENCE      100     // One second.
+
+static void size_worker_pool(Server *server, Scheduler *scheduler, int num_threads, s32 metric_id, s32 *num_idle_looks)
+{
+    int num_active  = get_num_active_workers(scheduler);
+    s64 num_pending = count_pending_tasks(scheduler);
+    int num_idle    = count_idle_workers(scheduler);
+
+    int new_num_active = num_active;
+
+    if (num_idle) {
+        *num_idle_looks += 1;
+        if (*num_idle_looks >= SIZER_PATIENCE) {
+            new_num_active  = Max(num_active-1, Min(num_threads, server->min_active_workers));
+            *num_idle_looks = 0;
+        }
+    } else {
+        *num_idle_looks = 0;
+        if (num_pending)  new_num_active = Min(num_active + num_pending, num_threads);
+    }
+
+    if (new_num_active != num_active) {
+        set_num_active_workers(scheduler, new_num_active);
+        add_to_metric(server->metrics, metric_id, new_num_active - num_active);
+    }
+}
+
+static void *sizer_thread_routine(void *arg)
+{
+    Server *server = arg;
+
+    s32 num_idle_looks          = 0;
+    s32 num_blocking_idle_looks = 0;
+
+    struct timespec interval = {.tv_nsec = SIZER_INTERVAL*1000000};
+
+    while (!__atomic_load_n(&server->sizer_should_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+
+        // In reactor mode, the reactors do the work that workers otherwise would, so there's only the blocking pool.
+        if (!server->use_reactors) {
+            size_worker_pool(server, server->scheduler, server->worker_threads.count, server->metric_ids.active_workers, &num_idle_looks);
+        }
+        size_worker_pool(server, server->blocking_scheduler, server->blocking_threads.count, server->metric_ids.active_blocking_workers, &num_blocking_idle_looks);
+    }
+
+    return NULL;
+}
+
+static void start_sizer(Server *server)
+// Call this once the worker threads have started.
+{
+    int r = pthread_create(&server->sizer_thread, NULL, sizer_thread_routine, server);
+    if (r) {
+        Fatal("Thread creation failed (%s).", get_error_info(r).string);
+    }
+}
+
+static void stop_sizer(Server *server)
+{
+    __atomic_store_n(&server->sizer_should_stop, true, __ATOMIC_RELEASE);
+
+    int r = pthread_join(server->sizer_thread, NULL);
+    if (r) {
+        Fatal("Failed to join a thread (%s).", get_error_info(r).string);
+    }
+}
+
+void start_server(Server *server)
+{
+    int num_cpus = get_num_available_cpus();
+
+    int num_workers          = server->num_workers ? server->num_workers : num_cpus;
+    int num_blocking_workers = server->num_blocking_workers ? server->num_blocking_workers : 4*num_cpus;
+
+    server->min_active_workers = num_cpus;
+
+    server->scheduler          = create_scheduler(num_workers, sizeof(Task), server->context);
+    server->blocking_scheduler = create_scheduler(num_blocking_workers, sizeof(Task), server->context);
+
+    // Routes are stored by value in an array that grows as routes are added, so wait until now to set up the mutexes.
+    for (s64 i = 0; i < server->routes.count; i++) {
+        Route *route = &server->routes.data[i];
+        pthread_mutex_init(&route->admission.mutex, NULL);
+
+        route->phase_metrics = add_phase_metrics(server, route->path_pattern);
+    }
+    server->metric_ids.unrouted_phases = add_phase_metrics(server, "");
+
+    open_access_log(server);
+    open_trace_file(server);
+
+    start_workers(server, server->blocking_scheduler, &server->blocking_threads, num_blocking_workers, blocking_worker_routine, false, server->metric_ids.active_blocking_workers);
+
+    if (server->use_io_uring) {
+        server->use_reactors = true;
+
+        if (!is_uring_supported()) {
+            log_error("This kernel can't do what we need from io_uring, so we'll use epoll.");
+            server->use_io_uring = false;
+        }
+    }
+
+    if (server->use_reactors) {
+        start_sizer(server);
+        run_reactors(server, num_workers);
+        stop_sizer(server);
+        stop_workers(server->blocking_scheduler, &server->blocking_threads);
+        close_access_log(server);
+        close_trace_file(server);
+        free_response_cache(server->response_cache);
+        return;
+    }
+
+    // The main thread gets a deque of its own to push clients onto. The workers steal from it.
+    attach_to_scheduler(server->scheduler, false);
+
+    server->socket = open_listening_socket(server, false);
+
+    u32 address = server->address;
+    printf("Listening on http://%d.%d.%d.%d:%d...\n", address>>24, address>>16&0xff, address>>8&0xff, address&0xff, server->port);
+    fflush(stdout); // The access log writes to stdout without going through stdio.
+
+    start_workers(server, server->scheduler, &server->worker_threads, num_workers, worker_thread_routine, server->pin_workers, server->metric_ids.active_workers);
+    start_sizer(server);
+
+    //
+    // The main thread waits on an epoll instance. Client sockets are registered with EPOLLONESHOT, so each one is
+    // armed only while the main thread owns the client. The main thread initialises a memory context for new clients
+    // and, when epoll says a client's socket is ready, passes the client to the worker threads via the
+    // server.scheduler. Until a worker thread hands the client back via the completion channel, it
+    // owns (i.e. can modify) the Client struct and the client's memory context. Separately the server maintains
+    // server.clients, a hash table containing all open connections, keyed by the file descriptors of the open
+    // sockets, and server.watched_clients, the subset of those that the main thread currently owns. These hash tables
+    // are not threadsafe and should never be accessed by the worker threads.
+    //
+    // The SIGINT handle, the listening socket and the completion doorbell are level-triggered and stay armed.
+    //
+    watch_file(server, server->interrupt_handle,  EPOLLIN);
+    watch_file(server, server->socket,            EPOLLIN);
+    watch_file(server, server->completion_handle, EPOLLIN);
+
+    reserve_spare_file();
+
+    struct epoll_event events[64];
+
+    bool server_should_stop = false;
+    s64  stop_deadline      = 0;    // Once we're stopping, when we give up on the connections that are still open.
+
+    init_timer_wheel(&server->timers, get_monotonic_time());
+
+    while (!server_should_stop || server->clients.count) // This is the server's main loop.
+    {
+        // Wake up in time for the next client deadline. If we aren't waiting on any clients, wait indefinitely.
+        int timeout_ms = get_timer_timeout(&server->timers, get_monotonic_time());
+
+        int num_events = epoll_wait(server->epoll_handle, events, countof(events), timeout_ms);
+        if (num_events < 0) {
+            Fatal("epoll_wait failed (%s).", get_last_error().string);
+        }
+
+        s64 current_time = get_monotonic_time(); // We need to get this value after waiting.
+
+        for (int event_index = 0; event_index < num_events; event_index++) {
+            struct epoll_event *event = &events[event_index];
+
+            s32 file_no = event->data.fd;
+
+            if (file_no == server->completion_handle) {
+                // Worker threads have finished with some clients (for now). Take them all at once.
+                Client *client = take_completions(&server->completions, server->completion_handle);
+
+                while (client) {
+                    Client *next = client->completion.next;
+                    assert(*Get(&server->clients, client->socket) == client);
+
+                    enum Interest interest = client->completion.interest;
+
+                    if (interest == WANT_TO_CLOSE) {
+                        close_and_delete_client(server, client);
+                    } else {
+                        s64 deadline = get_client_deadline(client, interest, current_time, stop_deadline);
+                        watch_client(server, client, interest, false, deadline);
+                    }
+
+                    client = next;
+                }
+                continue;
+            }
+
+            if (file_no == server->socket) {
+                // New connections have arrived. Take up to MAX_ACCEPTS_PER_WAKEUP of them. If there are more, the
+                // listening socket is level-triggered, so epoll will tell us again, after we've seen to other events.
+                assert(server_should_stop == false);
+
+                for (int i = 0; i < MAX_ACCEPTS_PER_WAKEUP; i++) {
+                    u32 address;
+                    s32 client_socket = accept_connection(server, server->socket, &address);
+                    if (client_socket < 0)  break;
+
+                    bool admitted = admit_connection(server, client_socket, address);
+                    if (!admitted)  continue;
+
+                    Client *client = take_client(&server->client_pool);
+                    init_client(server, client, client->context, client_socket, current_time);
+                    client->address = address;
+
+                    assert(!IsSet(&server->clients, client_socket));
+                    *Set(&server->clients, client_socket) = client;
+
+                    add_to_metric(server->metrics, server->metric_ids.connections, 1);
+                    add_to_metric(server->metrics, server->metric_ids.open_connections, 1);
+
+                    // Rather than handing the client straight to a worker, wait until the request starts arriving.
+                    watch_client(server, client, WANT_TO_READ, true, get_client_deadline(client, WANT_TO_READ, current_time, 0));
+                }
+                continue;
+            }
+
+            if (file_no == server->interrupt_handle) {
+                // We've received a SIGINT.
+                struct signalfd_siginfo info; // |Cleanup: We don't do anything with this.
+                read(server->interrupt_handle, &info, sizeof(info));
+
+                server_should_stop = true;
+                stop_deadline      = current_time + 1000;
+
+                // In the future, don't wait on the SIGINT file descriptor or the server's socket listening for new connections.
+                unwatch_file(server, server->interrupt_handle);
+                unwatch_file(server, server->socket);
+
+                // Bring forward the deadlines of the clients we're waiting on. The others get the stop deadline when
+                // the workers hand them back.
+                for (s64 i = 0; i < server->watched_clients.count; i++) {
+                    Client *client = server->watched_clients.vals[i];
+                    set_timer(&server->timers, &client->timer, Min(client->timer.deadline, stop_deadline));
+                }
+                continue;
+            }
+
+            // Otherwise it's a client socket. Because it's one-shot, it's now disarmed and we're handing it over.
+            Client *client = *Get(&server->clients, file_no);
+            assert(client);
+            assert(*Get(&server->watched_clients, file_no) == client);
+
+            Delete(&server->watched_clients, file_no);
+            cancel_timer(&server->timers, &client->timer);
+
+            if (event->events & (EPOLLERR|EPOLLHUP)) {
+                close_and_delete_client(server, client);
+                continue;
+            }
+
+            // We can read from or write to a client socket.
+            client->timing.queued = get_monotonic_time_us();
+            push_task(server->scheduler, (Task){DEAL_WITH_A_CLIENT, .client=client});
+        }
+
+        // Close the connections whose deadlines have passed.
+        Timer *expired = expire_timers(&server->timers, get_monotonic_time());
+        while (expired) {
+            Timer *next = expired->next;
+            close_and_delete_client(server, expired->data);
+            expired = next;
+        }
+    }
+
+    // Wind up the worker threads.
+    stop_sizer(server);
+    stop_workers(server->scheduler, &server->worker_threads);
+    stop_workers(server->blocking_scheduler, &server->blocking_threads);
+
+    close_access_log(server);
+    close_trace_file(server);
+
+    // Close the server's main socket. |Cleanup: Do this earlier?
+    bool closed = !close(server->socket);
+    if (!closed) {
+        Fatal("We couldn't close our own socket (%s).", get_last_error().string);
+    }
+
+    closed = !close(server->epoll_handle);
+    if (!closed) {
+        Fatal("We couldn't close the epoll instance (%s).", get_last_error().string);
+    }
+
+    closed = !close(server->completion_handle);
+    if (!closed) {
+        Fatal("We couldn't close the completion doorbell (%s).", get_last_error().string);
+    }
+
+    free_response_cache(server->response_cache);
+}
+
+//
+// Reactor mode. Instead of one main thread that accepts connections and hands clients to worker threads through the
+// scheduler and the completion channel, each worker thread has its own listening socket, bound to the same port with
+// SO_REUSEPORT, and its own epoll instance. The kernel balances new connections between the listening sockets, and
+// each reactor deals with its clients from start to finish. Clients never change threads, so nothing about them is
+// shared. The main thread just waits for SIGINT and then tells the reactors to wind up.
+//
+// In io_uring mode, each reactor's ring has room for this many submissions, and we lend the kernel this many buffers of
+// this size to receive into. A receive that finds them all taken falls back to recv() into the client's own buffer.
+#define URING_ENTRIES       1024
+#define URING_NUM_BUFFERS   512
+#define URING_BUFFER_SIZE   4096
+
+// What each request in a reactor's ring is for. A request on a client's socket carries the Client pointer, which is
+// at least 16-byte aligned, with one of these in the low bits. The others carry only their tag.
+enum {
+    URING_RECV = 1,     // A receive into one of the reactor's buffers.
+    URING_POLLOUT,      // Waiting for a socket with a reply to send to become writable.
+    URING_ACCEPT,       // The multishot accept on the reactor's listening socket.
+    URING_DOORBELL,     // A multishot poll on the reactor's completion doorbell.
+    URING_STOP,         // A poll on the server's stop handle.
+    URING_CANCEL,       // Cancelling one of the others. We ignore these.
+};
+#define URING_TAG_MASK      15
+
+struct Reactor {
+    Server             *server;
+    Memory_context     *context;        // A child of the server's context, so reactors don't contend for the same mutex.
+
+    s32                 socket;         // This reactor's own listening socket.
+    s32                 epoll_handle;   // Not used in io_uring mode.
+
+    Uring               ring;           // Only used in io_uring mode. The reactor thread sets it up. See uring_reactor_routine().
+    Uring_buffers       recv_buffers;   // What the ring receives into. We copy what arrives onto each client's message.
+
+    Client_map          clients;        // The open connections owned by this reactor, keyed by socket.
+    Timer_wheel         timers;         // The deadlines of the clients we're waiting on.
+    Client_pool         client_pool;    // Closed clients we can reuse for new connections. See take_client().
+
+    Client             *completions;        // Clients that other threads have passed a turn on a busy route, or woken from a flight. See wake_reactor_client().
+    s32                 completion_handle;  // The doorbell for .completions. See push_completion().
+};
+
+static void wake_reactor_client(Client *client)
+// Send a client back to its reactor, which might be running on another thread, because the client has just been given
+// a turn, the request it was waiting on has finished, or a blocking worker has finished with it.
+{
+    Reactor *reactor = client->reactor;
+
+    // The reactor deals with the client straight away, so the interest doesn't matter.
+    push_completion(&reactor->completions, reactor->completion_handle, client, WANT_TO_READ);
+}
+
+static void close_reactor_client(Reactor *reactor, Client *client)
+{
+    cancel_timer(&reactor->timers, &client->timer);
+
+    if (client->admission.has_turn)  give_up_turn(client);
+
+    int r = close(client->socket);
+    if (r == -1) {
+        Fatal("We couldn't close a client socket (%s).", get_last_error().string);
+    }
+
+    release_replies(client);
+    if (client->trace)  discard_trace(client->trace);
+
+    add_to_metric(client->server->metrics, client->server->metric_ids.open_connections, -1);
+    release_connection(client->server, client->address);
+
+    Delete(&reactor->clients, client->socket);
+    give_back_client(&reactor->client_pool, client);
+}
+
+static Client *open_reactor_client(Reactor *reactor, s32 socket, u32 address, s64 current_time)
+// Set up a client for a connection the reactor has just accepted. The caller arms its socket. Return NULL if the
+// client's address already has too many connections, in which case we've closed the socket.
 {
-    File_tree_resource *resource = NULL;
+    Server *server = reactor->server;
 
-    pthread_mutex_lock(&accessor->mutex);
-    {
-        // Now that we've locked the accessor's mutex, we know that the resource the accessor points
-        // to is valid and cannot be deleted while we hold the mutex. This is true because:
-        // - A resource will not be deallocated until its .num_refs reaches 0.
-        // - Every resource has its .num_refs initialised to 1 before any accessor points to it.
-        // - Every thread that accesses a resource increments .num_refs before decrementing it.
-        // - The one exception to the above point is the routine responsible for updating an
-        //   accessor's resource, which also locks the accessor's mutex and changes the accessor's
-        //   pointer before decrementing the old resource's .num_refs.
-        resource = accessor->resource;
+    bool admitted = admit_connection(server, socket, address);
+    if (!admitted)  return NULL;
 
-        // Increment .num_refs so the resource stays valid after we unlock the accessor's mutex.
-        pthread_mutex_lock(&resource->num_refs.mutex);
-        {
-            resource->num_refs.value += 1;
-        }
-        pthread_mutex_unlock(&resource->num_refs.mutex);
-    }
-    pthread_mutex_unlock(&accessor->mutex);
+    Client *client = take_client(&reactor->client_pool);
+    init_client(server, client, client->context, socket, current_time);
+    client->reactor = reactor;
+    client->address = address;
 
-    return resource;
+    assert(!IsSet(&reactor->clients, socket));
+    *Set(&reactor->clients, socket) = client;
+
+    add_to_metric(server->metrics, server->metric_ids.connections, 1);
+    add_to_metric(server->metrics, server->metric_ids.open_connections, 1);
+
+    return client;
 }
 
-void free_file_tree_resource(File_tree_resource *resource)
+static void arm_uring_client(Reactor *reactor, Client *client, enum Interest interest)
+// In io_uring mode, ask the kernel to receive on a client's socket, or to tell us when it's writable. There's only ever
+// one request in flight per client, so when it comes back we know the client is ours to deal with.
 {
-    assert(resource->num_refs.value == 0);
+    assert(!client->uring.pending);
 
-    pthread_mutex_destroy(&resource->num_refs.mutex);
-    pthread_mutex_destroy(&resource->update_pending.mutex);
+    struct io_uring_sqe *sqe = get_sqe(&reactor->ring);
 
-    free_context(resource->context);
+    if (interest == WANT_TO_READ) {
+        client->uring.pending = (u64)client | URING_RECV;
+        prep_recv_buffer(sqe, client->socket, &reactor->recv_buffers, client->uring.pending);
+    } else {
+        client->uring.pending = (u64)client | URING_POLLOUT;
+        prep_poll(sqe, client->socket, POLLOUT, false, client->uring.pending);
+    }
 }
 
-bool release_file_tree(File_tree_resource *resource)
-// Return true if we were the last one to release the resource and hence must clean it up.
+static void deal_with_reactor_client(Reactor *reactor, Client *client, s64 stop_deadline, bool received)
+// If received is true, whatever arrived on the socket is already on client.message (in io_uring mode).
 {
-    int num_refs;
-    pthread_mutex_lock(&resource->num_refs.mutex);
-    {
-        resource->num_refs.value -= 1;
-        num_refs = resource->num_refs.value;
+    current_trace = client->trace;
+
+    bool still_ours = received ? advance_client(client) : deal_with_client(client);
+
+    current_trace = NULL;
+
+    if (!still_ours)  return; // It's waiting for a turn or an identical request. We'll get it back through .completions.
+
+    if (client->phase == READY_TO_CLOSE) {
+        close_reactor_client(reactor, client);
+    } else {
+        enum Interest interest = get_interest(client);
+        if (reactor->server->use_io_uring)  arm_uring_client(reactor, client, interest);
+        else                                arm_client_socket(reactor->epoll_handle, client, interest, EPOLL_CTL_MOD);
+
+        s64 deadline = get_client_deadline(client, interest, get_monotonic_time(), stop_deadline);
+        set_timer(&reactor->timers, &client->timer, deadline);
     }
-    pthread_mutex_unlock(&resource->num_refs.mutex);
+}
 
-    return (num_refs == 0);
+static void run_background_tasks(Server *server)
+// Request handlers can still give background tasks (like refreshing a file tree) to the scheduler.
+// No worker thread is waiting for tasks in reactor mode, so each reactor picks them up between events.
+{
+    Task task;
+    while (try_pop_task(server->scheduler, &task)) {
+        if (task.type == REVALIDATE_RESPONSE) {
+            revalidate_response(task.client);
+            continue;
+        }
+        assert(task.type == REFRESH_FILE_TREE);
+        refresh_file_tree(task.file_tree_accessor);
+    }
 }
 
-void refresh_file_tree(File_tree_accessor *accessor)
-// Replace the current resource on the accessor. Clean up the old resource if no-one else has a reference to it.
+static void *reactor_thread_routine(void *arg)
+// In reactor mode, each worker thread runs this loop instead of popping tasks from the scheduler.
 {
-    Memory_context *context = new_context(accessor->context);
+    Reactor *reactor = arg;
+    Server  *server  = reactor->server;
+
+    // The stop handle is shared between all the reactors. It's level-triggered and nobody reads it, so once the
+    // main thread writes to it, it wakes up every reactor.
+    s32 files_to_watch[] = {reactor->socket, server->stop_handle, reactor->completion_handle};
+    for (s64 i = 0; i < countof(files_to_watch); i++) {
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = files_to_watch[i]};
+
+        int r = epoll_ctl(reactor->epoll_handle, EPOLL_CTL_ADD, files_to_watch[i], &event);
+        if (r == -1) {
+            Fatal("Couldn't add a file descriptor to the epoll interest list (%s).", get_last_error().string);
+        }
+    }
 
-    File_tree_resource *resource = New(File_tree_resource, context);
-    resource->context = context;
-    pthread_mutex_init(&resource->update_pending.mutex, NULL);
+    reserve_spare_file();
 
-    resource->file_tree = get_file_tree(accessor->directory, context);
+    struct epoll_event events[64];
 
-    resource->time_created = get_monotonic_time();//|Todo: Maybe take this as an arg.
-    pthread_mutex_init(&resource->num_refs.mutex, NULL);
-    resource->num_refs.value = 1;
+    bool reactor_should_stop = false;
+    s64  stop_deadline       = 0;
 
-    // Put the resource on the accessor.
-    File_tree_resource *old_resource;
-    pthread_mutex_lock(&accessor->mutex);
+    init_timer_wheel(&reactor->timers, get_monotonic_time());
+
+    while (!reactor_should_stop || reactor->clients.count)
     {
-        old_resource = accessor->resource;
-        accessor->resource = resource;
-    }
-    pthread_mutex_unlock(&accessor->mutex);
+        int timeout_ms = get_timer_timeout(&reactor->timers, get_monotonic_time());
 
-    if (!old_resource)  return; // This lets us also use this function to create a resource for the first time, assuming the accessor has already been initialised except for its resource member, which should be NULL.
+        int num_events = epoll_wait(reactor->epoll_handle, events, countof(events), timeout_ms);
+        if (num_events < 0) {
+            Fatal("epoll_wait failed (%s).", get_last_error().string);
+        }
 
-    bool should_clean_up = release_file_tree(old_resource);
+        s64 current_time = get_monotonic_time();
 
-    if (should_clean_up)  free_file_tree_resource(old_resource);
-}
+        for (int event_index = 0; event_index < num_events; event_index++) {
+            struct epoll_event *event = &events[event_index];
 
-File_tree_accessor *create_file_tree_accessor(char *directory, Memory_context *context)
-{
-    Memory_context *sub_context = new_context(context); // |Memory
+            s32 file_no = event->data.fd;
 
-    File_tree_accessor *accessor = New(File_tree_accessor, sub_context);
-    accessor->context = sub_context;
-    pthread_mutex_init(&accessor->mutex, NULL);
+            if (file_no == server->stop_handle) {
+                reactor_should_stop = true;
+                stop_deadline       = current_time + 1000;
 
-    // Copy the directory path, sans the trailing slash if there is one.
-    {
-        int length = strlen(directory);
-        if (directory[length-1] == '/')  length -= 1;
+                // Bring forward the deadlines of the clients we're waiting on. The others are waiting for a turn or
+                // running on a blocking worker, and whoever has them could still be using them. They get the stop
+                // deadline when they come back through .completions.
+                for (s64 i = 0; i < reactor->clients.count; i++) {
+                    Client *client = reactor->clients.vals[i];
+                    if (!client->timer.prev)  continue;
 
-        accessor->directory = copy_string(directory, length, context).data;
+                    set_timer(&reactor->timers, &client->timer, Min(client->timer.deadline, stop_deadline));
+                }
+
+                int r = epoll_ctl(reactor->epoll_handle, EPOLL_CTL_DEL, server->stop_handle, NULL);
+                if (r == -1) {
+                    Fatal("Couldn't remove a file descriptor from the epoll interest list (%s).", get_last_error().string);
+                }
+
+                // Close our listening socket so the kernel sends new connections to the reactors that are still open.
+                // This also removes the socket from our epoll instance.
+                bool closed = !close(reactor->socket);
+                if (!closed) {
+                    Fatal("We couldn't close our own socket (%s).", get_last_error().string);
+                }
+                continue;
+            }
+
+            if (file_no == reactor->completion_handle) {
+                // Other threads have passed turns on busy routes to some of our clients, or blocking workers have
+                // finished with them.
+                Client *client = take_completions(&reactor->completions, reactor->completion_handle);
+
+                while (client) {
+                    Client *next = client->completion.next;
+                    deal_with_reactor_client(reactor, client, stop_deadline, false);
+                    client = next;
+                }
+                continue;
+            }
+
+            if (file_no == reactor->socket) {
+                // New connections have arrived. Take a batch of them, as in start_server().
+                assert(reactor_should_stop == false);
+
+                for (int i = 0; i < MAX_ACCEPTS_PER_WAKEUP; i++) {
+                    u32 address;
+                    s32 client_socket = accept_connection(server, reactor->socket, &address);
+                    if (client_socket < 0)  break;
+
+                    Client *client = open_reactor_client(reactor, client_socket, address, current_time);
+                    if (!client)  continue;
+
+                    arm_client_socket(reactor->epoll_handle, client, WANT_TO_READ, EPOLL_CTL_ADD);
+                    set_timer(&reactor->timers, &client->timer, get_client_deadline(client, WANT_TO_READ, current_time, 0));
+                }
+                continue;
+            }
+
+            Client *client = *Get(&reactor->clients, file_no);
+            assert(client);
+
+            cancel_timer(&reactor->timers, &client->timer);
+
+            if (event->events & (EPOLLERR|EPOLLHUP)) {
+                close_reactor_client(reactor, client);
+                continue;
+            }
+
+            deal_with_reactor_client(reactor, client, stop_deadline, false);
+        }
+
+        run_background_tasks(server);
+
+        // Close the connections whose deadlines have passed.
+        Timer *expired = expire_timers(&reactor->timers, get_monotonic_time());
+        while (expired) {
+            Timer *next = expired->next;
+            close_reactor_client(reactor, expired->data);
+            expired = next;
+        }
     }
 
-    refresh_file_tree(accessor);
+    bool closed = !close(reactor->epoll_handle);
+    if (!closed) {
+        Fatal("We couldn't close a reactor's epoll instance (%s).", get_last_error().string);
+    }
 
-    return accessor;
+    closed = !close(reactor->completion_handle);
+    if (!closed) {
+        Fatal("We couldn't close a reactor's completion doorbell (%s).", get_last_error().string);
+    }
+
+    release_spare_file();
+
+    return NULL;
 }
-#endif
 
-void add_file_route(Server *server, char *path_pattern, char *directory)
-// Add a route to serve files under a given directory.
-//
-// We might want to make this more flexible later: directory could be a single file (which, if it won't change, we could just keep in memory for the program's lifetime!---that will mean extending the concept of a "shared resource"). Also, the path_pattern could be like "files/(?<file_name>.*)"---that is, have a special capture group that gets taken as the file path rather than the full request path.
+static void close_uring_client(Reactor *reactor, Client *client)
+// In io_uring mode, close a client, unless the kernel still has a request on its socket. Then cancel the request and
+// close the client when it comes back, so that it can't come back for a client we've since reused.
 {
-    Regex *regex = compile_regex(path_pattern, server->context);
-    assert(regex);
-
-    Route route = {GET, regex, &serve_files};
+    if (!client->uring.pending) {
+        close_reactor_client(reactor, client);
+        return;
+    }
 
-    route.file_tree_accessor = create_file_tree_accessor(directory, server->context);
+    cancel_timer(&reactor->timers, &client->timer);
 
-    //|Robustness: Assert the server hasn't started.
-    *Add(&server->routes) = route;
+    if (!client->uring.closing) {
+        prep_cancel(get_sqe(&reactor->ring), client->uring.pending, URING_CANCEL);
+        client->uring.closing = true;
+    }
 }
 
-void start_server(Server *server)
+static void *uring_reactor_routine(void *arg)
+// In io_uring mode, each reactor runs this loop instead of reactor_thread_routine(). Rather than wait for sockets to
+// be ready and then make a system call on each one, we hand the kernel our accepts and receives up front, and it tells
+// us when they're done. Everything we queue goes in with the one system call we make to wait.
+//
+// Replies still go out through send_replies(), which gathers a client's replies into one writev() and sends bodies on
+// disk with sendfile(). We only ask the ring to tell us when a socket that was full can take more.
 {
-    //
-    // The pollfds array is both the array of file descriptors passed to poll() and the authoritative list
-    // of the clients currently owned by the main thread. The main thread initialises a memory context for
-    // new clients and then passes them to worker threads via the server.task_queue. Until a worker thread
-    // sends the client pointer back to the server via the worker pipe, it owns (i.e. can modify) the
-    // Client struct and the client's memory context. Separately the server maintains server.clients, a
-    // hash table containing all open connections, keyed by the file descriptors of the open sockets. This
-    // hash table is not threadsafe and should never be accessed by the worker threads.
-    //
-    Array(struct pollfd) pollfds = {.context = server->context};
+    Reactor *reactor = arg;
+    Server  *server  = reactor->server;
+    Uring   *ring    = &reactor->ring;
 
-    // The first three members of this array don't change. Note that we will iterate backwards when checking
-    // poll events, so we put the SIGINT handle first because it rarely needs to be checked.
-    *Add(&pollfds) = (struct pollfd){.fd = server->interrupt_handle, .events = POLLIN};
-    *Add(&pollfds) = (struct pollfd){.fd = server->socket,           .events = POLLIN};
-    *Add(&pollfds) = (struct pollfd){.fd = server->worker_pipe[0],   .events = POLLIN};
+    // A ring belongs to the thread that sets it up. start_server() has already checked that we can.
+    bool ok = init_uring(ring, URING_ENTRIES);
+    ok = ok && init_provided_buffers(&reactor->recv_buffers, ring, 0, URING_NUM_BUFFERS, URING_BUFFER_SIZE);
+    if (!ok)  Fatal("We couldn't set up io_uring on a reactor.");
 
-    s64 non_client_pollfds_count = pollfds.count; // Any other elements in this array are open client connections.
+    reserve_spare_file();
 
-    bool server_should_stop = false;
+    prep_multishot_accept(get_sqe(ring), reactor->socket, SOCK_NONBLOCK|SOCK_CLOEXEC, URING_ACCEPT);
+    prep_poll(get_sqe(ring), reactor->completion_handle, POLLIN, true, URING_DOORBELL);
+    prep_poll(get_sqe(ring), server->stop_handle, POLLIN, false, URING_STOP);
 
-    while (!server_should_stop || server->clients.count) // This is the server's main loop.
+    bool reactor_should_stop = false;
+    s64  stop_deadline       = 0;
+
+    init_timer_wheel(&reactor->timers, get_monotonic_time());
+
+    while (!reactor_should_stop || reactor->clients.count)
     {
-        // If there are open connections, poll twice per second so we can keep checking whether
-        // any connections have timed out. Otherwise wait indefinitely.
-        int timeout_ms = (server->clients.count > 0) ? 500 : -1;
+        int timeout_ms = get_timer_timeout(&reactor->timers, get_monotonic_time());
 
-        int num_events = poll(pollfds.data, pollfds.count, timeout_ms);
-        if (num_events < 0) {
-            Fatal("poll failed (%s).", get_last_error().string);
-        }
+        submit_and_wait(ring, 1, timeout_ms);
 
-        s64 current_time = get_monotonic_time(); // We need to get this value after polling.
+        s64 current_time = get_monotonic_time();
 
-        for (s64 pollfd_index = pollfds.count-1; pollfd_index >= 0; pollfd_index -= 1) { // Iterate backwards so we can delete from the array.
-            if (num_events == 0)  break;
+        struct io_uring_cqe *cqe;
+        while ((cqe = peek_cqe(ring))) {
+            // Copy the completion and give its slot back before we deal with it.
+            u64 user_data = cqe->user_data;
+            s32 result    = cqe->res;
+            u32 flags     = cqe->flags;
+            advance_cqe(ring);
 
-            struct pollfd *pollfd = &pollfds.data[pollfd_index];
+            u64     tag    = user_data & URING_TAG_MASK;
+            Client *client = (Client *)(user_data & ~(u64)URING_TAG_MASK);
 
-            if (!pollfd->revents)  continue;
-            else  num_events -= 1;
+            if (tag == URING_CANCEL)  continue;
 
-            if (pollfd->revents & (POLLERR|POLLHUP|POLLNVAL)) {
-                Client *client = *Get(&server->clients, pollfd->fd);
-                close_and_delete_client(server, client);
-                array_unordered_remove_by_index(&pollfds, pollfd_index);
+            if (tag == URING_STOP) {
+                reactor_should_stop = true;
+                stop_deadline       = current_time + 1000;
+
+                // As in reactor_thread_routine(), leave the clients we aren't waiting on to whoever has them.
+                for (s64 i = 0; i < reactor->clients.count; i++) {
+                    Client *client = reactor->clients.vals[i];
+                    if (!client->timer.prev)  continue;
+
+                    set_timer(&reactor->timers, &client->timer, Min(client->timer.deadline, stop_deadline));
+                }
+
+                // Stop accepting and close our listening socket so the kernel sends new connections to the reactors
+                // that are still open. The socket only really closes once the accept has been cancelled.
+                prep_cancel(get_sqe(ring), URING_ACCEPT, URING_CANCEL);
+
+                bool closed = !close(reactor->socket);
+                if (!closed) {
+                    Fatal("We couldn't close our own socket (%s).", get_last_error().string);
+                }
                 continue;
             }
 
-            if (pollfd->fd == server->worker_pipe[0]) {
-                // A worker thread is letting us know that they've finished with a client (for now).
-                Client *client;
-                s64 num_bytes_read = read(server->worker_pipe[0], &client, sizeof(client));
-                if (num_bytes_read == -1) {
-                    Fatal("We couldn't read from the worker pipe (%s).\n", get_last_error().string);
-                } //|Todo: Make sure we read the whole pointer.
-                assert(*Get(&server->clients, client->socket) == client);
-
-                if (client->phase == READY_TO_CLOSE) {
-                    close_and_delete_client(server, client);
-                } else {
-                    struct pollfd pollfd = {.fd = client->socket};
-
-                    if (client->phase == PARSING_REQUEST)     pollfd.events |= POLLIN;
-                    else if (client->phase == SENDING_REPLY)  pollfd.events |= POLLOUT;
-                    else  assert(!"Unexpected request phase.");
-
-                    *Add(&pollfds) = pollfd;
+            if (tag == URING_DOORBELL) {
+                // As in reactor_thread_routine(). The kernel ends a multishot poll if it runs out of room to post
+                // completions, in which case we start another.
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    prep_poll(get_sqe(ring), reactor->completion_handle, POLLIN, true, URING_DOORBELL);
+                }
+
+                Client *client = take_completions(&reactor->completions, reactor->completion_handle);
+
+                while (client) {
+                    Client *next = client->completion.next;
+                    deal_with_reactor_client(reactor, client, stop_deadline, false);
+                    client = next;
                 }
                 continue;
             }
 
-            if (pollfd->fd == server->socket) {
-                // A new connection has occurred.
-                assert(server_should_stop == false);
-
-                struct sockaddr_in client_socket_addr; // This will be initialised by accept().
-                socklen_t client_socket_addr_size = sizeof(client_socket_addr);
+            if (tag == URING_ACCEPT) {
+                if (result >= 0) {
+                    // A multishot accept doesn't tell us who connected, so only ask if we need to know.
+                    u32 address = server->max_connections_per_ip ? get_peer_address(result) : 0;
+
+                    Client *client = open_reactor_client(reactor, result, address, current_time);
+                    if (client) {
+                        arm_uring_client(reactor, client, WANT_TO_READ);
+                        set_timer(&reactor->timers, &client->timer, get_client_deadline(client, WANT_TO_READ, current_time, stop_deadline));
+                    }
+                } else if ((result == -EMFILE || result == -ENFILE) && !reactor_should_stop) {
+                    // We've run out of file descriptors. accept_connection() knows how to turn away the connections
+                    // that are waiting, and takes any it can.
+                    for (int i = 0; i < MAX_ACCEPTS_PER_WAKEUP; i++) {
+                        u32 address;
+                        s32 client_socket = accept_connection(server, reactor->socket, &address);
+                        if (client_socket < 0)  break;
+
+                        Client *client = open_reactor_client(reactor, client_socket, address, current_time);
+                        if (!client)  continue;
+
+                        arm_uring_client(reactor, client, WANT_TO_READ);
+                        set_timer(&reactor->timers, &client->timer, get_client_deadline(client, WANT_TO_READ, current_time, stop_deadline));
+                    }
+                } else if (result != -ECANCELED) {
+                    log_error("We couldn't accept a connection (%s).", get_error_info(-result).string);
+                }
 
-                int client_socket = accept(server->socket, (struct sockaddr *)&client_socket_addr, &client_socket_addr_size);
-                if (client_socket < 0) {
-                    Fatal("poll() said we could read from our main socket, but we couldn't get a new connection (%s).", get_last_error().string);
+                // The kernel ends a multishot accept after an error. Start another, unless we're closing the socket.
+                if (!(flags & IORING_CQE_F_MORE) && !reactor_should_stop) {
+                    prep_multishot_accept(get_sqe(ring), reactor->socket, SOCK_NONBLOCK|SOCK_CLOEXEC, URING_ACCEPT);
                 }
+                continue;
+            }
 
-                set_blocking(client_socket, false);
+            // Otherwise it's the request we had in flight on a client's socket.
+            assert(tag == URING_RECV || tag == URING_POLLOUT);
+            assert(client->uring.pending == user_data);
 
-                Client *client = New(Client, server->context);
-                init_client(server, client, new_context(server->context), client_socket, current_time);
+            client->uring.pending = 0;
 
-                assert(!IsSet(&server->clients, client_socket));
-                *Set(&server->clients, client_socket) = client;
-                add_to_queue(server->task_queue, (Task){DEAL_WITH_A_CLIENT, .client=client});
-                continue;
+            if (flags & IORING_CQE_F_BUFFER) {
+                u16 buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+                if (result > 0 && !client->uring.closing) {
+                    add_received_bytes(client, get_provided_buffer(&reactor->recv_buffers, buffer_id), result);
+                }
+                give_back_buffer(&reactor->recv_buffers, buffer_id);
             }
 
-            if (pollfd->fd == server->interrupt_handle) {
-                // We've received a SIGINT.
-                struct signalfd_siginfo info; // |Cleanup: We don't do anything with this.
-                read(server->interrupt_handle, &info, sizeof(info));
+            if (client->uring.closing) {
+                close_reactor_client(reactor, client);
+                continue;
+            }
 
-                server_should_stop = true;
+            cancel_timer(&reactor->timers, &client->timer);
 
-                // In the future, don't poll the SIGINT file descriptor or the server's socket listening for new connections.
-                assert(pollfds.data[0].fd == server->interrupt_handle);
-                pollfds.data[0].events = 0;
-                assert(pollfds.data[1].fd == server->socket);
-                pollfds.data[1].events = 0;
+            if (tag == URING_RECV) {
+                if (result == -ENOBUFS) {
+                    // Every one of our buffers is in use. Let the client receive into its own.
+                    deal_with_reactor_client(reactor, client, stop_deadline, false);
+                    continue;
+                }
+                if (result <= 0) {
+                    // There was an error (result < 0) or the client disconnected (result == 0). A reset is just the
+                    // client going away without reading everything we sent, which epoll mode doesn't report either.
+                    if (result < 0 && result != -ECONNRESET) {
+                        log_error("We failed to read from a socket (%s).", get_error_info(-result).string);
+                    }
+                    close_reactor_client(reactor, client);
+                    continue;
+                }
+                deal_with_reactor_client(reactor, client, stop_deadline, true);
                 continue;
             }
 
-            if (pollfd->revents & (POLLIN|POLLOUT)) {
-                // We can read from or write to a client socket.
-                Client *client = *Get(&server->clients, pollfd->fd);
-                assert(client);
-                add_to_queue(server->task_queue, (Task){DEAL_WITH_A_CLIENT, .client=client});
-                array_unordered_remove_by_index(&pollfds, pollfd_index);
-                continue; //|Cleanup: We continue in every case?
+            if (result < 0 || (result & (POLLERR|POLLHUP))) {
+                close_reactor_client(reactor, client);
+                continue;
             }
+            deal_with_reactor_client(reactor, client, stop_deadline, false);
         }
 
-        // Remove connections that have expired.
-        for (s64 pollfd_index = pollfds.count-1; pollfd_index >= non_client_pollfds_count; pollfd_index -= 1) {
-            struct pollfd *pollfd = &pollfds.data[pollfd_index];
-            assert(!pollfd->revents); // We should have removed any pollfds with returned events.
+        run_background_tasks(server);
 
-            Client *client = *Get(&server->clients, pollfd->fd);
-            assert(client);
+        // Close the connections whose deadlines have passed.
+        Timer *expired = expire_timers(&reactor->timers, get_monotonic_time());
+        while (expired) {
+            Timer *next = expired->next;
+            close_uring_client(reactor, expired->data);
+            expired = next;
+        }
+    }
 
-            s64 request_age = current_time - client->start_time;
-            s64 max_age     = (server_should_stop) ? 1000 : 15000;
+    free_provided_buffers(&reactor->recv_buffers);
+    free_uring(ring);
 
-            if (request_age > max_age) {
-                close_and_delete_client(server, client);
-                array_unordered_remove_by_index(&pollfds, pollfd_index);
+    bool closed = !close(reactor->completion_handle);
+    if (!closed) {
+        Fatal("We couldn't close a reactor's completion doorbell (%s).", get_last_error().string);
+    }
+
+    release_spare_file();
+
+    return NULL;
+}
+
+static void run_reactors(Server *server, int num_reactors)
+// start_server() calls this instead of running its own event loop if server.use_reactors is true.
+{
+    server->stop_handle = eventfd(0, EFD_NONBLOCK);
+    if (server->stop_handle == -1) {
+        Fatal("Couldn't create an eventfd (%s).", get_last_error().string);
+    }
+
+    server->reactors = (Reactor_array){.context = server->context};
+    array_reserve(&server->reactors, num_reactors); // Reserve up front because the threads hold pointers into the array.
+
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor *reactor = Add(&server->reactors);
+
+        *reactor = (Reactor){.server = server};
+        reactor->context      = new_context(server->context);
+        reactor->socket       = open_listening_socket(server, true);
+        reactor->clients      = (Client_map){.context = reactor->context, .binary_mode = true};
+        reactor->client_pool  = (Client_pool){.context = reactor->context};
+        reactor->epoll_handle = -1;
+
+        if (!server->use_io_uring) {
+            reactor->epoll_handle = epoll_create1(0);
+            if (reactor->epoll_handle == -1) {
+                Fatal("Couldn't create an epoll instance (%s).", get_last_error().string);
             }
         }
+
+        reactor->completion_handle = eventfd(0, EFD_NONBLOCK);
+        if (reactor->completion_handle == -1) {
+            Fatal("Couldn't create an eventfd (%s).", get_last_error().string);
+        }
     }
 
-    // Signal to the worker threads that it's time to wind up.
-    for (s64 i = 0; i < server->worker_threads.count; i++)  add_to_queue(server->task_queue, (Task){TIME_TO_WIND_UP});
+    u32 address = server->address;
+    printf("Listening on http://%d.%d.%d.%d:%d with %d reactors%s...\n", address>>24, address>>16&0xff, address>>8&0xff, address&0xff, server->port, num_reactors, server->use_io_uring ? " on io_uring" : "");
+    fflush(stdout); // The access log writes to stdout without going through stdio.
 
-    // Join the worker threads.
-    for (int i = 0; i < server->worker_threads.count; i++) {
+    for (int i = 0; i < num_reactors; i++) {
+        pthread_t *thread = Add(&server->worker_threads);
+
+        void *(*routine)(void *) = server->use_io_uring ? uring_reactor_routine : reactor_thread_routine;
+
+        int r = pthread_create(thread, NULL, routine, &server->reactors.data[i]);
+        if (r) {
+            Fatal("Thread creation failed (%s).", get_error_info(r).string);
+        }
+
+        if (server->pin_workers)  pin_thread(*thread, i);
+    }
+
+    // Wait for SIGINT.
+    watch_file(server, server->interrupt_handle, EPOLLIN);
+    while (true) {
+        struct epoll_event event;
+        int num_events = epoll_wait(server->epoll_handle, &event, 1, -1);
+        if (num_events < 0) {
+            if (errno == EINTR)  continue;
+            Fatal("epoll_wait failed (%s).", get_last_error().string);
+        }
+        if (num_events == 1)  break;
+    }
+
+    struct signalfd_siginfo info;
+    read(server->interrupt_handle, &info, sizeof(info));
+
+    // Wake up every reactor.
+    s64 num_bytes_written = write(server->stop_handle, &(u64){1}, sizeof(u64));
+    if (num_bytes_written == -1) {
+        Fatal("We couldn't write to the stop handle (%s).", get_last_error().string);
+    }
+
+    for (s64 i = 0; i < server->worker_threads.count; i++) {
         int r = pthread_join(server->worker_threads.data[i], NULL);
         if (r) {
             Fatal("Failed to join a thread (%s).", get_error_info(r).string);
         }
     }
 
-    // Close the server's main socket. |Cleanup: Do this earlier?
-    bool closed = !close(server->socket);
+    for (s64 i = 0; i < server->reactors.count; i++)  free_context(server->reactors.data[i].context);
+
+    bool closed = !close(server->stop_handle);
     if (!closed) {
-        Fatal("We couldn't close our own socket (%s).", get_last_error().string);
+        Fatal("We couldn't close the stop handle (%s).", get_last_error().string);
+    }
+
+    closed = !close(server->epoll_handle);
+    if (!closed) {
+        Fatal("We couldn't close the epoll instance (%s).", get_last_error().string);
     }
 }
 
@@ -1022,6 +4402,39 @@ Response create_index_page(File_node *file_node, Memory_context *context)
     return (Response){200, .headers=headers, .body=doc.data, .size=doc.count};
 }
 
+static Response serve_asset(Client *client, Asset *asset)
+// Pick the best encoding of a cached file for the client. If the client already has it, reply 304 Not Modified.
+{
+    Memory_context *context = client->context;
+    Request        *request = &client->request;
+
+    Asset_variant *variant = &asset->identity;
+    if (asset->brotli.bytes.count && accepts_encoding(request, "br"))       variant = &asset->brotli;
+    else if (asset->gzip.bytes.count && accepts_encoding(request, "gzip"))  variant = &asset->gzip;
+
+    string_dict headers = {.context = context};
+
+    *Set(&headers, "etag")          = variant->etag;
+    *Set(&headers, "last-modified") = asset->last_modified;
+    *Set(&headers, "cache-control") = "no-cache"; // Browsers can keep a copy, but they should check with us before using it. With the ETag, checking is cheap.
+    if (asset->content_type)  *Set(&headers, "content-type")     = asset->content_type;
+    if (variant->encoding)    *Set(&headers, "content-encoding") = variant->encoding;
+
+    if (asset->gzip.bytes.count || asset->brotli.bytes.count)  *Set(&headers, "vary") = "accept-encoding";
+
+    Header *if_none_match = NULL;
+    while ((if_none_match = get_header(request, "if-none-match", if_none_match))) {
+        // The header is a list of ETags. Since we only need a weak comparison here, it's enough that ours is in there.
+        char *value = if_none_match->value;
+        s32   size  = if_none_match->value_size;
+
+        bool not_modified = (size == 1 && *value == '*') || memmem(value, size, variant->etag, strlen(variant->etag));
+        if (not_modified)  return (Response){304, .headers=headers};
+    }
+
+    return (Response){200, .headers=headers, .body=variant->bytes.data, .size=variant->bytes.count};
+}
+
 Response serve_files(Client *client)
 {
     File_tree_accessor *accessor = client->route->file_tree_accessor;
@@ -1051,8 +4464,7 @@ Response serve_files(Client *client)
     }
 
     if (we_should_update) {
-        Task_queue *task_queue = client->server->task_queue;
-        add_to_queue(task_queue, (Task){REFRESH_FILE_TREE, .file_tree_accessor=accessor});
+        push_task(client->server->scheduler, (Task){REFRESH_FILE_TREE, .file_tree_accessor=accessor});
     }
 
     Memory_context *context = client->context;
@@ -1097,35 +4509,34 @@ Response serve_files(Client *client)
         goto done;
     }
 
-    u8_array *file = load_binary_file(file_node->path.data, context);
-    if (!file) {
+    if (file_node->user_data) {
+        // The file is in our asset cache. The response points into the asset, which belongs to the file tree, so
+        // the response holds on to our reference to the tree until the server has sent it.
+        response = serve_asset(client, file_node->user_data);
+        response.file_tree = resource;
+        goto done;
+    }
+
+    // The file is too big for the cache. Send it straight from the page cache with sendfile(). The open file belongs
+    // to the file tree, so again the response holds on to our reference to the tree.
+    s32 file_handle = get_file_handle(file_node);
+    if (file_handle < 0) {
         char static body[] = "That file is on our list, yet it doesn't exist.\n";
         response = (Response){500, .body=body, .size=lengthof(body)};
         goto done;
     }
 
-    response = (Response){200, .body=file->data, .size=file->count};
-
-    char *content_type = NULL;
-    for (s64 i = file_node->path.count-1; i >= 0; i--) {
-        if (file_node->path.data[i] == '/')  break;
-        if (file_node->path.data[i] != '.')  continue;
+    response = (Response){200, .size=file_node->size, .file=file_node, .file_tree=resource};
 
-        char *file_extension = &file_node->path.data[i+1];
-
-        if (!strcmp(file_extension, "html"))       content_type = "text/html";
-        else if (!strcmp(file_extension, "js"))    content_type = "text/javascript";
-        else if (!strcmp(file_extension, "json"))  content_type = "application/json";
-        else if (!strcmp(file_extension, "ttf"))   content_type = "font/ttf";
-
-        break;
-    }
+    char *content_type = get_content_type(file_node->path.data);
     if (content_type) {
         response.headers = (string_dict){.context = context};
         *Set(&response.headers, "content-type") = content_type;
     }
 
 done:;
+    if (response.file_tree)  return response; // The server will release the file tree after sending the response.
+
     bool should_clean_up = release_file_tree(resource);
 
     if (should_clean_up) {
@@ -1137,6 +4548,54 @@ done:;
     return response;
 }
 
+Response serve_metrics(Client *client)
+// Report the server's metrics in the Prometheus text format.
+{
+    char_array out = {.context = client->context};
+    array_reserve(&out, 64*1024);
+
+    write_metrics(client->server->metrics, &out);
+
+    Response response = {200, .body = out.data, .size = out.count};
+
+    response.headers = (string_dict){.context = client->context};
+    *Set(&response.headers, "content-type") = "text/plain; version=0.0.4";
+
+    return response;
+}
+
+Response serve_trace(Client *client)
+// Report the requests we've traced lately, in the Chrome trace-event format. Load the result in chrome://tracing or
+// ui.perfetto.dev. To change how many requests we trace, pass ?sample_every=n to trace one in n, or 0 to stop. The
+// route should be .local_only, since this changes what the server does.
+{
+    Tracer *tracer = client->server->tracer;
+
+    char *sample_every = *Get(&client->request.query_params, "sample_every");
+    if (sample_every) {
+        char *end = NULL;
+        long  n   = strtol(sample_every, &end, 10);
+        if (*sample_every == '\0' || *end != '\0' || n < 0 || n > INT32_MAX) {
+            char static body[] = "sample_every should be a whole number of requests, or 0 to stop tracing.\n";
+            return (Response){400, .body = body, .size = lengthof(body)};
+        }
+
+        set_trace_sampling(tracer, n);
+    }
+
+    char_array out = {.context = client->context};
+    array_reserve(&out, 64*1024);
+
+    write_chrome_trace(tracer, &out);
+
+    Response response = {200, .body = out.data, .size = out.count};
+
+    response.headers = (string_dict){.context = client->context};
+    *Set(&response.headers, "content-type") = "application/json";
+
+    return response;
+}
+
 Response serve_404(Client *client)
 {
     char const static body[] = "Can't find it.\n";
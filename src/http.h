@@ -1,20 +1,47 @@
 #ifndef HTTP_H_INCLUDED
 #define HTTP_H_INCLUDED
 
+#include "access_log.h"
 #include "array.h"
+#include "compress.h"
 #include "map.h"
+#include "metrics.h"
 #include "regex.h"
+#include "request.h"
+#include "system.h"
+#include "timers.h"
+#include "trace.h"
 
 typedef struct Server      Server;
-typedef struct Request     Request;
 typedef struct Response    Response;
+typedef struct Reply       Reply;
+typedef Array(Reply)       Reply_array;
 typedef struct Client      Client;
 typedef struct Route       Route;
+typedef struct Route_options Route_options;
 typedef Array(Route)       Route_array;
 typedef Map(s32, Client*)  Client_map;
+typedef Map(u32, s32)      Address_count_map;
 typedef Array(pthread_t)   pthread_t_array;
-typedef struct Task_queue  Task_queue;
+typedef struct Scheduler   Scheduler;
+typedef struct Reactor     Reactor;
+typedef Array(Reactor)     Reactor_array;
 typedef struct File_tree_accessor File_tree_accessor;
+typedef struct File_tree_resource File_tree_resource;
+typedef struct Shared_buffer Shared_buffer;
+typedef struct Body_segment  Body_segment;
+typedef Array(Body_segment)  Body_segment_array;
+typedef struct Flight        Flight;
+typedef Dict(Flight *)       Flight_dict;
+typedef struct Response_cache Response_cache;
+typedef struct Shared_response Shared_response;
+typedef struct Client_pool   Client_pool;
+
+struct Client_pool {
+    Memory_context         *context;        // Where new clients come from.
+    Client                 *first;          // A stack of closed clients, linked by .next_in_pool, whose contexts we've reset.
+    s32                     count;
+};
 
 struct Server {
     Memory_context         *context;
@@ -22,34 +49,182 @@ struct Server {
     u32                     address;
     u16                     port;
 
+    // Settings. create_server() fills in defaults, which you can change before calling start_server().
+    bool                    use_reactors;       // If true, each worker thread has its own listening socket (SO_REUSEPORT) and event loop and deals with its own clients from start to finish.
+    bool                    use_io_uring;       // If true, the reactors hand their accepts and receives to the kernel with io_uring instead of waiting on epoll, and file routes read their files with it (so set it before adding them). Implies .use_reactors. We fall back to epoll if the kernel can't do it.
+    s64                     min_compression_size; // Don't compress response bodies smaller than this many bytes. See Route_options.compression_level.
+    s64                     response_cache_size;  // The most bytes of responses to keep in the response cache. See Route_options.cache_ttl.
+    int                     listen_backlog;     // How many new connections the kernel will queue for us before it starts dropping them.
+    int                     defer_accept;       // If non-zero, the kernel holds on to a new connection until its first bytes arrive, for up to this many seconds (TCP_DEFER_ACCEPT).
+    s64                     max_request_size;   // The longest request we'll take, in bytes, up to 4 GB. We reply 413 to longer ones and close the connection.
+
+    // Worker threads. There are two pools: one for most of the work, and one for the handlers of .blocking routes, so
+    // that handlers waiting on the database can't starve everything else. Each pool starts with an active worker for
+    // each CPU we can use (or all of its workers, if it has fewer), and grows and shrinks between that and its maximum,
+    // depending on how many tasks are waiting. See size_worker_pool().
+    int                     num_workers;        // The most workers (or, with .use_reactors, the number of reactors). 0 means one for each CPU we're allowed to run on.
+    int                     num_blocking_workers; // The most workers for .blocking handlers. 0 means four for each CPU.
+    bool                    pin_workers;        // If true, pin each worker (or reactor) to a CPU of its own, as far as the CPUs go. Blocking workers aren't pinned.
+
+    // How long we wait on a client's socket before we give up and close the connection, in milliseconds.
+    s64                     idle_timeout;       // For the first byte of the next request, while a keep-alive connection sits idle.
+    s64                     header_timeout;     // For the rest of a request's header, counting from its first byte. (We don't take request bodies.)
+    s64                     send_timeout;       // For the socket to take more of a reply.
+
+    // Clients that trickle bytes can stay just inside the timeouts and still tie up a connection (and, for slow
+    // readers, the memory of their replies) for a long time. So once a client has had RATE_GRACE_PERIOD milliseconds
+    // to send a request or to take a reply it couldn't take all at once, we close it if it's going slower than these,
+    // in bytes per second. 0 means no limit.
+    s64                     min_receive_rate;
+    s64                     min_send_rate;
+    int                     max_connections_per_ip; // The most connections we keep open from one IPv4 address, across all threads. 0 means no limit.
+
+    char                   *access_log_path;    // The file to append the access log to. If NULL, we write it to stdout.
+    enum Access_log_format  access_log_format;  // TEXT_LOG, or BINARY_LOG for offline analysis. See access_log.h.
+    char                   *trace_path;         // If set, append every request we trace to this file too, in the Chrome trace-event format. Turn tracing on with set_trace_sampling(server->tracer, n).
+
     s32                     socket;             // The file descriptor for the socket that accepts connections.
     s32                     interrupt_handle;   // The file descriptor for handling SIGINT.
+    s32                     epoll_handle;       // The epoll instance the main thread waits on.
 
     Route_array             routes;
 
-    Client_map              clients;
+    Client_map              clients;            // All open connections, keyed by socket. Only the main thread may touch this.
+    Client_map              watched_clients;    // The subset of .clients that the main thread owns and is waiting on epoll for.
+    Timer_wheel             timers;             // The deadlines of the .watched_clients. Only the main thread may touch this.
+    Client_pool             client_pool;        // Closed clients the main thread can reuse for new connections. See take_client().
 
-    Task_queue             *task_queue;
+    Scheduler              *scheduler;          // Hands tasks (mostly clients) to the worker threads.
     pthread_t_array         worker_threads;
-    s32                     worker_pipe[2];     // File descriptors for the pipe that workers use to communicate to the server (read, write).
-};
+    Scheduler              *blocking_scheduler; // Hands clients on .blocking routes to the blocking workers.
+    pthread_t_array         blocking_threads;
+    int                     min_active_workers; // The fewest workers a pool keeps active: one for each CPU we can use.
+    pthread_t               sizer_thread;       // Runs size_worker_pool() on each pool.
+    bool                    sizer_should_stop;
+    Client                 *completions;        // A lock-free stack of clients that workers have handed back to the main thread. See push_completion().
+    s32                     completion_handle;  // An eventfd that workers write to when they push onto an empty .completions stack.
 
-enum HTTP_method {GET=1, POST}; // We can add HTTP_ prefixes to these later if we need.
+    Reactor_array           reactors;           // Only used if .use_reactors is true.
+    s32                     stop_handle;        // In reactor mode, an eventfd the main thread writes to when it's time for the reactors to wind up.
 
-struct Request {
-    enum HTTP_method        method;
-    char_array              path;
-    string_dict             query_params;
+    struct {
+        pthread_mutex_t     mutex;
+        Flight_dict         dict;               // Keyed by method, path and query string.
+    }                       flights;            // The requests on .coalesce routes that we're handling right now. See coalesce_request().
+
+    struct {
+        pthread_mutex_t     mutex;
+        Address_count_map   counts;
+    }                       connections_per_ip; // How many open connections come from each address, if .max_connections_per_ip is set. Shared by the main thread and the reactors. See admit_connection().
+
+    Response_cache         *response_cache;     // Responses from routes with a .cache_ttl, shared by all threads.
+
+    Access_log             *access_log;         // Only open while the server is running.
+
+    Metrics                *metrics;            // What serve_metrics() reports.
+    string_array            phase_names;        // The phases we time for each route. The first NUM_BUILTIN_PHASES are ours; handlers can add more with add_phase().
+    struct {
+        s32                 open_connections;
+        s32                 connections;
+        s32                 connections_shed;
+        s32                 connections_rejected;
+        s32                 slow_receives;
+        s32                 slow_sends;
+        s32                 bytes_sent;
+        s32                 access_log_dropped;
+        s32                 active_workers;
+        s32                 active_blocking_workers;
+        s32                 unrouted_phases;    // The first phase histogram for requests that don't match a route.
+    }                       metric_ids;
+
+    Tracer                 *tracer;             // Traces a sample of requests, for serve_trace(). Off until someone calls set_trace_sampling().
+};
+
+//
+// We time each request in phases and keep a histogram for each phase of each route. These are the phases the server
+// times itself. A handler can time phases of its own work with add_phase() and record_phase().
+//
+enum Builtin_phase {
+    QUEUE_PHASE=0,      // Waiting for a worker thread to pick the client up. Not in reactor mode.
+    RECEIVE_PHASE,      // From the first byte of the request to the last.
+    PARSE_PHASE,
+    ROUTE_PHASE,        // Finding the route.
+    ADMISSION_PHASE,    // Waiting for a turn on a busy route. Only for requests that had to wait.
+    HANDLER_PHASE,      // Running the handler, or getting the response from the cache or another request.
+    SEND_PHASE,         // From queueing the reply to sending the last of it, including making the chunks of a stream.
+    NUM_BUILTIN_PHASES,
 };
 
 // A Request_handler is a function that takes a pointer to a Client and returns a Response.
 typedef Response Request_handler(Client*);
 
+// A Body_streamer produces a response body a piece at a time. See Response.stream. Each time it's called, it should
+// append the next piece of the body to the output array and return true, or return false if that was the last piece.
+typedef bool Body_streamer(Client *client, void *data, u8_array *out);
+
+// Settings for a route. Pass them to add_route() as designated initialisers after the handler, e.g.
+//
+//      add_route(server, GET, "/data.json", &serve_data, .compression_level = 6);
+//
+struct Route_options {
+    int                     compression_level;  // If non-zero, compress responses for clients that accept gzip or brotli. 1 is fastest; 9 is smallest.
+    bool                    coalesce;           // If true, when a request arrives while we're already handling an identical one, wait for that one's response and share it instead of running the handler again. A streamed response is shared as it's made, at the pace of the first request's client.
+
+    // If .cache_ttl is non-zero, keep the route's 200 responses in the server's response cache. Serve them from there
+    // for .cache_ttl milliseconds. For .cache_stale_time milliseconds after that, keep serving the old response but
+    // make a fresh one in the background (stale-while-revalidate). All times are in milliseconds.
+    s64                     cache_ttl;
+    s64                     cache_stale_time;
+    s64                     cache_max_size;     // Don't cache response bodies bigger than this many bytes. 0 means no limit besides Server.response_cache_size.
+    bool                    cache_ignores_query; // If true, requests that differ only in their query strings share a cached response.
+
+    // If .max_concurrency is non-zero, run at most that many of the route's handlers at once. Up to .max_queue more
+    // requests can wait for a turn, without tying up a thread while they wait. Once the queue is full, we reply 503
+    // straight away, with a retry-after header of .retry_after seconds (1 if you leave it out). Requests that we
+    // answer from the response cache, or by waiting for an identical request (.coalesce), don't need a turn. If the
+    // handler streams its body, the turn lasts until the body has been sent, because the streamer does the work.
+    int                     max_concurrency;
+    int                     max_queue;
+    int                     retry_after;
+
+    // If .blocking is true, the handler spends most of its time waiting, e.g. on the database, rather than using the
+    // CPU. We run it on a separate pool of workers (see Server.num_blocking_workers).
+    bool                    blocking;
+
+    bool                    local_only;         // If true, only clients connecting from the same machine (127.0.0.0/8) can use the route. For anyone else, it's as if it weren't there. For debugging and monitoring routes.
+};
+
+// A Shared_buffer is a reference-counted byte array with its own memory context, for response bodies that outlive the
+// client that made them, e.g. cached fragments. Hand one to the server with add_body_segment().
+struct Shared_buffer {
+    Memory_context         *context;        // Contains the struct itself and .bytes.
+    u8_array                bytes;
+    int                     num_refs;       // Only modify this atomically. See retain_shared_buffer() and release_shared_buffer().
+};
+
+struct Body_segment {
+    void                   *data;
+    s64                     size;
+    Shared_buffer          *buffer;         // If set, .data points into this buffer, and the segment holds a reference to it.
+};
+
 struct Route {
     enum HTTP_method        method;
+    char                   *path_pattern;
     Regex                  *path_regex;
     Request_handler        *handler;
     File_tree_accessor     *file_tree_accessor;
+    Route_options           options;
+
+    struct {
+        pthread_mutex_t     mutex;
+        int                 num_running;    // How many requests have a turn.
+        int                 num_waiting;    // How many requests are waiting for a turn, including any about to join the queue.
+        Client             *first;          // The queue of clients waiting for a turn, linked by client.admission.next.
+        Client             *last;
+    }                       admission;      // Only used if options.max_concurrency is set. See admit_request().
+
+    s32                     phase_metrics;  // The ID of the route's histogram for the first phase. The other phases follow in order.
 };
 
 struct Response {
@@ -57,6 +232,41 @@ struct Response {
     string_dict             headers;        // The request handler is expected to set the content-type header. The server sets the content-length header.
     void                   *body;
     s64                     size;           // The number of bytes in the body.
+
+    Body_segment_array      segments;       // If not empty, the body is these segments one after another, which we send without joining them up. .body is ignored. Add segments with add_body_segment(), which keeps .size up to date.
+
+    File_node              *file;           // If set, the body is the contents of this file, which we send with sendfile() instead of sending .body.
+    File_tree_resource     *file_tree;      // If set, a reference to the file tree that .file belongs to. The server releases it once it's done with the response.
+
+    // If .stream is set, the handler doesn't make the body up front. Instead, the server sends the headers straight
+    // away and then calls .stream(client, .stream_data, out) for each piece of the body, but only once the previous
+    // piece has gone out, so a slow client doesn't make us buffer the whole body. We send the pieces with
+    // transfer-encoding: chunked. .body and .size are ignored. Anything .stream_data points to should be in the
+    // client's context. A streamer can find out if the client has gone away with is_request_cancelled(), and return
+    // false to stop. If we stop sending the body before the streamer has finished, for whatever reason, we call it
+    // one last time with is_request_cancelled() returning true, so it can let go of anything it holds outside the
+    // client's context, like a database connection. It should return false straight away.
+    Body_streamer          *stream;
+    void                   *stream_data;
+};
+
+struct Reply {
+    char_array              header;         // The response header in text form.
+    Response                response;       // If it's streamed, .body and .size describe the chunk we're currently sending.
+    struct {
+        enum HTTP_method    method;
+        char_array          path;
+        string_dict         query_params;
+    }                       request;        // The request that this is the reply to, or what we need of it for logging.
+    Route                  *route;          // The request's route, for metrics. Can be NULL.
+    s64                     time_queued;    // When we queued the reply, in microseconds.
+
+    // For streamed responses:
+    u8_array                chunk;          // A buffer for the current chunk, including its chunked-encoding framing.
+    u8_array                piece;          // If we're compressing the stream, the uncompressed piece from the streamer.
+    Compressor             *compressor;     // NULL if we're not compressing the stream.
+    s64                     num_chunk_bytes; // The total size of the chunks we've made so far, for the access log.
+    bool                    finished;       // Whether the streamer has returned false.
 };
 
 struct Client {
@@ -64,43 +274,102 @@ struct Client {
     Memory_context         *context;
 
     s32                     socket;         // The client socket's file descriptor.
-    s64                     start_time;     // When we accepted the connection, or last reset the struct to be reused if client.keep_alive.
+    u32                     address;        // The IPv4 address the client connected from, in host byte order.
+    s64                     start_time;     // When we received the first byte of the current request. Until then, when we accepted the connection or reset the struct for the next request.
+    Timer                   timer;          // The deadline for the socket event we're waiting for. Only the thread that waits on the socket (the main thread or the client's reactor) touches it.
 
     enum {
         PARSING_REQUEST=1,
         HANDLING_REQUEST,
+        WAITING_FOR_TURN,
+        WAITING_FOR_FLIGHT,
+        WAITING_FOR_STREAM,
+        WAITING_FOR_WORKER,
         SENDING_REPLY,
         READY_TO_CLOSE,
     }                       phase;
 
-    char_array              message;        // A buffer for storing bytes received.
-    s16_array               crlf_offsets;
-
+    char_array              message;        // A buffer for storing bytes received. Once we've parsed a request, we remove its bytes from the front, so anything left is the start of the next (pipelined) request.
+    s64                     request_size;   // The number of bytes at the start of the message that make up the request we've just parsed.
 
-    Request                 request;
+    Request                 request;        // The request we're currently handling.
 
     Route                  *route;
     Match                  *route_match;    // The result of applying the matching route's path_regex to the request path.
 
     Response                response;
 
-    char_array              reply_header;   // Our response's header in text form.
-    s64                     num_bytes_sent; // The total number of bytes we've sent of our response. Includes both header and body.
+    Reply_array             replies;        // Replies waiting to be sent, in the same order as their requests.
+    s64                     num_bytes_sent; // The total number of bytes we've sent of the queued replies. Includes both headers and bodies.
 
-    enum {
-        HTTP_VERSION_1_0=1,
-        HTTP_VERSION_1_1,
-    }                       http_version;
-    bool                    keep_alive;     // Whether to keep the socket open after processing the request.
+    struct {
+        s64                 start;          // When the socket first couldn't take everything we had to send, in milliseconds. 0 if it hasn't happened yet.
+        s64                 num_bytes;      // How many bytes the socket has taken since then.
+    }                       send_rate;      // See Server.min_send_rate.
+
+    struct {
+        Client             *next;           // The next client in the server's (or, in reactor mode, the reactor's) completion stack.
+        enum Interest {
+            WANT_TO_READ=1,
+            WANT_TO_WRITE,
+            WANT_TO_CLOSE,
+        }                   interest;       // What the main thread should wait for on the client's socket.
+    }                       completion;     // Set by a worker when it hands the client back to the main thread, or to its reactor.
+
+    struct {
+        bool                has_turn;       // Whether the client holds one of its route's turns. See Route_options.max_concurrency.
+        Client             *next;           // The next client waiting for a turn on the same route.
+    }                       admission;
+
+    Reactor                *reactor;        // In reactor mode, the reactor that owns the client.
+
+    struct {
+        u64                 pending;        // The user data of the request the reactor's ring has in flight on our socket, or 0 if there isn't one.
+        bool                closing;        // Whether we've cancelled that request and should close the client when it comes back.
+    }                       uring;          // Only used in io_uring mode.
+
+    struct {
+        s64                 first_byte;     // When we received the first byte of the current request. 0 if it came in with the previous one.
+        s64                 queued;         // When the main thread last pushed the client onto the scheduler.
+        s64                 queue_wait;     // The total time the current request has waited for a worker.
+        s64                 turn_requested; // When the client started waiting for a turn. 0 if it didn't have to wait.
+        s64                 handler_start;  // When we started on the handler, if the client then had to wait for an identical request.
+    }                       timing;         // In microseconds. For the phase histograms.
+    struct {
+        Flight             *leading;        // The flight the client is running the handler or streamer for, if any.
+        Flight             *following;      // The flight the client is waiting on, or has been woken by, if any.
+        Client             *next;           // The next client waiting on the same flight.
+    }                       coalescing;     // See coalesce_request().
+    Shared_response        *shared_response; // If the response came from the response cache or an identical request, the one it shares. compress_response() picks its encoding.
+    bool                    cancelled;      // Whether the client has hung up on the current request. See is_request_cancelled().
+    Trace                  *trace;          // If we're tracing the current request, its trace. See trace.h.
+    Client                 *next_in_pool;   // While the client is closed and waiting in a Client_pool, the next one in the pool.
+
+    enum HTTP_version       http_version;
+    bool                    keep_alive;     // Whether to keep the socket open after processing the current request.
 };
 
 Server *create_server(u32 address, u16 port, Memory_context *context);
 void start_server(Server *server);
-void add_route(Server *server, enum HTTP_method method, char *path_pattern, Request_handler *handler);
+void add_route_(Server *server, enum HTTP_method method, char *path_pattern, Request_handler *handler, Route_options options);
 void add_file_route(Server *server, char *path_pattern, char *directory);
 
+Shared_buffer *create_shared_buffer(Memory_context *parent);
+void retain_shared_buffer(Shared_buffer *buffer);
+void release_shared_buffer(Shared_buffer *buffer);
+void add_body_segment(Client *client, Response *response, void *data, s64 size, Shared_buffer *buffer);
+bool is_request_cancelled(Client *client);
+s32 add_phase(Server *server, char *name);
+void record_phase(Client *client, s32 phase, s64 microseconds);
+
+// add_route() is variadic so that you can pass Route_options as designated initialisers. The 0 lets you leave them out.
+#define add_route(SERVER, METHOD, PATH_PATTERN, HANDLER, ...) \
+    add_route_((SERVER), (METHOD), (PATH_PATTERN), (HANDLER), (Route_options){0, __VA_ARGS__})
+
 // Request_handler functions:
 Response serve_files(Client *client); //|Cleanup: Remove this, because external code shouldn't use it directly, only via add_file_route().
 Response serve_404(Client *client);
+Response serve_metrics(Client *client);
+Response serve_trace(Client *client);
 
 #endif // HTTP_H_INCLUDED
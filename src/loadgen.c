@@ -0,0 +1,892 @@
+//
+// A load generator for measuring the server. It keeps a number of connections busy and reports the throughput and
+// the latency percentiles of each route, so you can compare the server before and after a change.
+//
+//      bin/loadgen [options] [host:]port
+//
+// By default it simulates people using the map: each connection is a session that starts with the whole of
+// Australia on the screen and then pans and zooms at random, requesting the tiles it doesn't already have, the
+// same way maybeFetchVertices() in web/script.js does. With --replay, it replays an access log instead (text or
+// binary; see access_log.h), sending each request at the same time after the first one as it originally arrived.
+//
+//      --connections n     How many connections to open. (Default 8.)
+//      --pipeline n        How many requests each connection can have in flight. (Default 1, i.e. no pipelining.)
+//      --no-keep-alive     Open a new connection for each request.
+//      --duration seconds  How long to run. (Default 10 for sessions; a replay runs to the end of the log.)
+//      --think ms          How long a session pauses after each view has loaded. (Default 0.)
+//      --seed n            Seed for the sessions' random pans and zooms, so runs are repeatable.
+//      --replay file       Replay an access log.
+//      --speed x           Replay the log x times as fast as it was recorded. (Default 1.)
+//
+// Latency is measured from when we meant to send a request: when a session wanted it, or when it arrived in the
+// recorded log. So if every connection is busy and a replayed request has to wait for one, the wait counts. That way a
+// slow server can't hide its slowness by holding up the requests that would have measured it.
+//
+// For getaddrinfo() and strncasecmp(), we need _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "array.h"
+#include "map.h"
+#include "strings.h"
+#include "system.h"
+
+typedef struct Pending     Pending;
+typedef Array(Pending)     Pending_array;
+typedef struct Job         Job;
+typedef Array(Job)         Job_array;
+typedef struct Session     Session;
+typedef struct Connection  Connection;
+typedef struct Route_stats Route_stats;
+typedef Array(Route_stats) Route_stats_array;
+typedef struct Loadgen     Loadgen;
+
+// The screen we pretend to have, and the map constants from web/script.js.
+#define SCREEN_WIDTH        1280
+#define SCREEN_HEIGHT       800
+#define PIXELS_PER_TILE     512
+#define MIN_SCALE           0.0001
+#define MAX_SCALE           0.5
+
+s32 static ELECTION_IDS[] = {15508, 17496, 20499, 24310, 27966};
+
+// The bounding box of Australia in map units, which the page fits to the screen when it loads.
+double static AUSTRALIA[2][2] = {{-1863361, 1168642}, {2087981, 4840595}};
+
+struct Pending {
+    s32                     route;          // An index into Loadgen.routes.
+    s64                     start_time;     // When we meant to send the request, in microseconds.
+};
+
+struct Job {
+    char                   *target;         // The path and query string.
+    s64                     due_time;       // In microseconds after the start of the replay.
+};
+
+struct Session {
+    Memory_context         *context;
+
+    u64                     random;         // The state of the session's random number generator.
+    s32                     election_id;
+    bool                    started;
+    double                  scale;          // Pixels per map unit.
+    double                  x, y;           // The map coordinates at the centre of the screen.
+
+    int_dict                tiles;          // The tiles we've already fetched, keyed by "election upp x,y".
+    string_array            todo;           // The targets we still need for the current view.
+    s64                     num_done;       // How many of .todo we've sent.
+    s64                     next_view_time; // When to move on to the next view, once .todo is done. In microseconds.
+};
+
+struct Connection {
+    s32                     socket;         // -1 if we need to connect before we can send.
+
+    char_array              out;            // Requests we haven't finished writing.
+    s64                     num_out_sent;
+    char_array              in;             // Bytes we've received but haven't parsed.
+
+    Pending_array           pending;        // The requests we've sent (or are sending), oldest first, from .pending_head.
+    s64                     pending_head;
+
+    // Where we are in the current response.
+    enum {
+        READING_HEADER=1,
+        READING_BODY,
+        READING_CHUNK_SIZE,
+        READING_CHUNK,
+        READING_TRAILER,
+    }                       state;
+    s64                     num_remaining;  // The bytes left in the body or chunk (including the chunk's CRLF).
+    int                     status;
+    bool                    closing;        // Whether the server said it would close the connection after this response.
+
+    Session                *session;        // NULL when replaying.
+};
+
+struct Route_stats {
+    char                   *name;
+    s64_array               latencies;      // In microseconds.
+    s64                     num_errors;     // Responses that weren't 2xx or 3xx, and requests lost to a closed connection.
+};
+
+struct Loadgen {
+    Memory_context         *context;
+
+    // Settings.
+    struct sockaddr_in      address;
+    char                   *host;           // For the host header.
+    int                     num_connections;
+    int                     pipeline_depth;
+    bool                    keep_alive;
+    s64                     think_time;     // In microseconds.
+    double                  speed;
+
+    s32                     epoll_handle;
+    Connection             *connections;
+
+    Job_array               jobs;           // Only when replaying. Sorted by due time.
+    s64                     num_jobs_sent;
+    s32                     next_connection; // Where to start looking for a free connection for the next job.
+
+    s64                     start_time;     // In microseconds.
+    s64                     stop_time;      // When to stop sending requests.
+
+    Route_stats_array       routes;
+    int_dict                route_indexes;  // Keyed by route name.
+    s64                     num_sent;
+    s64                     num_received;
+    s64                     num_bytes_received;
+};
+
+static u64 get_random(u64 *state)
+// xorshift64*. The state must not be 0.
+{
+    u64 x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double get_random_double(u64 *state)
+// Between 0 and 1.
+{
+    return (get_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static char *get_route_name(char *target, Memory_context *context)
+// Group targets into routes for the report. Drop the query string and replace each run of digits with N, so
+// "/elections/27966/districts.json" becomes "/elections/N/districts.json".
+{
+    char_array name = {.context = context};
+    array_reserve(&name, round_up_pow2(strlen(target)+1));
+
+    for (char *c = target; *c && *c != '?'; c++) {
+        if ('0' <= *c && *c <= '9') {
+            while ('0' <= c[1] && c[1] <= '9')  c++;
+            *Add(&name) = 'N';
+        } else {
+            *Add(&name) = *c;
+        }
+    }
+    *Add(&name) = '\0';
+
+    return name.data;
+}
+
+static s32 get_route(Loadgen *lg, char *target)
+{
+    char *name = get_route_name(target, lg->context);
+
+    int index = *Get(&lg->route_indexes, name);
+    if (index < 0) {
+        Route_stats *route = Add(&lg->routes);
+        *route = (Route_stats){.name = name, .latencies = {.context = lg->context}};
+
+        index = lg->routes.count-1;
+        *Set(&lg->route_indexes, name) = index;
+    }
+
+    return index;
+}
+
+//
+// Sessions.
+//
+
+static void add_tiles_for_view(Session *s)
+// Add every tile the current view needs that the session doesn't already have. This follows maybeFetchVertices() in
+// web/script.js, including its quirks, e.g. the "?&" in the URL and the extra row and column of tiles, so that we
+// ask for exactly what a browser would, and hit the response cache just as often.
+{
+    s64 upp       = (s64)pow(2, -round(log2(s->scale)));
+    s64 tile_size = PIXELS_PER_TILE*upp;
+
+    double half_width  = SCREEN_WIDTH/(2*s->scale);
+    double half_height = SCREEN_HEIGHT/(2*s->scale);
+
+    s64 min_x = tile_size*(s64)floor((s->x - half_width)/tile_size);
+    s64 min_y = tile_size*(s64)floor((s->y - half_height)/tile_size);
+    s64 max_x = tile_size*(s64)ceil((s->x + half_width)/tile_size);
+    s64 max_y = tile_size*(s64)ceil((s->y + half_height)/tile_size);
+
+    for (s64 x = min_x; x <= max_x; x += tile_size) {
+        for (s64 y = min_y; y <= max_y; y += tile_size) {
+            char *key = get_string(s->context, "%d %ld %ld,%ld", s->election_id, upp, x, y).data;
+            if (*Get(&s->tiles, key))  continue;
+
+            *Set(&s->tiles, key) = 1;
+
+            *Add(&s->todo) = get_string(s->context, "/vertices/%d?&x0=%ld&y0=%ld&x1=%ld&y1=%ld&upp=%ld",
+                                        s->election_id, x, y, x + tile_size, y + tile_size, upp).data;
+        }
+    }
+}
+
+static void move_to_next_view(Session *s)
+// Pan or zoom at random, or, when the session starts, show the whole country. Fill .todo with what the new view needs.
+{
+    if (!s->started) {
+        s->started     = true;
+        s->election_id = ELECTION_IDS[get_random(&s->random) % countof(ELECTION_IDS)];
+
+        double width  = AUSTRALIA[1][0] - AUSTRALIA[0][0];
+        double height = AUSTRALIA[1][1] - AUSTRALIA[0][1];
+
+        s->scale = Min(SCREEN_WIDTH/width, SCREEN_HEIGHT/height);
+        s->x     = AUSTRALIA[0][0] + width/2;
+        s->y     = AUSTRALIA[0][1] + height/2;
+
+        // The page asks for these as soon as it loads.
+        *Add(&s->todo) = get_string(s->context, "/elections/%d/districts.json", s->election_id).data;
+        *Add(&s->todo) = get_string(s->context, "/elections/%d/seats-won.json", s->election_id).data;
+    } else {
+        double r = get_random_double(&s->random);
+
+        // The point under the pointer, which stays put when we zoom.
+        double px = (get_random_double(&s->random) - 0.5)*SCREEN_WIDTH/s->scale;
+        double py = (get_random_double(&s->random) - 0.5)*SCREEN_HEIGHT/s->scale;
+
+        if (r < 0.5) {
+            // Drag the map by up to half a screen.
+            s->x += px;
+            s->y += py;
+        } else {
+            double factor = (r < 0.75) ? 2 : 0.5;
+            double scale  = Min(Max(s->scale*factor, MIN_SCALE), MAX_SCALE);
+
+            // Zoom about the pointer.
+            double k = 1 - s->scale/scale;
+            s->x += px*k;
+            s->y += py*k;
+            s->scale = scale;
+        }
+
+        // Don't wander off the map.
+        s->x = Min(Max(s->x, AUSTRALIA[0][0]), AUSTRALIA[1][0]);
+        s->y = Min(Max(s->y, AUSTRALIA[0][1]), AUSTRALIA[1][1]);
+    }
+
+    add_tiles_for_view(s);
+}
+
+static Session *create_session(u64 seed, Memory_context *parent)
+{
+    Memory_context *context = new_context(parent);
+
+    Session *s = New(Session, context);
+
+    s->context = context;
+    s->random  = seed ? seed : 1;
+    s->tiles   = (int_dict){.context = context};
+    s->todo    = (string_array){.context = context};
+
+    return s;
+}
+
+//
+// Connections.
+//
+
+static void close_connection(Loadgen *lg, Connection *c)
+// Close the socket. Any requests we were still waiting on count as errors.
+{
+    if (c->socket >= 0)  close(c->socket);
+    c->socket = -1;
+
+    for (s64 i = c->pending_head; i < c->pending.count; i++) {
+        lg->routes.data[c->pending.data[i].route].num_errors += 1;
+    }
+
+    // If the session was waiting for those responses to finish its view, it shouldn't wait any more.
+    if (c->session && c->session->next_view_time == INT64_MAX)  c->session->next_view_time = 0;
+    c->pending.count = 0;
+    c->pending_head  = 0;
+
+    c->out.count    = 0;
+    c->num_out_sent = 0;
+    c->in.count     = 0;
+    c->state        = READING_HEADER;
+    c->closing      = false;
+}
+
+static bool open_connection(Loadgen *lg, Connection *c)
+{
+    s32 s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)  Fatal("We couldn't create a socket (%s).", get_last_error().string);
+
+    // Connect while the socket is blocking, so we don't have to wait for it to be writable.
+    if (connect(s, (struct sockaddr *)&lg->address, sizeof(lg->address)) < 0) {
+        log_error("We couldn't connect to the server (%s).", get_last_error().string);
+        close(s);
+        return false;
+    }
+
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    set_blocking(s, false);
+
+    struct epoll_event event = {.events = EPOLLIN|EPOLLOUT|EPOLLET, .data.ptr = c};
+    if (epoll_ctl(lg->epoll_handle, EPOLL_CTL_ADD, s, &event) < 0) {
+        Fatal("We couldn't add a socket to epoll (%s).", get_last_error().string);
+    }
+
+    c->socket = s;
+    return true;
+}
+
+static bool flush_output(Loadgen *lg, Connection *c)
+// Write as much of c->out as the socket will take. Return false if the connection failed.
+{
+    while (c->num_out_sent < c->out.count) {
+        s64 n = write(c->socket, c->out.data + c->num_out_sent, c->out.count - c->num_out_sent);
+        if (n < 0) {
+            if (errno == EINTR)   continue;
+            if (errno == EAGAIN)  return true; // We'll hear from epoll when there's room.
+
+            close_connection(lg, c);
+            return false;
+        }
+        c->num_out_sent += n;
+    }
+
+    c->out.count    = 0;
+    c->num_out_sent = 0;
+
+    return true;
+}
+
+static s64 count_pending(Connection *c)
+{
+    return c->pending.count - c->pending_head;
+}
+
+static bool send_request(Loadgen *lg, Connection *c, char *target, s64 start_time)
+// Queue a request on a connection, connecting first if we have to. Return false if we couldn't.
+{
+    if (c->socket < 0 && !open_connection(lg, c)) {
+        lg->routes.data[get_route(lg, target)].num_errors += 1;
+        return false;
+    }
+
+    append_string(&c->out, "GET %s HTTP/1.1\r\nhost: %s\r\naccept-encoding: gzip, br\r\n%s\r\n",
+                  target, lg->host, lg->keep_alive ? "" : "connection: close\r\n");
+
+    if (c->pending_head == c->pending.count) {
+        c->pending.count = 0;
+        c->pending_head  = 0;
+    }
+    *Add(&c->pending) = (Pending){get_route(lg, target), start_time};
+
+    lg->num_sent += 1;
+
+    return flush_output(lg, c);
+}
+
+static bool is_free(Loadgen *lg, Connection *c)
+// Whether a connection can take another request.
+{
+    if (!lg->keep_alive && c->socket >= 0)  return false; // It's waiting for its response, then it will close.
+
+    return count_pending(c) < lg->pipeline_depth;
+}
+
+static void feed_session(Loadgen *lg, Connection *c, s64 now)
+// Send a session's next requests, if the connection has room for them.
+{
+    Session *s = c->session;
+
+    while (now < lg->stop_time && is_free(lg, c)) {
+        if (s->num_done == s->todo.count) {
+            // Only move on once the whole view has loaded, and the user has had a look at it.
+            if (count_pending(c))         break;
+            if (now < s->next_view_time)  break;
+
+            s->todo.count = 0;
+            s->num_done   = 0;
+
+            // Small pans may not need any new tiles. Keep going until the view needs something.
+            for (int i = 0; i < 100 && !s->todo.count; i++)  move_to_next_view(s);
+            if (!s->todo.count)  break;
+        }
+
+        char *target = s->todo.data[s->num_done];
+        s->num_done += 1;
+
+        bool ok = send_request(lg, c, target, now);
+        if (!ok)  break;
+
+        if (s->num_done == s->todo.count)  s->next_view_time = INT64_MAX; // Until the view has loaded.
+    }
+}
+
+static void feed_replay(Loadgen *lg, s64 now)
+// Send every job that's due, as long as we have connections free.
+{
+    while (lg->num_jobs_sent < lg->jobs.count && now < lg->stop_time) {
+        Job *job = &lg->jobs.data[lg->num_jobs_sent];
+        s64  due = lg->start_time + job->due_time;
+        if (due > now)  break;
+
+        Connection *c = NULL;
+        for (int i = 0; i < lg->num_connections && !c; i++) {
+            Connection *candidate = &lg->connections[(lg->next_connection + i) % lg->num_connections];
+            if (is_free(lg, candidate))  c = candidate;
+        }
+        if (!c)  break; // The job waits for a connection, and its latency counts the wait.
+
+        lg->next_connection = (c - lg->connections + 1) % lg->num_connections;
+        lg->num_jobs_sent  += 1;
+
+        send_request(lg, c, job->target, due);
+    }
+}
+
+static void finish_response(Loadgen *lg, Connection *c, s64 now)
+{
+    assert(count_pending(c) > 0);
+    Pending *pending = &c->pending.data[c->pending_head];
+    c->pending_head += 1;
+
+    Route_stats *route = &lg->routes.data[pending->route];
+
+    if (200 <= c->status && c->status < 400)  *Add(&route->latencies) = now - pending->start_time;
+    else                                      route->num_errors += 1;
+
+    lg->num_received += 1;
+
+    if (c->session && c->session->num_done == c->session->todo.count && !count_pending(c)) {
+        c->session->next_view_time = now + lg->think_time;
+    }
+
+    c->state   = READING_HEADER;
+    c->status  = 0;
+}
+
+static char *find_crlf(char *data, s64 size, char *crlf)
+{
+    s64 n = strlen(crlf);
+    for (s64 i = 0; i + n <= size; i++) {
+        if (!memcmp(&data[i], crlf, n))  return &data[i];
+    }
+    return NULL;
+}
+
+static bool parse_responses(Loadgen *lg, Connection *c, s64 now)
+// Work through the bytes in c->in, finishing any responses they complete. We skip over bodies without keeping them.
+// Return false if the server sent something we don't understand.
+{
+    char *data = c->in.data;
+    char *end  = c->in.data + c->in.count;
+
+    while (data < end) {
+        if (c->state == READING_BODY || c->state == READING_CHUNK) {
+            s64 n = Min(c->num_remaining, end - data);
+            data             += n;
+            c->num_remaining -= n;
+            if (c->num_remaining)  break;
+
+            if (c->state == READING_CHUNK)  c->state = READING_CHUNK_SIZE;
+            else                            finish_response(lg, c, now);
+            continue;
+        }
+
+        if (c->state == READING_HEADER) {
+            char *header_end = find_crlf(data, end - data, "\r\n\r\n");
+            if (!header_end)  break;
+            *header_end = '\0';
+
+            if (sscanf(data, "HTTP/1.%*d %d", &c->status) != 1)  return false;
+
+            s64  content_length = 0;
+            bool chunked        = false;
+            c->closing          = false;
+
+            for (char *line = strstr(data, "\r\n"); line; line = strstr(line, "\r\n")) {
+                line += 2;
+                if (!strncasecmp(line, "content-length:", 15))           content_length = atol(line + 15);
+                if (!strncasecmp(line, "transfer-encoding: chunked", 26))  chunked = true;
+                if (!strncasecmp(line, "connection: close", 17))          c->closing = true;
+            }
+
+            data = header_end + 4;
+
+            if (chunked) {
+                c->state = READING_CHUNK_SIZE;
+            } else if (content_length) {
+                c->state         = READING_BODY;
+                c->num_remaining = content_length;
+            } else {
+                finish_response(lg, c, now);
+            }
+            continue;
+        }
+
+        // The chunk size line, or a trailer line.
+        char *line_end = find_crlf(data, end - data, "\r\n");
+        if (!line_end)  break;
+
+        if (c->state == READING_CHUNK_SIZE) {
+            char *number_end = NULL;
+            s64   size       = strtol(data, &number_end, 16);
+            if (number_end == data)  return false;
+
+            if (size)  c->state = READING_CHUNK, c->num_remaining = size + 2; // The chunk and its CRLF.
+            else       c->state = READING_TRAILER;
+        } else {
+            assert(c->state == READING_TRAILER);
+            if (line_end == data)  finish_response(lg, c, now); // An empty line ends the trailer.
+        }
+        data = line_end + 2;
+    }
+
+    // Keep whatever we haven't used.
+    c->in.count = end - data;
+    memmove(c->in.data, data, c->in.count);
+
+    return true;
+}
+
+static void receive_responses(Loadgen *lg, Connection *c, s64 now)
+{
+    while (c->socket >= 0) {
+        array_reserve(&c->in, round_up_pow2(c->in.count + 65536));
+
+        s64 n = read(c->socket, c->in.data + c->in.count, c->in.limit - c->in.count - 1);
+        if (n < 0 && errno == EINTR)  continue;
+        if (n < 0 && errno == EAGAIN)  break;
+
+        if (n <= 0) {
+            // The server closed the connection, or it broke.
+            close_connection(lg, c);
+            break;
+        }
+
+        c->in.count += n;
+        c->in.data[c->in.count] = '\0';
+        lg->num_bytes_received += n;
+
+        bool ok = parse_responses(lg, c, now);
+        if (!ok) {
+            log_error("We couldn't parse a response. Closing the connection.");
+            close_connection(lg, c);
+            break;
+        }
+
+        if (!count_pending(c) && (c->closing || !lg->keep_alive)) {
+            close_connection(lg, c);
+            break;
+        }
+    }
+}
+
+//
+// Replaying access logs.
+//
+
+static s64 get_days_from_civil(s64 y, s64 m, s64 d)
+// The number of days from 1970-01-01 to a date in the proleptic Gregorian calendar. From Howard Hinnant's
+// "chrono-Compatible Low-Level Date Algorithms".
+{
+    y -= m <= 2;
+    s64 era = (y >= 0 ? y : y-399) / 400;
+    s64 yoe = y - era*400;
+    s64 doy = (153*(m > 2 ? m-3 : m+9) + 2)/5 + d-1;
+    s64 doe = yoe*365 + yoe/4 - yoe/100 + doy;
+
+    return era*146097 + doe - 719468;
+}
+
+static int compare_jobs(void const *a, void const *b)
+{
+    s64 t = ((Job *)a)->due_time;
+    s64 u = ((Job *)b)->due_time;
+
+    return (t > u) - (t < u);
+}
+
+static void load_replay(Loadgen *lg, char *file_name)
+// Read the GET requests out of an access log, in the order they arrived.
+{
+    Memory_context *ctx = lg->context;
+
+    u8_array *file = load_binary_file(file_name, ctx);
+    if (!file)  Fatal("Couldn't read %s.", file_name);
+
+    Job_array *jobs = &lg->jobs;
+    *jobs = (Job_array){.context = ctx};
+
+    // The log says when each request finished, so we take away its duration to find when it arrived. Until we sort
+    // the jobs, .due_time is that arrival time, in microseconds since the epoch.
+    bool binary = (file->count >= lengthof(ACCESS_LOG_MAGIC) && !memcmp(file->data, ACCESS_LOG_MAGIC, lengthof(ACCESS_LOG_MAGIC)));
+
+    if (binary) {
+        u8 *d   = file->data + lengthof(ACCESS_LOG_MAGIC);
+        u8 *end = file->data + file->count;
+
+        s64 HEADER_SIZE = 3*sizeof(s64) + 3*sizeof(u16);
+
+        while (end - d >= HEADER_SIZE) {
+            s64 time;           memcpy(&time,          d, sizeof(s64));  d += sizeof(s64);
+            s64 duration;       memcpy(&duration,      d, sizeof(s64));  d += sizeof(s64);
+            d += sizeof(s64); // The number of bytes.
+            d += sizeof(u16); // The status.
+            u16 method_length;  memcpy(&method_length, d, sizeof(u16));  d += sizeof(u16);
+            u16 target_length;  memcpy(&target_length, d, sizeof(u16));  d += sizeof(u16);
+
+            if (end - d < method_length + target_length)  break;
+
+            bool is_get = (method_length == 3 && !memcmp(d, "GET", 3));
+            d += method_length;
+
+            if (is_get)  *Add(jobs) = (Job){copy_string((char *)d, target_length, ctx).data, time - duration};
+            d += target_length;
+        }
+    } else {
+        *Add(file) = '\0';
+
+        char *line = (char *)file->data;
+        while (*line) {
+            char *line_end = strchr(line, '\n');
+            if (line_end)  *line_end = '\0';
+
+            // 2026-10-16T09:30:01.123Z 200 GET /elections/1/districts.json 1.234ms 5678B
+            int    year, month, day, hour, minute, second, millisecond, status;
+            char   method[16];
+            char   target[4096];
+            double duration;
+
+            int n = sscanf(line, "%d-%d-%dT%d:%d:%d.%dZ %d %15s %4095s %lfms", &year, &month, &day, &hour, &minute,
+                           &second, &millisecond, &status, method, target, &duration);
+
+            if (n == 11 && !strcmp(method, "GET")) {
+                s64 days = get_days_from_civil(year, month, day);
+                s64 time = (((days*24 + hour)*60 + minute)*60 + second)*1000000 + millisecond*1000;
+
+                *Add(jobs) = (Job){get_string(ctx, "%s", target).data, time - (s64)(duration*1000)};
+            }
+
+            if (!line_end)  break;
+            line = line_end + 1;
+        }
+    }
+
+    if (!jobs->count)  Fatal("We didn't find any GET requests in %s.", file_name);
+
+    qsort_array(jobs, compare_jobs);
+
+    s64 first_arrival = jobs->data[0].due_time;
+    for (s64 i = 0; i < jobs->count; i++) {
+        jobs->data[i].due_time = (jobs->data[i].due_time - first_arrival)/lg->speed;
+    }
+}
+
+//
+// The report.
+//
+
+static int compare_s64(void const *a, void const *b)
+{
+    s64 x = *(s64 *)a;
+    s64 y = *(s64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double get_percentile(s64_array *sorted, double p)
+// In milliseconds.
+{
+    assert(sorted->count);
+
+    s64 index = (s64)ceil(p*sorted->count) - 1;
+    index = Min(Max(index, 0), sorted->count-1);
+
+    return sorted->data[index]/1000.0;
+}
+
+static void print_report(Loadgen *lg, s64 elapsed)
+{
+    double seconds = elapsed/1.0e6;
+
+    s64 num_errors = 0;
+    for (s64 i = 0; i < lg->routes.count; i++)  num_errors += lg->routes.data[i].num_errors;
+
+    printf("%ld requests, %ld responses in %.2fs: %.1f responses/s, %.2f MB/s received, %ld errors.\n\n",
+           lg->num_sent, lg->num_received, seconds, lg->num_received/seconds, lg->num_bytes_received/seconds/1.0e6,
+           num_errors);
+
+    printf("%-40s %8s %7s %9s %9s %9s %9s\n", "route", "count", "errors", "p50 ms", "p99 ms", "p999 ms", "max ms");
+
+    for (s64 i = 0; i < lg->routes.count; i++) {
+        Route_stats *route = &lg->routes.data[i];
+        s64_array   *lat   = &route->latencies;
+
+        qsort_array(lat, compare_s64);
+
+        if (!lat->count) {
+            printf("%-40s %8d %7ld %9s %9s %9s %9s\n", route->name, 0, route->num_errors, "-", "-", "-", "-");
+            continue;
+        }
+
+        printf("%-40s %8ld %7ld %9.3f %9.3f %9.3f %9.3f\n", route->name, lat->count, route->num_errors,
+               get_percentile(lat, 0.5), get_percentile(lat, 0.99), get_percentile(lat, 0.999),
+               get_percentile(lat, 1));
+    }
+}
+
+//
+// The main loop.
+//
+
+static void parse_address(Loadgen *lg, char *arg)
+// Take "port" or "host:port".
+{
+    char *host  = "127.0.0.1";
+    char *port  = arg;
+    char *colon = strrchr(arg, ':');
+
+    if (colon) {
+        host   = get_string(lg->context, "%.*s", (int)(colon - arg), arg).data;
+        port   = colon + 1;
+    }
+
+    struct addrinfo  hints  = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result = NULL;
+
+    int r = getaddrinfo(host, port, &hints, &result);
+    if (r)  Fatal("We couldn't look up %s (%s).", arg, gai_strerror(r));
+
+    memcpy(&lg->address, result->ai_addr, sizeof(lg->address));
+    freeaddrinfo(result);
+
+    lg->host = get_string(lg->context, "%s:%s", host, port).data;
+}
+
+int main(int argc, char **argv)
+{
+    Memory_context *ctx = new_context(NULL);
+
+    Loadgen *lg = New(Loadgen, ctx);
+
+    lg->context         = ctx;
+    lg->num_connections = 8;
+    lg->pipeline_depth  = 1;
+    lg->keep_alive      = true;
+    lg->speed           = 1;
+    lg->routes          = (Route_stats_array){.context = ctx};
+    lg->route_indexes   = (int_dict){.context = ctx};
+    SetDefault(&lg->route_indexes, -1);
+
+    char  *address     = "6008";
+    char  *replay_file = NULL;
+    double duration    = 0;
+    u64    seed        = 1;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg  = argv[i];
+        bool  more = (i+1 < argc);
+
+        if (!strcmp(arg, "--connections") && more)     lg->num_connections = atoi(argv[++i]);
+        else if (!strcmp(arg, "--pipeline") && more)   lg->pipeline_depth  = atoi(argv[++i]);
+        else if (!strcmp(arg, "--no-keep-alive"))      lg->keep_alive      = false;
+        else if (!strcmp(arg, "--duration") && more)   duration            = atof(argv[++i]);
+        else if (!strcmp(arg, "--think") && more)      lg->think_time      = 1000*atol(argv[++i]);
+        else if (!strcmp(arg, "--seed") && more)       seed                = strtoull(argv[++i], NULL, 10);
+        else if (!strcmp(arg, "--replay") && more)     replay_file         = argv[++i];
+        else if (!strcmp(arg, "--speed") && more)      lg->speed           = atof(argv[++i]);
+        else if (arg[0] != '-')                        address             = arg;
+        else  Fatal("Usage: %s [--connections n] [--pipeline n] [--no-keep-alive] [--duration seconds] [--think ms] "
+                    "[--seed n] [--replay access-log [--speed x]] [host:]port", argv[0]);
+    }
+
+    if (lg->num_connections < 1 || lg->pipeline_depth < 1 || lg->speed <= 0)  Fatal("That doesn't make sense.");
+    if (!lg->keep_alive)  lg->pipeline_depth = 1;
+
+    parse_address(lg, address);
+
+    if (replay_file)  load_replay(lg, replay_file);
+    else if (!duration)  duration = 10;
+
+    lg->epoll_handle = epoll_create1(0);
+    if (lg->epoll_handle < 0)  Fatal("Couldn't create an epoll instance (%s).", get_last_error().string);
+
+    lg->connections = New(lg->num_connections, Connection, ctx);
+
+    for (int i = 0; i < lg->num_connections; i++) {
+        Connection *c = &lg->connections[i];
+
+        c->socket   = -1;
+        c->out      = (char_array){.context = ctx};
+        c->in       = (char_array){.context = ctx};
+        c->pending  = (Pending_array){.context = ctx};
+        c->state    = READING_HEADER;
+
+        if (!replay_file)  c->session = create_session(seed*1000003 + i, ctx);
+
+        // Connect up front, so that connecting isn't part of the first requests' latency.
+        if (lg->keep_alive && !open_connection(lg, c))  Fatal("We couldn't connect to %s.", lg->host);
+    }
+
+    lg->start_time = get_monotonic_time_us();
+    lg->stop_time  = duration ? lg->start_time + (s64)(duration*1.0e6) : INT64_MAX;
+
+    // Once we stop sending, give the last responses a little while to come back.
+    s64 GRACE_PERIOD         = 5000000;
+    s64 stopped_sending_time = 0;
+
+    while (true) {
+        s64 now = get_monotonic_time_us();
+
+        if (replay_file)  feed_replay(lg, now);
+        else              for (int i = 0; i < lg->num_connections; i++)  feed_session(lg, &lg->connections[i], now);
+
+        s64 num_pending = 0;
+        for (int i = 0; i < lg->num_connections; i++)  num_pending += count_pending(&lg->connections[i]);
+
+        bool sending = (now < lg->stop_time) && (!replay_file || lg->num_jobs_sent < lg->jobs.count);
+        if (!sending && !stopped_sending_time)  stopped_sending_time = now;
+
+        if (!sending && !num_pending)  break;
+        if (!sending && now > stopped_sending_time + GRACE_PERIOD)  break;
+
+        // Sleep until something happens, or until the next thing we have to do on time.
+        s64 wake_time = sending ? lg->stop_time : stopped_sending_time + GRACE_PERIOD;
+        if (replay_file && lg->num_jobs_sent < lg->jobs.count) {
+            wake_time = Min(wake_time, lg->start_time + lg->jobs.data[lg->num_jobs_sent].due_time);
+        }
+        for (int i = 0; i < lg->num_connections && !replay_file; i++) {
+            Session *s = lg->connections[i].session;
+            if (s->num_done == s->todo.count)  wake_time = Min(wake_time, s->next_view_time);
+        }
+        int timeout = (int)Min(Max((wake_time - now + 999)/1000, 0), 1000);
+
+        struct epoll_event events[64];
+        int num_events = epoll_wait(lg->epoll_handle, events, countof(events), timeout);
+        if (num_events < 0 && errno != EINTR)  Fatal("epoll_wait failed (%s).", get_last_error().string);
+
+        now = get_monotonic_time_us();
+
+        for (int i = 0; i < num_events; i++) {
+            Connection *c = events[i].data.ptr;
+            if (c->socket < 0)  continue;
+
+            if (events[i].events & EPOLLOUT)  flush_output(lg, c);
+            receive_responses(lg, c, now);
+        }
+    }
+
+    print_report(lg, get_monotonic_time_us() - lg->start_time);
+
+    free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include "metrics.h"
+#include "strings.h"
+
+#define SUB_COUNT  (1 << HISTOGRAM_SUB_BITS)
+
+// The shard this thread records into, and the registry it belongs to.
+static __thread Metrics *current_metrics = NULL;
+static __thread s64     *current_shard   = NULL;
+
+Metrics *create_metrics(Memory_context *context)
+{
+    Metrics *metrics = New(Metrics, context);
+
+    metrics->context = context;
+    metrics->metrics = (Metric_array){.context = context};
+
+    return metrics;
+}
+
+s32 add_metric(Metrics *metrics, enum Metric_type type, char *name, char *labels, char *help)
+// Register a metric and return its ID. The strings aren't copied, so they have to outlive the registry.
+{
+    assert(!metrics->num_shards); // Too late. Someone has already recorded something.
+
+    Metric *metric = Add(&metrics->metrics);
+    *metric = (Metric){type, name, labels, help, .offset = metrics->num_values};
+
+    if (type == HISTOGRAM)  metrics->num_values += HISTOGRAM_NUM_BUCKETS + 1; // The buckets, then the sum.
+    else                    metrics->num_values += 1;
+
+    return metrics->metrics.count - 1;
+}
+
+static s64 *get_shard(Metrics *metrics)
+// Get this thread's shard, claiming one the first time.
+{
+    if (current_metrics == metrics)  return current_shard;
+
+    s32 index = __atomic_fetch_add(&metrics->num_shards, 1, __ATOMIC_SEQ_CST);
+    index = Min(index, METRICS_MAX_SHARDS-1);
+
+    // If we're sharing the last shard, someone else may be making it at the same time. Whoever gets there first wins.
+    s64 *shard = New(metrics->num_values, s64, metrics->context);
+    s64 *expected = NULL;
+    if (!__atomic_compare_exchange_n(&metrics->shards[index], &expected, shard, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        dealloc(shard, metrics->context);
+        shard = expected;
+    }
+
+    current_metrics = metrics;
+    current_shard   = shard;
+
+    return shard;
+}
+
+void add_to_metric(Metrics *metrics, s32 metric, s64 amount)
+// Add to a counter or gauge. A gauge can go down.
+{
+    Metric *m = &metrics->metrics.data[metric];
+    assert(m->type == COUNTER || m->type == GAUGE);
+
+    s64 *shard = get_shard(metrics);
+
+    // Only the last shard can be shared, but we'd need a branch to tell, so always use an atomic add. Without
+    // contention it's cheap.
+    __atomic_fetch_add(&shard[m->offset], amount, __ATOMIC_RELAXED);
+}
+
+static int get_bucket(s64 value)
+// Find a value's bucket. Each bucket covers (its lower bound, its upper bound], like Prometheus's le="..." buckets.
+{
+    s64 x = value - 1;
+    if (x < HISTOGRAM_MIN_VALUE)  return 0;
+
+    int exponent = 63 - __builtin_clzll(x); // floor(log2(x))
+    if (exponent >= HISTOGRAM_MAX_EXPONENT)  return HISTOGRAM_NUM_BUCKETS-1;
+
+    int sub = (x >> (exponent - HISTOGRAM_SUB_BITS)) & (SUB_COUNT-1);
+
+    return 1 + ((exponent - HISTOGRAM_MIN_EXPONENT) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+static s64 get_bucket_limit(int bucket)
+// The largest value that goes in a bucket. The last bucket has no limit.
+{
+    if (bucket == 0)  return HISTOGRAM_MIN_VALUE;
+
+    int exponent = HISTOGRAM_MIN_EXPONENT + ((bucket-1) >> HISTOGRAM_SUB_BITS);
+    int sub      = (bucket-1) & (SUB_COUNT-1);
+
+    return (s64)(SUB_COUNT + sub + 1) << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+void record_value(Metrics *metrics, s32 histogram, s64 microseconds)
+{
+    Metric *m = &metrics->metrics.data[histogram];
+    assert(m->type == HISTOGRAM);
+
+    s64 *shard  = get_shard(metrics);
+    s64 *values = &shard[m->offset];
+
+    __atomic_fetch_add(&values[get_bucket(microseconds)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&values[HISTOGRAM_NUM_BUCKETS], microseconds, __ATOMIC_RELAXED);
+}
+
+static s64 sum_shards(Metrics *metrics, s64 offset)
+{
+    s32 num_shards = Min(__atomic_load_n(&metrics->num_shards, __ATOMIC_SEQ_CST), METRICS_MAX_SHARDS);
+
+    s64 sum = 0;
+    for (s32 i = 0; i < num_shards; i++) {
+        s64 *shard = __atomic_load_n(&metrics->shards[i], __ATOMIC_ACQUIRE);
+        if (shard)  sum += __atomic_load_n(&shard[offset], __ATOMIC_RELAXED);
+    }
+
+    return sum;
+}
+
+static void write_metric(Metrics *metrics, Metric *metric, char_array *out)
+{
+    char *labels = metric->labels ? metric->labels : "";
+    char *comma  = metric->labels ? "," : "";
+
+    if (metric->type != HISTOGRAM) {
+        s64 value = sum_shards(metrics, metric->offset);
+
+        if (metric->labels)  append_string(out, "%s{%s} %ld\n", metric->name, labels, value);
+        else                 append_string(out, "%s %ld\n", metric->name, value);
+        return;
+    }
+
+    s64 counts[HISTOGRAM_NUM_BUCKETS];
+    s64 total = 0;
+    for (int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        counts[i] = sum_shards(metrics, metric->offset + i);
+        total    += counts[i];
+    }
+
+    // Leave out histograms that haven't recorded anything, because there are lots of routes and phases and not every
+    // route has every phase. Prometheus doesn't mind a series that appears later.
+    if (!total)  return;
+
+    // Prometheus buckets are cumulative.
+    s64 cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_NUM_BUCKETS-1; i++) {
+        cumulative += counts[i];
+        append_string(out, "%s_bucket{%s%sle=\"%g\"} %ld\n", metric->name, labels, comma, get_bucket_limit(i)/1.0e6, cumulative);
+    }
+    append_string(out, "%s_bucket{%s%sle=\"+Inf\"} %ld\n", metric->name, labels, comma, total);
+
+    s64 sum = sum_shards(metrics, metric->offset + HISTOGRAM_NUM_BUCKETS);
+
+    // The sum and count are read after the buckets, so they can be a little ahead of them.
+    append_string(out, "%s_sum{%s} %g\n", metric->name, labels, sum/1.0e6);
+    append_string(out, "%s_count{%s} %ld\n", metric->name, labels, total);
+}
+
+void write_metrics(Metrics *metrics, char_array *out)
+// Append every metric to out in the Prometheus text format, grouped by name.
+{
+    Metric_array *all = &metrics->metrics;
+
+    char *type_names[] = {[COUNTER] = "counter", [GAUGE] = "gauge", [HISTOGRAM] = "histogram"};
+
+    for (s64 i = 0; i < all->count; i++) {
+        Metric *first = &all->data[i];
+
+        // Skip the metric if we've already written its family.
+        bool seen = false;
+        for (s64 j = 0; j < i && !seen; j++)  seen = !strcmp(all->data[j].name, first->name);
+        if (seen)  continue;
+
+        append_string(out, "# HELP %s %s\n", first->name, first->help);
+        append_string(out, "# TYPE %s %s\n", first->name, type_names[first->type]);
+
+        for (s64 j = i; j < all->count; j++) {
+            Metric *metric = &all->data[j];
+            if (!strcmp(metric->name, first->name))  write_metric(metrics, metric, out);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include "array.h"
+
+//
+// A Metrics registry holds counters, gauges and histograms, and writes them out in the Prometheus text format.
+//
+//      Metrics *metrics = create_metrics(context);
+//
+//      s32 requests = add_metric(metrics, COUNTER, "requests_total", "route=\"/\"", "How many requests we've handled.");
+//      s32 latency  = add_metric(metrics, HISTOGRAM, "latency_seconds", "route=\"/\"", "How long requests take.");
+//
+//      add_to_metric(metrics, requests, 1);
+//      record_value(metrics, latency, microseconds);
+//
+//      write_metrics(metrics, &out);
+//
+// Metrics with the same name form a family and should differ in their labels. Register every metric before anyone
+// records anything. After that the registry is fixed and any thread can record without taking a lock: each thread
+// adds to its own shard of the values, and write_metrics() adds the shards up.
+//
+// Histograms are for durations. They take microseconds and write out seconds, which is what Prometheus expects. The
+// buckets are HDR-style: two per power of two, so a bucket's upper bound is at most 1.5 times its lower bound,
+// from HISTOGRAM_MIN_VALUE up to about 134 seconds.
+//
+typedef struct Metric  Metric;
+typedef Array(Metric)  Metric_array;
+typedef struct Metrics Metrics;
+
+#define METRICS_MAX_SHARDS       64      // Threads beyond this many share the last shard.
+
+#define HISTOGRAM_SUB_BITS       1       // Each power of two is split into 2^HISTOGRAM_SUB_BITS buckets.
+#define HISTOGRAM_MIN_EXPONENT   4       // Values up to 2^4 microseconds all go in the first bucket.
+#define HISTOGRAM_MAX_EXPONENT   27      // Values above 2^27 microseconds all go in the last bucket (+Inf).
+#define HISTOGRAM_MIN_VALUE      (1 << HISTOGRAM_MIN_EXPONENT)
+#define HISTOGRAM_NUM_BUCKETS    (1 + ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_MIN_EXPONENT) << HISTOGRAM_SUB_BITS) + 1)
+
+enum Metric_type {COUNTER=1, GAUGE, HISTOGRAM};
+
+struct Metric {
+    enum Metric_type        type;
+    char                   *name;
+    char                   *labels;         // Like `route="/",phase="send"`. Can be NULL.
+    char                   *help;
+    s64                     offset;         // Where the metric's values start in each shard. A histogram has its buckets, then its sum.
+};
+
+struct Metrics {
+    Memory_context         *context;
+
+    Metric_array            metrics;
+    s64                     num_values;     // The size of each shard.
+
+    s64                    *shards[METRICS_MAX_SHARDS]; // Allocated by each thread the first time it records something.
+    s32                     num_shards;     // How many threads have claimed a shard. Once this isn't 0, the registry is fixed.
+};
+
+Metrics *create_metrics(Memory_context *context);
+s32 add_metric(Metrics *metrics, enum Metric_type type, char *name, char *labels, char *help);
+void add_to_metric(Metrics *metrics, s32 metric, s64 amount);
+void record_value(Metrics *metrics, s32 histogram, s64 microseconds);
+void write_metrics(Metrics *metrics, char_array *out);
+
+#endif // METRICS_H_INCLUDED
@@ -1,8 +1,10 @@
 #include <arpa/inet.h> // For ntohl(), which we use in get_u32_from_cell().
+#include <poll.h>
 
 #include "pg.h"
 #include "strings.h"
 #include "system.h"
+#include "trace.h"
 
 static u64 hash_query(char *query, string_array *params)
 {
@@ -33,6 +35,52 @@ static void add_s32(u8_array *array, s32 number)
     array->count = new_count;
 }
 
+static PGresult *wait_for_result(PG_client *client)
+// Wait for the result of the query we've sent, checking every so often whether to cancel it. Return NULL if we cancel.
+{
+    PGconn *conn = client->conn;
+
+    int CHECK_INTERVAL = 50; // Milliseconds.
+
+    while (PQisBusy(conn)) {
+        struct pollfd poll_fd = {PQsocket(conn), POLLIN};
+
+        int r = poll(&poll_fd, 1, CHECK_INTERVAL);
+        if (r < 0 && errno != EINTR)  Fatal("poll failed (%s).", get_last_error().string);
+
+        if (r > 0) {
+            if (!PQconsumeInput(conn))  break; // PQgetResult() will report the error.
+            continue;
+        }
+
+        if ((*client->is_cancelled)(client->cancel_data)) {
+            char error[256];
+
+            PGcancel *cancel = PQgetCancel(conn);
+            if (!cancel || !PQcancel(cancel, error, sizeof(error))) {
+                log_error("We couldn't cancel a query (%s).", cancel ? error : "no cancel object");
+            }
+            if (cancel)  PQfreeCancel(cancel);
+
+            // Throw away whatever the server sends back, so the connection is ready for the next query.
+            if (client->keep_alive) {
+                PGresult *result;
+                while ((result = PQgetResult(conn)))  PQclear(result);
+            }
+
+            return NULL;
+        }
+    }
+
+    PGresult *result = PQgetResult(conn);
+
+    // We only send one statement, but libpq wants us to keep calling PQgetResult() until it returns NULL.
+    PGresult *extra;
+    while ((extra = PQgetResult(conn)))  PQclear(extra);
+
+    return result;
+}
+
 static PG_result *query_database_uncached(PG_client *client, char *query, string_array *params, Memory_context *context)
 // Actually query the database and parse the result.
 // This function is called by query_database().
@@ -61,10 +109,22 @@ static PG_result *query_database_uncached(PG_client *client, char *query, string
         int num_params = (params) ? params->count : 0;
         char const *const *param_data = (params) ? (char const *const *)params->data : NULL;
 
-        query_result = PQexecParams(client->conn, query, num_params, NULL, param_data, NULL, NULL, 1);
+        if (client->is_cancelled) {
+            int sent = PQsendQueryParams(client->conn, query, num_params, NULL, param_data, NULL, NULL, 1);
+
+            query_result = sent ? wait_for_result(client) : NULL;
+            if (sent && !query_result) {
+                // We cancelled the query. It isn't an error worth logging.
+                result = NULL;
+                goto done;
+            }
+        } else {
+            query_result = PQexecParams(client->conn, query, num_params, NULL, param_data, NULL, NULL, 1);
+        }
 
         if (PQresultStatus(query_result) != PGRES_TUPLES_OK) {
             log_error("Query failed: %s", PQerrorMessage(client->conn));
+            PQclear(query_result);
             result = NULL;
             goto done;
         }
@@ -113,8 +173,13 @@ PG_result *query_database(PG_client *client, char *query, string_array *params,
 {
     Memory_context *ctx = context;
 
+    s64 span = BeginSpan();
+
     if (!client->use_cache) {
-        return query_database_uncached(client, query, params, ctx);
+        PG_result *result = query_database_uncached(client, query, params, ctx);
+        EndSpan("query_database", span);
+
+        return result;
     }
 
     char cache_dir[]    = "/tmp"; //|Todo: Create our own directory for cache files.
@@ -212,11 +277,14 @@ PG_result *query_database(PG_client *client, char *query, string_array *params,
         s64 num_bytes_parsed = d - cache_file->data;
         assert(num_bytes_parsed == cache_file->count);
 
+        EndSpan("query_database (cache hit)", span);
+
         return result;
     }
 
     // Make the query and parse the result.
     PG_result *result = query_database_uncached(client, query, params, ctx);
+    if (!result)  return NULL; // Don't cache a failed or cancelled query.
 
     //
     // Write the result to a cache file.
@@ -275,6 +343,8 @@ PG_result *query_database(PG_client *client, char *query, string_array *params,
 
     write_array_to_file(cache_file, cache_file_name);
 
+    EndSpan("query_database (cache miss)", span);
+
     return result;
 }
 
@@ -18,11 +18,17 @@ typedef struct PG_result PG_result;
 // The connection will also be closed by this function unless the client's .keep_alive is true.
 // So if you set .keep_alive, you'll need to call close_database() yourself when you're done.
 //
+// If the query is on behalf of someone who might give up waiting, set .is_cancelled. While the query is running, we
+// call .is_cancelled(.cancel_data) every so often, and if it returns true, we cancel the query with PQcancel() and
+// return NULL.
+//
 struct PG_client {
     char   *conn_string;
     PGconn *conn;
     bool    keep_alive; // If true, don't close the connection after a query.
     bool    use_cache;  // If true, cache query results.
+    bool  (*is_cancelled)(void *data); // If set, we cancel the query when this returns true.
+    void   *cancel_data;
 };
 
 //
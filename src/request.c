@@ -0,0 +1,375 @@
+// For strncasecmp(), we need _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "request.h"
+#include "strings.h"
+
+//
+// We scan a block of bytes at a time. For each block we make a bit mask with a bit for each byte, lowest byte first,
+// and then find the first set bit with __builtin_ctz().
+//
+#if defined(__AVX2__)
+
+#define BLOCK_SIZE 32
+
+static u32 match_byte(char *data, char c)
+// Set a bit for each of the 32 bytes at data that is c.
+{
+    __m256i block = _mm256_loadu_si256((__m256i *)data);
+    return (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(c)));
+}
+
+static __m256i in_range(__m256i block, u8 low, u8 high)
+// Set each byte that is between low and high (inclusive) to 0xff and the rest to 0. Subtracting low wraps the bytes
+// below it round to the top, so then one unsigned comparison with high-low does both ends of the range.
+{
+    __m256i offset = _mm256_sub_epi8(block, _mm256_set1_epi8(low));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(high - low)), offset);
+}
+
+static u32 match_uri_chars(char *data)
+// Set a bit for each of the 32 bytes at data that is a letter, a number or one of ALLOWED_URI_CHARS.
+{
+    __m256i block = _mm256_loadu_si256((__m256i *)data);
+
+    // "+,-./" come just before the digits, so one range covers them all.
+    __m256i allowed = in_range(block, '+', '9');
+    allowed = _mm256_or_si256(allowed, in_range(block, 'A', 'Z'));
+    allowed = _mm256_or_si256(allowed, in_range(block, 'a', 'z'));
+    allowed = _mm256_or_si256(allowed, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('_')));
+    allowed = _mm256_or_si256(allowed, _mm256_cmpeq_epi8(block, _mm256_set1_epi8('~')));
+
+    return (u32)_mm256_movemask_epi8(allowed);
+}
+
+#elif defined(__SSE2__)
+
+#define BLOCK_SIZE 16
+
+static u32 match_byte(char *data, char c)
+// Set a bit for each of the 16 bytes at data that is c.
+{
+    __m128i block = _mm_loadu_si128((__m128i *)data);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+static __m128i in_range(__m128i block, u8 low, u8 high)
+// As in the AVX2 version.
+{
+    __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+}
+
+static u32 match_uri_chars(char *data)
+// Set a bit for each of the 16 bytes at data that is a letter, a number or one of ALLOWED_URI_CHARS.
+{
+    __m128i block = _mm_loadu_si128((__m128i *)data);
+
+    __m128i allowed = in_range(block, '+', '9');
+    allowed = _mm_or_si128(allowed, in_range(block, 'A', 'Z'));
+    allowed = _mm_or_si128(allowed, in_range(block, 'a', 'z'));
+    allowed = _mm_or_si128(allowed, _mm_cmpeq_epi8(block, _mm_set1_epi8('_')));
+    allowed = _mm_or_si128(allowed, _mm_cmpeq_epi8(block, _mm_set1_epi8('~')));
+
+    return (u32)_mm_movemask_epi8(allowed);
+}
+
+#endif
+
+static s64 find_byte(char *data, s64 start, s64 end, char c)
+// Return the index of the first c in data between start and end, or end if there isn't one.
+{
+    s64 i = start;
+
+#ifdef BLOCK_SIZE
+    for (; i + BLOCK_SIZE <= end; i += BLOCK_SIZE) {
+        u32 mask = match_byte(data + i, c);
+        if (mask)  return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < end; i++) {
+        if (data[i] == c)  return i;
+    }
+    return end;
+}
+
+static s64 skip_uri_chars(char *data, s64 start, s64 end)
+// Return the index of the first character in data between start and end that isn't a letter, a number or one of
+// ALLOWED_URI_CHARS, or end if they all are.
+{
+    s64 i = start;
+
+#ifdef BLOCK_SIZE
+    u32 all_allowed = (u32)((1ull << BLOCK_SIZE) - 1);
+
+    for (; i + BLOCK_SIZE <= end; i += BLOCK_SIZE) {
+        u32 mask = match_uri_chars(data + i);
+        if (mask != all_allowed)  return i + __builtin_ctz(~mask);
+    }
+#endif
+
+    for (; i < end; i++) {
+        if (!isalnum((u8)data[i]) && !Contains(ALLOWED_URI_CHARS, data[i]))  return i;
+    }
+    return end;
+}
+
+s64 find_request_end(Request *request, char *data, s64 size)
+// Look for the blank line that ends the request's header. Return the size of the request up to and including the
+// blank line, or 0 if we haven't received it yet. Return -1 if the request has too many header lines to fit in
+// request->line_ends. We note the CRLFs we find in request->line_ends, so the next call only looks at the new bytes.
+//
+// The data may hold more than one request if the client has pipelined them. We only look for the end of the first.
+{
+    assert(size <= UINT32_MAX);
+
+    s64 offset = request->scan_offset;
+
+    while (true) {
+        s64 lf = find_byte(data, offset, size, '\n');
+        if (lf == size)  break;
+
+        offset = lf + 1;
+
+        if (lf == 0 || data[lf-1] != '\r')  continue;
+
+        // We've found a CRLF. If it comes straight after the previous one, that's the end of the header.
+        u32 crlf = (u32)(lf - 1);
+        if (request->num_lines > 0 && crlf == request->line_ends[request->num_lines-1] + 2)  return lf + 1;
+
+        if (request->num_lines == countof(request->line_ends))  return -1;
+
+        request->line_ends[request->num_lines] = crlf;
+        request->num_lines += 1;
+    }
+
+    request->scan_offset = (u32)size;
+
+    return 0;
+}
+
+static int fail(Request *request, int status, char *error)
+{
+    request->error = error;
+    return status;
+}
+
+static bool decode_percent(char *data, s64 i, s64 end, char *out)
+// If there's a hex-encoded byte like %2f at data[i], decode it into *out and return true.
+{
+    if (i + 2 >= end)            return false;
+    if (!isxdigit(data[i+1]))    return false;
+    if (!isxdigit(data[i+2]))    return false;
+
+    *out = (char)hex_to_byte(data[i+1], data[i+2]);
+    return true;
+}
+
+int parse_request(Request *request, char *data, s64 size, Memory_context *context)
+// Parse a request whose end find_request_end() has found. Fill in the request and return 0, or return the HTTP status
+// to reply with if the request is invalid, with a message in request->error.
+{
+    assert(request->num_lines > 0);
+    assert(size <= UINT32_MAX);
+
+    request->data         = data;
+    request->http_version = 0;      // Until we know the HTTP version, assume we'll close the connection after replying.
+    request->keep_alive   = false;
+
+    s64 line_end = request->line_ends[0];
+    s64 i = 0; // An index to advance as we parse.
+
+    if (starts_with(data, "GET ")) {
+        request->method = GET;
+        i += 4;
+    } else {
+        return fail(request, 501, "We only support GET requests!\n");
+    }
+
+    //
+    // Parse the path and query string. We copy the ordinary characters across a run at a time, and only look at the
+    // ones in between: the %-encoded bytes and the delimiters.
+    //
+    {
+        char_array  *path  = &request->path;
+        string_dict *query = &request->query_params;
+
+        // The decoded path can't be longer than the rest of the request line.
+        array_reserve(path, path->count + (line_end - i) + 1);
+
+        while (i < line_end) {
+            s64 run_end = skip_uri_chars(data, i, line_end);
+            memcpy(&path->data[path->count], &data[i], run_end - i);
+            path->count += run_end - i;
+            i = run_end;
+
+            if (i < line_end && data[i] == '%' && decode_percent(data, i, line_end, &path->data[path->count])) {
+                path->count += 1;
+                i += 3;
+                continue;
+            }
+            break;
+        }
+        path->data[path->count] = '\0';
+
+        // An & after the path starts the query string just as a ? does.
+        if (i < line_end && (data[i] == '?' || data[i] == '&')) {
+            i += 1;
+
+            // Put the decoded keys and values, null-terminated, one after the other in a buffer. Each key and value
+            // is no longer than it was in the request, and each gets a null byte in place of the = or & after it, so
+            // twice the rest of the line is always enough, even for keys without values, which get an empty string.
+            char *buffer = New(2*(line_end - i) + 2, char, context);
+            char *out    = buffer;
+            char *key    = out;
+            char *value  = NULL; // NULL while we're still reading the key.
+
+            bool finished = false;
+
+            while (i < line_end) {
+                s64 run_end = skip_uri_chars(data, i, line_end);
+                memcpy(out, &data[i], run_end - i);
+                out += run_end - i;
+                i = run_end;
+
+                if (i == line_end)  break;
+
+                char c = data[i];
+
+                if (c == '%') {
+                    if (!decode_percent(data, i, line_end, out))  break;
+                    out += 1;
+                    i += 3;
+                } else if (c == '=') {
+                    if (value || out == key)  break;
+                    *out++ = '\0';
+                    value = out;
+                    i += 1;
+                } else if (c == '&' || c == ' ') {
+                    if (value || out > key) {
+                        // Add the key/value we were building. If the key has no value, its value is an empty string.
+                        *out++ = '\0';
+                        if (!value) {
+                            value  = out;
+                            *out++ = '\0';
+                        }
+                        *Set(query, key) = value;
+
+                        key   = out;
+                        value = NULL;
+                    }
+                    if (c == ' ') {
+                        finished = true; // Success!
+                        break;
+                    }
+                    i += 1;
+                } else {
+                    // There was an unexpected character.
+                    break;
+                }
+            }
+            if (!finished && path->count) {
+                // We came to an unexpected character in the query string. Since we managed to parse a path, we'll
+                // allow it and just disregard the rest of the query string.
+                i = find_byte(data, i, line_end, ' ');
+            }
+        }
+
+        if (i == line_end || data[i] != ' ') {
+            // We came to an unexpected character in the URI, or the end of the line.
+            char_array message = {.context = context};
+            append_string(&message, "The request had an unexpected character at index %ld: ", i);
+            append_string(&message, isalnum(data[i]) ? "'%c'.\n" : "\\x%02x.\n", data[i]);
+
+            return fail(request, 400, message.data);
+        }
+        i += 1;
+    }
+
+    if (starts_with(&data[i], "HTTP/1.0")) {
+        request->http_version = HTTP_VERSION_1_0;
+    } else if (starts_with(&data[i], "HTTP/1.1")) {
+        request->http_version = HTTP_VERSION_1_1;
+        request->keep_alive   = true; // Connection: keep-alive is the default in version 1.1.
+    } else {
+        return fail(request, 505, "Unsupported HTTP version.\n");
+    }
+
+    Header *connection = get_header(request, "connection", NULL);
+    if (connection) {
+        if (header_starts_with(connection, "keep-alive"))  request->keep_alive = true;
+        else if (header_starts_with(connection, "close"))  request->keep_alive = false;
+    }
+
+    return 0;
+}
+
+static void parse_headers(Request *request)
+// Split the header lines that find_request_end() found into names and values.
+{
+    char *data = request->data;
+
+    request->num_headers = 0;
+
+    // The first line is the request line, and the last CRLF ends the last header line.
+    for (s32 i = 1; i < request->num_lines; i++) {
+        s64 start = request->line_ends[i-1] + 2;
+        s64 end   = request->line_ends[i];
+
+        s64 colon = find_byte(data, start, end, ':');
+        if (colon == end)  continue; // Ignore lines that aren't headers.
+
+        s64 value = colon + 1;
+        while (value < end && (data[value] == ' ' || data[value] == '\t'))  value += 1;
+        while (end > value && (data[end-1] == ' ' || data[end-1] == '\t'))  end -= 1;
+
+        Header *header = &request->headers[request->num_headers];
+        request->num_headers += 1;
+
+        *header = (Header){
+            .name       = &data[start],
+            .name_size  = (s32)(colon - start),
+            .value      = &data[value],
+            .value_size = (s32)(end - value),
+        };
+    }
+
+    request->headers_parsed = true;
+}
+
+Header *get_header(Request *request, char *name, Header *previous)
+// Find the request's header with this name, which should be in lowercase. Header names are case-insensitive, so it
+// matches any case. If a header appears more than once, pass the one you've got as previous to get the next one.
+// Otherwise pass NULL. Return NULL if there are no (more) headers with the name.
+{
+    if (!request->data)  return NULL; // We haven't parsed a request.
+
+    if (!request->headers_parsed)  parse_headers(request);
+
+    s64 length = strlen(name);
+
+    s32 first = previous ? (s32)(previous - request->headers) + 1 : 0;
+
+    for (s32 i = first; i < request->num_headers; i++) {
+        Header *header = &request->headers[i];
+        if (header->name_size == length && !strncasecmp(header->name, name, length))  return header;
+    }
+    return NULL;
+}
+
+bool header_starts_with(Header *header, char *prefix)
+// Check whether a header's value starts with prefix, ignoring case.
+{
+    s64 length = strlen(prefix);
+    return header->value_size >= length && !strncasecmp(header->value, prefix, length);
+}
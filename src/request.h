@@ -0,0 +1,77 @@
+#ifndef REQUEST_H_INCLUDED
+#define REQUEST_H_INCLUDED
+
+#include "array.h"
+#include "map.h"
+
+//
+// Parsing HTTP/1.x requests. As the bytes of a request arrive, call find_request_end() on everything received so far.
+// Once it returns the size of the request, parse_request() fills in the rest of the Request:
+//
+//      Request request = {.path = {.context = ctx}, .query_params = {.context = ctx}};
+//
+//      s64 size = find_request_end(&request, data, num_bytes_received);
+//      if (size == 0)  // Wait for more bytes and try again. It picks up where it left off.
+//      if (size < 0)   // The request has more than MAX_REQUEST_HEADERS header lines.
+//
+//      int status = parse_request(&request, data, size, ctx);
+//      if (status)     // The request is invalid. Reply with this status and request.error as the body.
+//
+//      Header *accept = get_header(&request, "accept", NULL);
+//
+// We don't copy the headers. get_header() returns slices of the data, so the data has to stay where it is while the
+// Request is in use. It splits the header lines into names and values the first time it's called, so a request that
+// nobody asks about the headers of doesn't pay for it.
+//
+// Both functions scan 16 bytes at a time with SSE2, or 32 with AVX2 if we're compiled with -mavx2 (or -march=native
+// on a machine that has it). On other architectures, they fall back to going a byte at a time.
+//
+typedef struct Request Request;
+typedef struct Header  Header;
+
+enum HTTP_method {GET=1, POST}; // We can add HTTP_ prefixes to these later if we need.
+
+enum HTTP_version {
+    HTTP_VERSION_1_0=1,
+    HTTP_VERSION_1_1,
+};
+
+#define MAX_REQUEST_HEADERS 64
+
+// These are the characters that we treat just like regular letters and numbers when we come across them
+// in paths and query strings. Everything else either has a special meaning or is not allowed.
+#define ALLOWED_URI_CHARS "-._~/,+"
+
+struct Header {
+    char                   *name;           // As the client sent it, so in any case. Not null-terminated.
+    s32                     name_size;
+    char                   *value;          // Without the whitespace around it. Not null-terminated.
+    s32                     value_size;
+};
+
+struct Request {
+    enum HTTP_method        method;
+    enum HTTP_version       http_version;
+    bool                    keep_alive;     // Whether the client wants to keep the connection open after this request.
+    char_array              path;
+    string_dict             query_params;
+    char                   *error;          // If parse_request() fails, a message for the body of the response.
+
+    // What find_request_end() has found so far. The offsets are from the start of the request.
+    u32                     scan_offset;    // How far we've looked for the end of the request.
+    s32                     num_lines;      // How many CRLFs we've found. The first one ends the request line.
+    u32                     line_ends[MAX_REQUEST_HEADERS+1]; // Where the CRLFs are.
+
+    // What get_header() works from.
+    char                   *data;           // The request's bytes, as passed to parse_request().
+    bool                    headers_parsed; // Whether we've split the header lines into .headers yet.
+    s32                     num_headers;
+    Header                  headers[MAX_REQUEST_HEADERS];
+};
+
+s64 find_request_end(Request *request, char *data, s64 size);
+int parse_request(Request *request, char *data, s64 size, Memory_context *context);
+Header *get_header(Request *request, char *name, Header *previous);
+bool header_starts_with(Header *header, char *prefix);
+
+#endif // REQUEST_H_INCLUDED
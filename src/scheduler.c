@@ -0,0 +1,471 @@
+// For syscall() we need _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "system.h"
+
+typedef struct Task_deque   Task_deque;
+typedef struct Sleeper      Sleeper;
+typedef struct Task_ring    Task_ring;
+
+#define CACHE_LINE_SIZE  64
+
+// How many tasks fit in each worker's deque. If a deque is full, we push to the shared queue instead.
+#define DEQUE_CAPACITY   1024
+
+struct Task_deque {
+    // This is the deque from "Correct and Efficient Work-Stealing for Weak Memory Models" by Lê et al. (2013), with a
+    // fixed-size buffer. The owner pushes and pops at .bottom. Thieves take from .top. Both only ever increase, except
+    // that the owner temporarily decrements .bottom while it pops. The slot for index i is i % DEQUE_CAPACITY.
+    s64             top;
+    u8              padding1[CACHE_LINE_SIZE - sizeof(s64)];
+    s64             bottom;
+    u8              padding2[CACHE_LINE_SIZE - sizeof(s64)];
+
+    u8             *slots;
+};
+
+struct Sleeper {
+    // A futex word. AWAKE or SLEEPING. A thread that pushes a task changes a SLEEPING worker's state to
+    // AWAKE and wakes it up, so at most one sleeping worker is woken per task.
+    u32             state;
+    u8              padding[CACHE_LINE_SIZE - sizeof(u32)];
+};
+
+enum {AWAKE = 0, SLEEPING = 1};
+
+struct Task_ring {
+    // A growable circular buffer. This is the shared queue for threads that don't own a deque.
+    pthread_mutex_t mutex;
+    s64             count;          // Read without the mutex as a hint, so only modify it atomically.
+    s64             head;
+    s64             limit;
+    u8             *data;
+};
+
+struct Scheduler {
+    Memory_context *context;
+
+    u64             task_size;
+    int             num_workers;
+
+    // There is one deque for each worker plus one extra for the thread that attaches with is_worker == false.
+    Task_deque     *deques;
+    Sleeper        *sleepers;
+    int             next_worker;    // The index we'll give to the next worker to attach.
+    bool            has_feeder;     // Whether a non-worker thread owns the extra deque.
+
+    s64             num_searching;  // How many workers are awake and looking for tasks in other deques.
+    s64             num_sleeping;
+    u32             num_active;     // Workers with this index or higher are parked. A futex word, so parked workers can wait on it.
+
+    Task_ring       shared;
+};
+
+// Which deque the current thread owns, if any.
+static __thread Scheduler *current_scheduler = NULL;
+static __thread int        current_deque     = -1;
+
+static long futex(u32 *address, int op, u32 value)
+{
+    return syscall(SYS_futex, address, op, value, NULL, NULL, 0);
+}
+
+Scheduler *create_scheduler(int num_workers, u64 task_size, Memory_context *context)
+{
+    assert(num_workers > 0);
+
+    Scheduler *s = New(Scheduler, context);
+
+    s->context     = context;
+    s->task_size   = task_size;
+    s->num_workers = num_workers;
+    s->num_active  = num_workers;
+
+    s->deques   = New(num_workers+1, Task_deque, context);
+    s->sleepers = New(num_workers, Sleeper, context);
+
+    for (int i = 0; i < num_workers+1; i++) {
+        s->deques[i].slots = alloc(DEQUE_CAPACITY, task_size, context);
+    }
+
+    pthread_mutex_init(&s->shared.mutex, NULL);
+    s->shared.limit = 8;
+    s->shared.data  = alloc(s->shared.limit, task_size, context);
+
+    return s;
+}
+
+void free_scheduler(Scheduler *scheduler)
+{
+    Scheduler *s = scheduler;
+
+    for (int i = 0; i < s->num_workers+1; i++)  dealloc(s->deques[i].slots, s->context);
+
+    pthread_mutex_destroy(&s->shared.mutex);
+    dealloc(s->shared.data, s->context);
+
+    dealloc(s->deques, s->context);
+    dealloc(s->sleepers, s->context);
+    dealloc(s, s->context);
+}
+
+void attach_to_scheduler(Scheduler *scheduler, bool is_worker)
+// Give the calling thread a deque of its own.
+{
+    Scheduler *s = scheduler;
+
+    assert(current_scheduler == NULL);
+
+    int index;
+    if (is_worker) {
+        index = __atomic_fetch_add(&s->next_worker, 1, __ATOMIC_RELAXED);
+        assert(index < s->num_workers);
+    } else {
+        bool already_had_feeder = __atomic_exchange_n(&s->has_feeder, true, __ATOMIC_RELAXED);
+        assert(!already_had_feeder);
+        index = s->num_workers;
+    }
+
+    current_scheduler = s;
+    current_deque     = index;
+}
+
+void detach_from_scheduler(Scheduler *scheduler)
+// Only the non-worker thread should need this, e.g. if it wants to attach to a different scheduler later.
+// Its deque must be empty.
+{
+    assert(current_scheduler == scheduler);
+    assert(current_deque == scheduler->num_workers);
+
+    Task_deque *deque = &scheduler->deques[current_deque];
+    assert(__atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) == __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED));
+
+    scheduler->has_feeder = false;
+
+    current_scheduler = NULL;
+    current_deque     = -1;
+}
+
+static bool push_to_deque(Scheduler *s, Task_deque *deque, void *task)
+// Only the deque's owner may call this. Return false if the deque is full.
+{
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+
+    if (b - t >= DEQUE_CAPACITY)  return false;
+
+    memcpy(deque->slots + (b % DEQUE_CAPACITY)*s->task_size, task, s->task_size);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+
+    return true;
+}
+
+static bool pop_from_deque(Scheduler *s, Task_deque *deque, void *task)
+// Only the deque's owner may call this. Return false if the deque is empty.
+{
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        // The deque was empty.
+        __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    memcpy(task, deque->slots + (b % DEQUE_CAPACITY)*s->task_size, s->task_size);
+
+    if (t < b)  return true; // There was more than one task, so no thief could have been competing for this one.
+
+    // This was the last task. Race any thieves for it by trying to increment .top.
+    bool won = __atomic_compare_exchange_n(&deque->top, &t, t+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, b+1, __ATOMIC_RELAXED);
+
+    return won;
+}
+
+static bool steal_from_deque(Scheduler *s, Task_deque *deque, void *task)
+// Any thread may call this. Return false if the deque was empty or another thread beat us to the task.
+{
+    s64 t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)  return false;
+
+    // We copy the task before we know whether we've won it. This is fine because the owner can't overwrite
+    // this slot until .top has moved past t, in which case the compare-exchange below fails.
+    memcpy(task, deque->slots + (t % DEQUE_CAPACITY)*s->task_size, s->task_size);
+
+    return __atomic_compare_exchange_n(&deque->top, &t, t+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void push_to_shared_queue(Scheduler *s, void *task)
+{
+    Task_ring *ring = &s->shared;
+
+    pthread_mutex_lock(&ring->mutex);
+
+    if (ring->count == ring->limit) {
+        // Double the buffer and unwrap the tasks so they start at index 0.
+        u8 *data = alloc(2*ring->limit, s->task_size, s->context);
+
+        s64 num_before_wrap = ring->limit - ring->head;
+        memcpy(data, ring->data + ring->head*s->task_size, num_before_wrap*s->task_size);
+        memcpy(data + num_before_wrap*s->task_size, ring->data, ring->head*s->task_size);
+
+        dealloc(ring->data, s->context);
+        ring->data   = data;
+        ring->head   = 0;
+        ring->limit *= 2;
+    }
+
+    s64 index = (ring->head + ring->count) % ring->limit;
+    memcpy(ring->data + index*s->task_size, task, s->task_size);
+
+    __atomic_store_n(&ring->count, ring->count+1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+static bool pop_from_shared_queue(Scheduler *s, void *task)
+{
+    Task_ring *ring = &s->shared;
+
+    // Don't take the lock if the queue looks empty.
+    if (!__atomic_load_n(&ring->count, __ATOMIC_SEQ_CST))  return false;
+
+    bool got_task = false;
+
+    pthread_mutex_lock(&ring->mutex);
+
+    if (ring->count > 0) {
+        memcpy(task, ring->data + ring->head*s->task_size, s->task_size);
+        ring->head = (ring->head + 1) % ring->limit;
+        __atomic_store_n(&ring->count, ring->count-1, __ATOMIC_RELAXED);
+        got_task = true;
+    }
+
+    pthread_mutex_unlock(&ring->mutex);
+
+    return got_task;
+}
+
+static void wake_one_worker(Scheduler *s)
+{
+    // This fence pairs with the ones in pop_task_(). Either we see that a worker is searching or about to sleep,
+    // or that worker sees the task we just pushed when it checks one last time before sleeping.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // If a worker is already searching for tasks, it will find ours. Waking another would only make them compete.
+    if (__atomic_load_n(&s->num_searching, __ATOMIC_RELAXED))  return;
+    if (!__atomic_load_n(&s->num_sleeping, __ATOMIC_RELAXED))  return;
+
+    // Only wake an active worker. A parked one would go straight back to waiting.
+    int num_active = __atomic_load_n(&s->num_active, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < num_active; i++) {
+        Sleeper *sleeper = &s->sleepers[i];
+
+        u32 expected = SLEEPING;
+        bool woke = __atomic_compare_exchange_n(&sleeper->state, &expected, AWAKE, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        if (woke) {
+            futex(&sleeper->state, FUTEX_WAKE_PRIVATE, 1);
+            return;
+        }
+    }
+}
+
+static bool has_pending_tasks(Scheduler *s)
+// This is only a hint.
+{
+    if (__atomic_load_n(&s->shared.count, __ATOMIC_RELAXED))  return true;
+
+    for (int i = 0; i < s->num_workers+1; i++) {
+        Task_deque *deque = &s->deques[i];
+
+        s64 t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+        s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+        if (b > t)  return true;
+    }
+
+    return false;
+}
+
+void push_task_(Scheduler *scheduler, void *task, u64 task_size)
+{
+    Scheduler *s = scheduler;
+    assert(task_size == s->task_size);
+
+    bool pushed = false;
+    if (current_scheduler == s)  pushed = push_to_deque(s, &s->deques[current_deque], task);
+    if (!pushed)  push_to_shared_queue(s, task);
+
+    wake_one_worker(s);
+}
+
+static bool find_task(Scheduler *s, void *task)
+// Look for a task in our own deque, then the shared queue, then everyone else's deques.
+{
+    int own = (current_scheduler == s) ? current_deque : -1;
+
+    if (own >= 0 && pop_from_deque(s, &s->deques[own], task))  return true;
+
+    if (pop_from_shared_queue(s, task))  return true;
+
+    // Start stealing from the deque after our own, so that thieves spread out.
+    int num_deques = s->num_workers + 1;
+    int start      = (own >= 0) ? own+1 : 0;
+
+    for (int attempt = 0; attempt < 2; attempt++) { // Try twice in case we lose a race for the only task in a deque.
+        for (int i = 0; i < num_deques; i++) {
+            int victim = (start + i) % num_deques;
+            if (victim == own)  continue;
+
+            if (steal_from_deque(s, &s->deques[victim], task))  return true;
+        }
+    }
+
+    return false;
+}
+
+static void wait_while_parked(Scheduler *s)
+// If set_num_active_workers() has parked the current worker, wait until it unparks us.
+{
+    while (true) {
+        u32 num_active = __atomic_load_n(&s->num_active, __ATOMIC_ACQUIRE);
+        if (current_deque < num_active)  return;
+
+        long r = futex(&s->num_active, FUTEX_WAIT_PRIVATE, num_active);
+        if (r == -1 && errno != EAGAIN && errno != EINTR) {
+            Fatal("futex wait failed (%s).", get_last_error().string);
+        }
+    }
+}
+
+void pop_task_(Scheduler *scheduler, void *task, u64 task_size)
+// Only workers may call this. Wait until there is a task.
+{
+    Scheduler *s = scheduler;
+    assert(task_size == s->task_size);
+    assert(current_scheduler == s && current_deque < s->num_workers);
+
+    // The fast path: there's a task in our own deque. We check this before we check whether we've been parked,
+    // because nobody else will take these tasks while we're parked, except by stealing.
+    if (pop_from_deque(s, &s->deques[current_deque], task))  return;
+
+    Sleeper *sleeper = &s->sleepers[current_deque];
+
+    while (true) {
+        wait_while_parked(s);
+
+        __atomic_fetch_add(&s->num_searching, 1, __ATOMIC_SEQ_CST);
+
+        bool found = find_task(s, task);
+        if (!found) {
+            // Stop searching and announce that we're going to sleep, then check for tasks one last time.
+            __atomic_fetch_sub(&s->num_searching, 1, __ATOMIC_SEQ_CST);
+            __atomic_fetch_add(&s->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&sleeper->state, SLEEPING, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            found = find_task(s, task);
+            if (!found) {
+                // The futex call returns straight away if someone has already set our state to AWAKE.
+                while (__atomic_load_n(&sleeper->state, __ATOMIC_ACQUIRE) == SLEEPING) {
+                    long r = futex(&sleeper->state, FUTEX_WAIT_PRIVATE, SLEEPING);
+                    if (r == -1 && errno != EAGAIN && errno != EINTR) {
+                        Fatal("futex wait failed (%s).", get_last_error().string);
+                    }
+                }
+            }
+
+            __atomic_store_n(&sleeper->state, AWAKE, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&s->num_sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_fetch_add(&s->num_searching, 1, __ATOMIC_SEQ_CST);
+        }
+
+        if (found)  break;
+
+        // Someone woke us, either because there's a task or because they've parked us. If we've been parked, we
+        // might have taken a wakeup meant for a task, so pass it on. Either way, start again.
+        __atomic_fetch_sub(&s->num_searching, 1, __ATOMIC_SEQ_CST);
+
+        bool parked = (current_deque >= __atomic_load_n(&s->num_active, __ATOMIC_ACQUIRE));
+        if (parked && has_pending_tasks(s))  wake_one_worker(s);
+    }
+
+    // We've stopped searching. If we were the last searcher and there's more work, wake someone else to look for it.
+    s64 num_searching = __atomic_sub_fetch(&s->num_searching, 1, __ATOMIC_SEQ_CST);
+    if (num_searching == 0 && has_pending_tasks(s))  wake_one_worker(s);
+}
+
+bool try_pop_task_(Scheduler *scheduler, void *task, u64 task_size)
+// Any thread may call this. Return false instead of waiting if there are no tasks.
+{
+    Scheduler *s = scheduler;
+    assert(task_size == s->task_size);
+
+    return find_task(s, task);
+}
+
+void set_num_active_workers(Scheduler *scheduler, int num_active)
+// Let only the first num_active workers take tasks. Any thread may call this. A worker we park finishes its current
+// task and the rest of its deque first. The ones we unpark start looking for tasks straight away.
+{
+    Scheduler *s = scheduler;
+    assert(0 < num_active && num_active <= s->num_workers);
+
+    u32 old = __atomic_exchange_n(&s->num_active, num_active, __ATOMIC_SEQ_CST);
+
+    if (num_active > old) {
+        futex(&s->num_active, FUTEX_WAKE_PRIVATE, INT32_MAX);
+    } else {
+        // Wake the workers we've parked that are asleep waiting for tasks, so they go and wait in wait_while_parked()
+        // instead, and stop counting as idle.
+        for (int i = num_active; i < old; i++) {
+            Sleeper *sleeper = &s->sleepers[i];
+
+            u32 expected = SLEEPING;
+            bool woke = __atomic_compare_exchange_n(&sleeper->state, &expected, AWAKE, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+            if (woke)  futex(&sleeper->state, FUTEX_WAKE_PRIVATE, 1);
+        }
+    }
+}
+
+int get_num_active_workers(Scheduler *scheduler)
+{
+    return __atomic_load_n(&scheduler->num_active, __ATOMIC_RELAXED);
+}
+
+s64 count_pending_tasks(Scheduler *scheduler)
+// How many tasks are waiting for a worker, roughly. The count can be out of date by the time we return.
+{
+    Scheduler *s = scheduler;
+
+    s64 count = __atomic_load_n(&s->shared.count, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < s->num_workers+1; i++) {
+        Task_deque *deque = &s->deques[i];
+
+        s64 t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+        s64 b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+        if (b > t)  count += b - t;
+    }
+
+    return count;
+}
+
+int count_idle_workers(Scheduler *scheduler)
+// How many active workers are asleep for want of tasks, roughly.
+{
+    return __atomic_load_n(&scheduler->num_sleeping, __ATOMIC_RELAXED);
+}
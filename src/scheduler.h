@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H_INCLUDED
+#define SCHEDULER_H_INCLUDED
+
+#include "context.h"
+
+//
+// A Scheduler hands tasks to a fixed set of worker threads. Each worker has its own lock-free deque. A worker pushes
+// and pops at the bottom of its deque, and when its deque is empty it steals from the top of the others. Workers with
+// nothing to do sleep on a futex, and each push wakes at most one sleeping worker.
+//
+// Tasks are copied by value, like the keys and values in a Map. The scheduler doesn't know what a task is; it only
+// knows its size. Use the macros at the bottom to get some type-checking:
+//
+//      Scheduler *scheduler = create_scheduler(num_workers, sizeof(Task), context);
+//
+//      push_task(scheduler, (Task){...});
+//
+//      Task task;
+//      pop_task(scheduler, &task);
+//
+// Each worker thread must call attach_to_scheduler(scheduler, true) before it pops any tasks. One other thread (in the
+// server, the main thread) can call attach_to_scheduler(scheduler, false) to get a deque of its own that the workers
+// steal from. Threads that don't attach can still push tasks; these go onto a shared, mutex-protected queue.
+//
+// The number of workers is fixed when you create the scheduler, but you can park some of them and unpark them later
+// to match the load. Only the first n workers to attach take tasks after set_num_active_workers(scheduler, n); the
+// others finish what's in their deques and wait. count_pending_tasks() and count_idle_workers() tell you how busy
+// the active ones are.
+//
+typedef struct Scheduler Scheduler;
+
+Scheduler *create_scheduler(int num_workers, u64 task_size, Memory_context *context);
+void free_scheduler(Scheduler *scheduler);
+void attach_to_scheduler(Scheduler *scheduler, bool is_worker);
+void detach_from_scheduler(Scheduler *scheduler);
+void push_task_(Scheduler *scheduler, void *task, u64 task_size);
+void pop_task_(Scheduler *scheduler, void *task, u64 task_size);
+bool try_pop_task_(Scheduler *scheduler, void *task, u64 task_size);
+void set_num_active_workers(Scheduler *scheduler, int num_active);
+int get_num_active_workers(Scheduler *scheduler);
+s64 count_pending_tasks(Scheduler *scheduler);
+int count_idle_workers(Scheduler *scheduler);
+
+// push_task() is variadic so that you can pass a compound literal with commas in it.
+#define push_task(SCHEDULER, ...)       push_task_((SCHEDULER), &(__VA_ARGS__), sizeof(__VA_ARGS__))
+#define pop_task(SCHEDULER, TASK)       pop_task_((SCHEDULER), (TASK), sizeof(*(TASK)))
+#define try_pop_task(SCHEDULER, TASK)   try_pop_task_((SCHEDULER), (TASK), sizeof(*(TASK)))
+
+#endif // SCHEDULER_H_INCLUDED
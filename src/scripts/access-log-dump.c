@@ -0,0 +1,64 @@
+// Print a binary access log (see access_log.h) as text, one line per request, like a text access log.
+//
+//      bin/votemap --access-log access.bin --binary-log
+//      bin/scripts/access-log-dump access.bin
+//
+// With --tsv, print tab-separated columns instead, which are easier to load into a spreadsheet or a database:
+// time in microseconds since the epoch, duration in microseconds, bytes, status, method and target.
+#include "../access_log.h"
+#include "../strings.h"
+#include "../system.h"
+
+int main(int argc, char **argv)
+{
+    char *file_name = NULL;
+    bool  tsv       = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--tsv"))  tsv = true;
+        else                            file_name = argv[i];
+    }
+    if (!file_name)  Fatal("Usage: %s [--tsv] file", argv[0]);
+
+    Memory_context *ctx = new_context(NULL);
+
+    u8_array *file = load_binary_file(file_name, ctx);
+    if (!file)  Fatal("Couldn't read %s.", file_name);
+
+    u8 *d   = file->data;
+    u8 *end = file->data + file->count;
+
+    if (file->count < lengthof(ACCESS_LOG_MAGIC) || memcmp(d, ACCESS_LOG_MAGIC, lengthof(ACCESS_LOG_MAGIC))) {
+        Fatal("%s isn't a binary access log.", file_name);
+    }
+    d += lengthof(ACCESS_LOG_MAGIC);
+
+    s64 HEADER_SIZE = 3*sizeof(s64) + 3*sizeof(u16);
+
+    while (d < end) {
+        if (end - d < HEADER_SIZE)  Fatal("%s ends part way through a record.", file_name);
+
+        s64 time;           memcpy(&time,          d, sizeof(s64));  d += sizeof(s64);
+        s64 duration;       memcpy(&duration,      d, sizeof(s64));  d += sizeof(s64);
+        s64 num_bytes;      memcpy(&num_bytes,     d, sizeof(s64));  d += sizeof(s64);
+        u16 status;         memcpy(&status,        d, sizeof(u16));  d += sizeof(u16);
+        u16 method_length;  memcpy(&method_length, d, sizeof(u16));  d += sizeof(u16);
+        u16 target_length;  memcpy(&target_length, d, sizeof(u16));  d += sizeof(u16);
+
+        if (end - d < method_length + target_length)  Fatal("%s ends part way through a record.", file_name);
+
+        char *method = (char *)d;  d += method_length;
+        char *target = (char *)d;  d += target_length;
+
+        if (tsv) {
+            printf("%ld\t%ld\t%ld\t%d\t%.*s\t%.*s\n", time, duration, num_bytes, status,
+                   method_length, method, target_length, target);
+        } else {
+            printf("%ld.%06ld %d %.*s %.*s %.3fms %ldB\n", time/1000000, time%1000000, status,
+                   method_length, method, target_length, target, duration/1000.0, num_bytes);
+        }
+    }
+
+    free_context(ctx);
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Measure what it costs to compress response bodies and how many bytes it saves, for each encoding and level.
+// Use this to choose the .compression_level for a route.
+//
+//      bin/scripts/compression-bench [file...]
+//
+// Each file should be a recorded response body, e.g. a tile saved with
+//
+//      curl -s -o tile.bin 'http://localhost:6008/vertices/...'
+//
+// With no files, we draw a synthetic tile: a grid of wobbly districts in party colours with boundary lines, like
+// serve_vertices() draws.
+//
+// For each body we print the compressed size and the time to compress it. We also print the time saved sending the
+// smaller body over a 10 Mbit/s mobile connection, minus the time spent compressing. Higher is better.
+//
+// For clock_gettime() we need _POSIX_C_SOURCE >= 199309L.
+#define _POSIX_C_SOURCE 199309L
+
+#include <math.h>
+#include <time.h>
+
+#include "../compress.h"
+#include "../draw.h"
+#include "../strings.h"
+#include "../system.h"
+
+const double PI = 3.14159265358979323846;
+
+static double now_ms()
+// get_monotonic_time() only has millisecond resolution, which is too coarse for small bodies.
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000.0 + t.tv_nsec/1000000.0;
+}
+
+static u8_array *draw_synthetic_tile(Memory_context *context)
+{
+    Vertex_array *verts = NewArray(verts, context);
+
+    Vector3 colours[] = {{0.9, 0.1, 0.1}, {0.1, 0.2, 0.8}, {0.1, 0.6, 0.2}, {0.5, 0.5, 0.5}, {0.3, 0.3, 0.3}};
+
+    int   GRID_SIZE    = 12;
+    int   NUM_POINTS   = 200;   // Per district outline.
+    float CELL_SIZE    = 100;
+
+    u32 seed = 12345;
+
+    for (int row = 0; row < GRID_SIZE; row++) {
+        for (int col = 0; col < GRID_SIZE; col++) {
+            Path ring = {.context = context};
+
+            float cx = (col + 0.5)*CELL_SIZE;
+            float cy = (row + 0.5)*CELL_SIZE;
+
+            // Go around a circle, wobbling the radius. The outer ring has to be counter-clockwise; see the Polygon typedef.
+            for (int i = 0; i < NUM_POINTS; i++) {
+                seed = seed*1664525 + 1013904223;
+                float wobble = 0.4 + 0.1*(seed >> 16)/65536.0;
+                float angle  = 2*PI*i/NUM_POINTS;
+
+                *Add(&ring) = (Vector2){{cx + wobble*CELL_SIZE*cosf(angle), cy + wobble*CELL_SIZE*sinf(angle)}};
+            }
+            Vector2 first = ring.data[0];
+            *Add(&ring) = first;
+
+            Polygon polygon = {.context = context};
+            *Add(&polygon) = ring;
+
+            Vector3 colour = colours[(row*7 + col*3) % countof(colours)];
+
+            draw_polygon(&polygon, colour, verts);
+            draw_path(&ring, 1.5, (Vector3){0.8, 0.8, 0.8}, verts);
+        }
+    }
+
+    u8_array *result = NewArray(result, context);
+    result->data  = (u8 *)verts->data;
+    result->count = verts->count*sizeof(Vertex);
+    result->limit = verts->limit*sizeof(Vertex);
+
+    return result;
+}
+
+static void run_bench(char *name, u8_array *body)
+{
+    double MBIT_PER_SEC = 10;
+    double ms_per_byte  = 8/(MBIT_PER_SEC*1000);
+
+    printf("%s: %ld bytes\n", name, body->count);
+    printf("%10s %6s %12s %8s %12s %12s\n", "encoding", "level", "bytes", "ratio", "compress ms", "net ms saved");
+
+    for (int encoding = 0; encoding < 2; encoding++) {
+        for (int level = 1; level <= 9; level++) {
+            Memory_context *ctx = new_context(NULL);
+
+            // Repeat small bodies so the timing means something.
+            int num_reps = Max(1, (int)(4000000/Max(body->count, 1)));
+            num_reps = Min(num_reps, 100);
+
+            u8_array *compressed = NULL;
+
+            double start = now_ms();
+            for (int i = 0; i < num_reps; i++) {
+                if (encoding == 0)  compressed = gzip_compress(body->data, body->count, level, ctx);
+                else                compressed = brotli_compress(body->data, body->count, level, ctx);
+            }
+            double ms = (now_ms() - start)/num_reps;
+
+            if (!compressed)  Fatal("Compression failed.");
+
+            double saved_ms = (body->count - compressed->count)*ms_per_byte - ms;
+
+            printf("%10s %6d %12ld %8.2f %12.2f %12.1f\n", encoding == 0 ? "gzip" : "br", level,
+                   compressed->count, (double)body->count/compressed->count, ms, saved_ms);
+
+            free_context(ctx);
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Memory_context *ctx = new_context(NULL);
+
+    if (argc < 2) {
+        run_bench("synthetic tile", draw_synthetic_tile(ctx));
+    }
+
+    for (int i = 1; i < argc; i++) {
+        u8_array *body = load_binary_file(argv[i], ctx);
+        if (!body)  Fatal("Couldn't read %s.", argv[i]);
+
+        run_bench(argv[i], body);
+    }
+
+    free_context(ctx);
+    return 0;
+}
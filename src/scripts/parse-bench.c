@@ -0,0 +1,132 @@
+//
+// A microbenchmark for the request parser in request.c. It parses a few kinds of request over and over, the way the
+// server does: find_request_end() as the bytes arrive, then parse_request(), then a lookup of the headers the server
+// always asks about. It reports the time per request and the throughput for each kind.
+//
+//      bin/scripts/parse-bench [options]
+//
+//      --iterations n  How many times to parse each request. (Default 1000000.)
+//      --pieces n      Pretend each request arrives in n pieces, calling find_request_end() after each. (Default 1.)
+//
+// The parser scans with SSE2 by default. To measure AVX2 instead, build with cflags += -mavx2 (or -march=native).
+//
+
+#include "../request.h"
+#include "../strings.h"
+#include "../system.h"
+
+typedef struct Sample Sample;
+
+struct Sample {
+    char                   *name;
+    char                   *text;
+};
+
+// A tile request from the map, as a desktop browser sends it.
+#define BROWSER_HEADERS \
+    "Host: votemap.example.com\r\n" \
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n" \
+    "Accept: */*\r\n" \
+    "Accept-Language: en-AU,en;q=0.5\r\n" \
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n" \
+    "Referer: https://votemap.example.com/\r\n" \
+    "Connection: keep-alive\r\n" \
+    "Sec-Fetch-Dest: empty\r\n" \
+    "Sec-Fetch-Mode: cors\r\n" \
+    "Sec-Fetch-Site: same-origin\r\n"
+
+Sample static SAMPLES[] = {
+    {"minimal", "GET / HTTP/1.1\r\nHost: x\r\n\r\n"},
+    {"tile", "GET /vertices/27966?upp=1024&x0=-1863361&y0=1168642&x1=2087981&y1=4840595 HTTP/1.1\r\n" BROWSER_HEADERS "\r\n"},
+    {"asset", "GET /fonts/Inter-Regular.woff2 HTTP/1.1\r\n" BROWSER_HEADERS "If-None-Match: \"5f2a-1b3c\"\r\n\r\n"},
+    {"encoded", "GET /search/%E2%80%9Cthe%20name%E2%80%9D?q=Bennelong%2C%20NSW&from=2016-07-02&to=2022-05-21 HTTP/1.1\r\n" BROWSER_HEADERS "\r\n"},
+    {"cookie", NULL}, // Filled in by main(), with an 8 KB cookie.
+};
+
+int main(int argc, char **argv)
+{
+    Memory_context *ctx = new_context(NULL);
+
+    s64 num_iterations = 1000000;
+    s64 num_pieces     = 1;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg  = argv[i];
+        bool  more = (i+1 < argc);
+
+        if (!strcmp(arg, "--iterations") && more)   num_iterations = atol(argv[++i]);
+        else if (!strcmp(arg, "--pieces") && more)  num_pieces     = atol(argv[++i]);
+        else  Fatal("Usage: %s [--iterations n] [--pieces n]", argv[0]);
+    }
+
+    if (num_iterations < 1 || num_pieces < 1)  Fatal("That doesn't make sense.");
+
+    {
+        char_array cookie = get_string(ctx, "GET /elections/27966/districts.json HTTP/1.1\r\n" BROWSER_HEADERS "Cookie: ");
+        for (int i = 0; cookie.count < 8*1024; i++)  append_string(&cookie, "session_%d=%08x; ", i, i*2654435761u);
+        append_string(&cookie, "\r\n\r\n");
+
+        SAMPLES[countof(SAMPLES)-1].text = cookie.data;
+    }
+
+#if defined(__AVX2__)
+    char *scanner = "AVX2";
+#elif defined(__SSE2__)
+    char *scanner = "SSE2";
+#else
+    char *scanner = "a byte at a time";
+#endif
+    printf("Scanning with %s, %ld iterations, %ld piece(s) per request.\n\n", scanner, num_iterations, num_pieces);
+    printf("%-10s %8s %8s %10s %10s\n", "request", "bytes", "headers", "ns/req", "MB/s");
+
+    Memory_context *request_context = new_context(ctx);
+
+    for (s64 i = 0; i < countof(SAMPLES); i++) {
+        Sample *sample = &SAMPLES[i];
+        s64     size   = strlen(sample->text);
+
+        s32 num_headers = 0;
+        s64 checksum    = 0; // So the compiler can't skip any of the work.
+
+        s64 start_time = get_monotonic_time_ns();
+
+        for (s64 j = 0; j < num_iterations; j++) {
+            Request request = {
+                .path         = {.context = request_context},
+                .query_params = {.context = request_context},
+            };
+
+            s64 request_size = 0;
+            for (s64 k = 1; k <= num_pieces; k++) {
+                request_size = find_request_end(&request, sample->text, size*k/num_pieces);
+            }
+            if (request_size != size)  Fatal("We couldn't find the end of the %s request.", sample->name);
+
+            int status = parse_request(&request, sample->text, request_size, request_context);
+            if (status)  Fatal("The %s request failed with %d: %s", sample->name, status, request.error);
+
+            // The server always asks about these.
+            Header *accept_encoding = get_header(&request, "accept-encoding", NULL);
+            Header *if_none_match   = get_header(&request, "if-none-match", NULL);
+
+            checksum   += request.path.count + request.query_params.count + request.keep_alive;
+            checksum   += (accept_encoding ? accept_encoding->value_size : 0) + (if_none_match != NULL);
+            num_headers = request.num_headers;
+
+            reset_context(request_context);
+        }
+
+        s64 elapsed = get_monotonic_time_ns() - start_time;
+
+        double ns_per_request = (double)elapsed/num_iterations;
+        double megabytes_per_second = (double)size*num_iterations/1e6/(elapsed/1e9);
+
+        printf("%-10s %8ld %8d %10.1f %10.1f\n", sample->name, size, num_headers, ns_per_request, megabytes_per_second);
+
+        if (checksum == 0)  Fatal("The checksum is suspicious.");
+    }
+
+    free_context(ctx);
+
+    return 0;
+}
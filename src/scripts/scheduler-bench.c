@@ -0,0 +1,172 @@
+// Measure how many tasks per second the scheduler can hand out with different numbers of worker threads.
+// For comparison, also measure a single queue protected by a mutex and a condition variable, which is how
+// the server used to hand tasks to workers.
+//
+//      bin/scripts/scheduler-bench [max_threads]
+//
+// For usleep() we need _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <unistd.h>
+
+#include "../scheduler.h"
+#include "../system.h"
+
+typedef struct Bench_task  Bench_task;
+typedef struct Bench       Bench;
+typedef struct Mutex_queue Mutex_queue;
+
+struct Bench_task {
+    enum {
+        DO_SOME_WORK=1,
+        STOP_WORKING,
+    }       type;
+    int     depth;      // If depth > 0, the worker pushes two more tasks with depth-1.
+};
+
+struct Mutex_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t  ready;
+
+    Array(Bench_task);
+    s64             head;
+};
+
+struct Bench {
+    Scheduler      *scheduler;      // If this is NULL, we're using the mutex queue.
+    Mutex_queue    *mutex_queue;
+
+    s64             num_done;
+};
+
+static void push_mutex_queue(Mutex_queue *q, Bench_task task)
+{
+    pthread_mutex_lock(&q->mutex);
+
+    bool queue_was_empty = (q->head == q->count);
+
+    if (q->count == q->limit && q->head > 0) {
+        memmove(q->data, &q->data[q->head], (q->count - q->head)*sizeof(q->data[0]));
+        q->count -= q->head;
+        q->head   = 0;
+    }
+    *Add(q) = task;
+
+    if (queue_was_empty)  pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+static Bench_task pop_mutex_queue(Mutex_queue *q)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->head == q->count)  pthread_cond_wait(&q->ready, &q->mutex);
+
+    Bench_task task = q->data[q->head];
+    q->head += 1;
+
+    pthread_mutex_unlock(&q->mutex);
+    return task;
+}
+
+static void push_bench_task(Bench *bench, Bench_task task)
+{
+    if (bench->scheduler)  push_task(bench->scheduler, task);
+    else                   push_mutex_queue(bench->mutex_queue, task);
+}
+
+static void *bench_worker(void *arg)
+{
+    Bench *bench = arg;
+
+    if (bench->scheduler)  attach_to_scheduler(bench->scheduler, true);
+
+    while (true) {
+        Bench_task task;
+        if (bench->scheduler)  pop_task(bench->scheduler, &task);
+        else                   task = pop_mutex_queue(bench->mutex_queue);
+
+        if (task.type == STOP_WORKING)  break;
+
+        if (task.depth > 0) {
+            push_bench_task(bench, (Bench_task){DO_SOME_WORK, task.depth-1});
+            push_bench_task(bench, (Bench_task){DO_SOME_WORK, task.depth-1});
+        }
+
+        // Pretend to do a tiny bit of work.
+        u64 x = task.depth;
+        for (int i = 0; i < 50; i++)  x = x*6364136223846793005 + 1442695040888963407;
+        if (x == 0)  printf(".");
+
+        __atomic_fetch_add(&bench->num_done, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static double run_bench(int num_threads, bool use_scheduler, int num_roots, int depth)
+// Return the number of tasks per second.
+{
+    Memory_context *ctx = new_context(NULL);
+
+    Bench bench = {0};
+    if (use_scheduler) {
+        bench.scheduler = create_scheduler(num_threads, sizeof(Bench_task), ctx);
+    } else {
+        bench.mutex_queue = New(Mutex_queue, ctx);
+        bench.mutex_queue->context = ctx;
+        pthread_mutex_init(&bench.mutex_queue->mutex, NULL);
+        pthread_cond_init(&bench.mutex_queue->ready, NULL);
+    }
+
+    pthread_t *threads = New(num_threads, pthread_t, ctx);
+    for (int i = 0; i < num_threads; i++) {
+        int r = pthread_create(&threads[i], NULL, bench_worker, &bench);
+        if (r)  Fatal("Thread creation failed (%s).", get_error_info(r).string);
+    }
+
+    s64 num_tasks = (s64)num_roots * ((2LL << depth) - 1);
+
+    // Like the server's main thread, take the scheduler's extra deque for the tasks we push.
+    if (use_scheduler)  attach_to_scheduler(bench.scheduler, false);
+
+    s64 start_time = get_monotonic_time();
+
+    for (int i = 0; i < num_roots; i++)  push_bench_task(&bench, (Bench_task){DO_SOME_WORK, depth});
+
+    while (__atomic_load_n(&bench.num_done, __ATOMIC_RELAXED) < num_tasks)  usleep(100);
+
+    s64 end_time = get_monotonic_time();
+
+    // The deque is empty now, so we can let go of it. The stop tasks go onto the shared queue.
+    if (use_scheduler)  detach_from_scheduler(bench.scheduler);
+
+    for (int i = 0; i < num_threads; i++)  push_bench_task(&bench, (Bench_task){STOP_WORKING});
+    for (int i = 0; i < num_threads; i++)  pthread_join(threads[i], NULL);
+
+    free_context(ctx);
+
+    s64 ms = Max(end_time - start_time, 1);
+    return 1000.0*num_tasks/ms;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 64;
+    if (argc > 1)  max_threads = atoi(argv[1]);
+
+    // "Fed" means the main thread pushes every task. "Fan-out" means each task pushes two more, so most tasks
+    // are pushed by workers.
+    printf("%8s %18s %18s %18s %18s\n", "threads", "mutex fed", "scheduler fed", "mutex fan-out", "scheduler fan-out");
+
+    for (int num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        double mutex_fed      = run_bench(num_threads, false, 200000, 0);
+        double scheduler_fed  = run_bench(num_threads, true,  200000, 0);
+        double mutex_fanout   = run_bench(num_threads, false, 64, 12);
+        double scheduler_fanout = run_bench(num_threads, true, 64, 12);
+
+        printf("%8d %18.0f %18.0f %18.0f %18.0f\n", num_threads, mutex_fed, scheduler_fed, mutex_fanout, scheduler_fanout);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+// Check that /debug/trace.json?sample_every=n changes how many requests a running server traces.
+//
+//      bin/votemap 6008 &
+//      bin/scripts/trace-sampling-test 6008
+//
+// We turn tracing on for every request, make a few requests and check they were traced. Then we turn tracing off,
+// make a few more and check they weren't. We also check that a bad rate gets a 400. Tracing is off when we finish.
+// The route is .local_only, so run this on the same machine as the server.
+#define _DEFAULT_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../strings.h"
+#include "../system.h"
+
+static int port;
+
+static int get(char *target, char_array *body)
+// Send a GET request to the server and wait for the whole response. Put the body in body and return the status.
+{
+    s32 socket_no = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_no < 0)  Fatal("We couldn't make a socket (%s).", get_last_error().string);
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+        .sin_addr   = {htonl(INADDR_LOOPBACK)},
+    };
+    int r = connect(socket_no, (struct sockaddr *)&address, sizeof(address));
+    if (r < 0)  Fatal("We couldn't connect to port %d (%s).", port, get_last_error().string);
+
+    char_array request = get_string(body->context, "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", target);
+
+    s64 num_sent = 0;
+    while (num_sent < request.count) {
+        s64 n = send(socket_no, request.data + num_sent, request.count - num_sent, MSG_NOSIGNAL);
+        if (n < 0)  Fatal("We couldn't send a request (%s).", get_last_error().string);
+        num_sent += n;
+    }
+
+    // The server closes the connection after the response, so read until it does.
+    char_array response = {.context = body->context};
+    array_reserve(&response, 64*1024);
+    while (true) {
+        if (response.limit - response.count < 4096)  array_reserve(&response, 2*response.limit);
+
+        s64 n = recv(socket_no, response.data + response.count, response.limit - response.count - 1, 0);
+        if (n < 0)  Fatal("We couldn't receive a response (%s).", get_last_error().string);
+        if (n == 0)  break;
+        response.count += n;
+    }
+    response.data[response.count] = '\0';
+    close(socket_no);
+
+    int status = 0;
+    if (sscanf(response.data, "HTTP/1.1 %d", &status) != 1)  Fatal("We got a strange response to %s.", target);
+
+    // The trace route's body isn't chunked, so it's everything after the header.
+    char *end_of_header = strstr(response.data, "\r\n\r\n");
+    if (!end_of_header)  Fatal("The response to %s has no end to its header.", target);
+
+    body->count = 0;
+    append_string(body, "%s", end_of_header + 4);
+
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)  Fatal("Usage: %s port", argv[0]);
+    port = atoi(argv[1]);
+
+    Memory_context *ctx = new_context(NULL);
+
+    char_array body = {.context = ctx};
+    int num_failures = 0;
+
+    // Each run uses its own paths, so we don't count traces left over from an earlier run.
+    int run = getpid();
+
+    int status = get("/debug/trace.json?sample_every=1", &body);
+    if (status != 200)  Fatal("We couldn't turn tracing on (status %d). Is the server on this machine?", status);
+
+    for (int i = 0; i < 3; i++)  get(get_string(ctx, "/trace-sampling-test/%d/on/%d", run, i).data, &body);
+
+    get("/debug/trace.json?sample_every=0", &body);
+
+    for (int i = 0; i < 3; i++) {
+        char *name = get_string(ctx, "\"GET /trace-sampling-test/%d/on/%d\"", run, i).data;
+        if (!strstr(body.data, name)) {
+            printf("FAIL: With sample_every=1, we didn't trace request %d.\n", i);
+            num_failures += 1;
+        }
+    }
+
+    for (int i = 0; i < 3; i++)  get(get_string(ctx, "/trace-sampling-test/%d/off/%d", run, i).data, &body);
+
+    get("/debug/trace.json", &body);
+
+    if (strstr(body.data, get_string(ctx, "/trace-sampling-test/%d/off/", run).data)) {
+        printf("FAIL: With sample_every=0, we still traced requests.\n");
+        num_failures += 1;
+    }
+
+    char *bad_rates[] = {"-1", "x", "", "99999999999"};
+    for (int i = 0; i < countof(bad_rates); i++) {
+        status = get(get_string(ctx, "/debug/trace.json?sample_every=%s", bad_rates[i]).data, &body);
+        if (status != 400) {
+            printf("FAIL: sample_every=%s got a %d, not a 400.\n", bad_rates[i], status);
+            num_failures += 1;
+        }
+    }
+
+    if (num_failures)  return 1;
+
+    printf("OK\n");
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "shapes.h"
+#include "trace.h"
 
 bool same_point(Vector2 p, Vector2 q)
 {
@@ -75,6 +76,8 @@ Triangle_array *triangulate_polygon(Polygon *polygon, Memory_context *context)
     assert(is_polygon(polygon));
     Memory_context *ctx = context;
 
+    s64 span = BeginSpan();
+
     Triangle_array *triangles = NewArray(triangles, ctx);
 
     // |Todo: If the polygon has holes, turn it into one big ring.
@@ -163,6 +166,8 @@ Triangle_array *triangulate_polygon(Polygon *polygon, Memory_context *context)
         break;
     }
 
+    EndSpan("triangulate_polygon", span);
+
     return triangles;
 }
 
@@ -189,6 +194,8 @@ void parse_wkb_polygons(u8 *data, Polygon_array *result, u8 **end_data)
     Memory_context *ctx = result->context;
     u8 *d = data;
 
+    s64 span = BeginSpan();
+
     s64 num_geometries = 1;
 
     while (num_geometries > 0) {
@@ -259,6 +266,8 @@ void parse_wkb_polygons(u8 *data, Polygon_array *result, u8 **end_data)
     }
 
     if (end_data)  *end_data = d;
+
+    EndSpan("parse_wkb_polygons", span);
 }
 
 void parse_wkb_paths(u8 *data, Path_array *result, u8 **end_data)
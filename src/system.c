@@ -1,11 +1,13 @@
 // For clock_gettime() we need _POSIX_C_SOURCE >= 199309L.
 // For strerror_r()    we need _POSIX_C_SOURCE >= 200112L.
-#define _POSIX_C_SOURCE 200112L
+// For stat.st_mtim     we need _POSIX_C_SOURCE >= 200809L.
+#define _POSIX_C_SOURCE 200809L
 
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "strings.h"
 #include "system.h"
@@ -65,12 +67,19 @@ u8_array *load_binary_file(char *file_name, Memory_context *context)
         return NULL;
     }
 
+    // If we know how big the file is, read it with one call. Otherwise (say it's a pipe) read it in growing blocks.
+    struct stat info;
+    bool know_size = !fstat(fileno(file), &info) && info.st_size > 0;
+
+    array_reserve(buffer, know_size ? info.st_size+1 : 4096);
+
     while (true) {
-        int c = fgetc(file);
-        if (c == EOF)  break;
+        if (buffer->count == buffer->limit)  array_reserve(buffer, 2*buffer->limit);
 
-        // |Memory: This doubles the buffer when needed.
-        *Add(buffer) = (u8)c;
+        u64 num_read = fread(&buffer->data[buffer->count], 1, buffer->limit - buffer->count, file);
+        if (!num_read)  break; // The end of the file, or an error.
+
+        buffer->count += num_read;
     }
 
     fclose(file);
@@ -107,6 +116,30 @@ s64 get_monotonic_time()
     return milliseconds;
 }
 
+s64 get_monotonic_time_us()
+// In microseconds, for timing things that take less than a millisecond.
+{
+    struct timespec time;
+    bool ok = !clock_gettime(CLOCK_MONOTONIC, &time);
+    if (!ok) {
+        Fatal("clock_gettime failed (%s).", get_last_error().string);
+    }
+
+    return 1000000*time.tv_sec + time.tv_nsec/1000;
+}
+
+s64 get_monotonic_time_ns()
+// In nanoseconds, for tracing. See trace.h.
+{
+    struct timespec time;
+    bool ok = !clock_gettime(CLOCK_MONOTONIC, &time);
+    if (!ok) {
+        Fatal("clock_gettime failed (%s).", get_last_error().string);
+    }
+
+    return 1000000000*time.tv_sec + time.tv_nsec;
+}
+
 void set_blocking(int file_no, bool blocking)
 // file_no is an open file descriptor.
 {
@@ -166,10 +199,6 @@ static void fill_out_file_node(File_node *file_node, Memory_context *context)
         Fatal("Couldn't stat file %s: %s", file_node->path.data, get_last_error().string);
     }
 
-    int S_IFMT  = 0170000; //|Cleanup: #include these octal constants. Feature test macros?
-    int S_IFDIR = 0040000;
-    int S_IFREG = 0100000;
-
     bool is_regular_file = (file_info.st_mode & S_IFMT) == S_IFREG;
     bool is_directory    = (file_info.st_mode & S_IFMT) == S_IFDIR;
 
@@ -177,6 +206,10 @@ static void fill_out_file_node(File_node *file_node, Memory_context *context)
     else if (is_directory)  file_node->type = DIRECTORY;
     else                    file_node->type = UNKNOWN_FILE_TYPE;
 
+    file_node->size   = file_info.st_size;
+    file_node->modified_time = (s64)file_info.st_mtim.tv_sec*1000000000 + file_info.st_mtim.tv_nsec;
+    file_node->handle = -1; // get_file_handle() opens files on demand.
+
     if (!is_directory)  return;
 
     // This is conservative. We'll only read directories if anyone can read them.
@@ -281,3 +314,41 @@ File_node *find_file_node(char *path, File_node *root)
 
     return node;
 }
+
+s32 get_file_handle(File_node *node)
+// Return a read-only file descriptor for a regular file in a file tree. The first time we're asked, open the file;
+// after that, return the same descriptor. It stays open until someone calls close_file_handles() on the tree.
+// Return -1 if we couldn't open the file. This is safe to call from multiple threads at once.
+{
+    assert(node->type == REGULAR_FILE);
+
+    s32 handle = __atomic_load_n(&node->handle, __ATOMIC_ACQUIRE);
+    if (handle >= 0)  return handle;
+
+    handle = open(node->path.data, O_RDONLY);
+    if (handle < 0)  return -1;
+
+    s32 expected = -1;
+    bool we_were_first = __atomic_compare_exchange_n(&node->handle, &expected, handle, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (!we_were_first) {
+        // Another thread opened the file at the same time. Use theirs.
+        close(handle);
+        handle = expected;
+    }
+
+    return handle;
+}
+
+void close_file_handles(File_node *root)
+// Close any file descriptors opened by get_file_handle() on the tree. No other thread should be using the tree.
+{
+    if (root->type == REGULAR_FILE && root->handle >= 0) {
+        int r = close(root->handle);
+        if (r == -1) {
+            Fatal("Couldn't close file %s: %s", root->path.data, get_last_error().string);
+        }
+        root->handle = -1;
+    }
+
+    for (s64 i = 0; i < root->children.count; i++)  close_file_handles(&root->children.data[i]);
+}
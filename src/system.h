@@ -23,6 +23,12 @@ struct File_node {
         DIRECTORY,
     }               type;
     File_node_array children;
+
+    // For regular files:
+    s64             size;       // The size of the file in bytes when we read the tree.
+    s64             modified_time; // The file's mtime in nanoseconds since the epoch.
+    s32             handle;     // An open file descriptor, once someone has called get_file_handle(). Otherwise -1.
+    void           *user_data;  // We don't touch this. Whoever owns the tree can use it to attach things to files.
 };
 
 System_error get_error_info(int code);
@@ -31,10 +37,14 @@ char_array *load_text_file(char *file_name, Memory_context *context);
 u8_array *load_binary_file(char *file_name, Memory_context *context);
 void write_array_to_file_(void *data, u64 unit_size, s64 count, char *file_name);
 s64 get_monotonic_time();
+s64 get_monotonic_time_us();
+s64 get_monotonic_time_ns();
 void set_blocking(int file_no, bool blocking);
 File_node *get_file_tree(char *path, Memory_context *context);
 void print_file_tree(char_array *out, File_node *node, int depth);
 File_node *find_file_node(char *path, File_node *root);
+s32 get_file_handle(File_node *node);
+void close_file_handles(File_node *root);
 
 #define write_array_to_file(ARRAY, FILE_NAME)  \
     write_array_to_file_((ARRAY)->data, sizeof((ARRAY)->data[0]), (ARRAY)->count, (FILE_NAME))
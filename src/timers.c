@@ -0,0 +1,142 @@
+#include "timers.h"
+
+#define SLOT_MASK  (TIMER_LEVEL_SIZE - 1)
+
+void init_timer_wheel(Timer_wheel *wheel, s64 current_time)
+{
+    *wheel = (Timer_wheel){0};
+
+    wheel->next_tick = current_time/TIMER_TICK + 1;
+
+    for (int level = 0; level < TIMER_NUM_LEVELS; level++) {
+        for (int i = 0; i < TIMER_LEVEL_SIZE; i++) {
+            Timer *head = &wheel->slots[level][i];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+}
+
+static void link_timer(Timer_wheel *wheel, Timer *timer)
+// Put a timer in the slot for its deadline. Which level it goes in depends on how far its deadline is from the
+// wheel's next tick, so the slot always comes round (to fire or cascade) before the deadline.
+{
+    s64 tick = (timer->deadline + TIMER_TICK-1)/TIMER_TICK; // Round up, so we never fire early.
+    if (tick < wheel->next_tick)  tick = wheel->next_tick;
+
+    s64 delta = tick - wheel->next_tick;
+
+    int level = 0;
+    while (level < TIMER_NUM_LEVELS-1 && delta >= (s64)1 << (TIMER_LEVEL_BITS*(level+1)))  level += 1;
+
+    // If the deadline is beyond the top level, the slot comes round early and we cascade the timer back into the top
+    // level. That's fine, because it'll be a long time before it happens again.
+    Timer *head = &wheel->slots[level][(tick >> (TIMER_LEVEL_BITS*level)) & SLOT_MASK];
+
+    timer->next       = head->next;
+    timer->prev       = head;
+    head->next->prev  = timer;
+    head->next        = timer;
+}
+
+static void unlink_timer(Timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void set_timer(Timer_wheel *wheel, Timer *timer, s64 deadline)
+// Set a timer to fire at a deadline. If it's already set, move it.
+{
+    cancel_timer(wheel, timer);
+
+    timer->deadline = deadline;
+    link_timer(wheel, timer);
+
+    wheel->count += 1;
+}
+
+void cancel_timer(Timer_wheel *wheel, Timer *timer)
+// It's fine to cancel a timer that isn't set.
+{
+    if (!timer->prev)  return;
+
+    unlink_timer(timer);
+
+    wheel->count -= 1;
+}
+
+Timer *expire_timers(Timer_wheel *wheel, s64 current_time)
+// Take every timer whose deadline has passed out of the wheel, and return them as a linked list (via timer.next).
+{
+    s64 current_tick = current_time/TIMER_TICK;
+
+    if (!wheel->count) {
+        // Nothing can be due, so skip straight to now.
+        wheel->next_tick = Max(wheel->next_tick, current_tick+1);
+        return NULL;
+    }
+
+    Timer *expired = NULL;
+
+    while (wheel->next_tick <= current_tick) {
+        s64 tick = wheel->next_tick;
+
+        // At the start of each block, spread out the timers in the next higher-level slot over the levels below.
+        for (int level = TIMER_NUM_LEVELS-1; level > 0; level--) {
+            int shift = TIMER_LEVEL_BITS*level;
+            if (tick & (((s64)1 << shift) - 1))  continue;
+
+            Timer *head  = &wheel->slots[level][(tick >> shift) & SLOT_MASK];
+            Timer *timer = head->next;
+
+            head->next = head;
+            head->prev = head;
+
+            while (timer != head) {
+                Timer *next = timer->next;
+                link_timer(wheel, timer);
+                timer = next;
+            }
+        }
+
+        // Everything in this tick's level-0 slot is due.
+        Timer *head = &wheel->slots[0][tick & SLOT_MASK];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            unlink_timer(timer);
+            wheel->count -= 1;
+
+            timer->next = expired;
+            expired     = timer;
+        }
+
+        wheel->next_tick += 1;
+    }
+
+    return expired;
+}
+
+int get_timer_timeout(Timer_wheel *wheel, s64 current_time)
+// How many milliseconds we can wait before we have to call expire_timers() again. Return -1 if no timers are set,
+// which is what epoll_wait() takes to mean wait indefinitely.
+{
+    if (!wheel->count)  return -1;
+
+    // Find the next tick with a timer in level 0, or the start of the next block, when we might have to cascade
+    // timers down from a higher level. We look at 64 slots at most.
+    s64 tick = wheel->next_tick;
+    while (true) {
+        Timer *head = &wheel->slots[0][tick & SLOT_MASK];
+        if (head->next != head)      break;
+        if ((tick & SLOT_MASK) == 0)  break;
+        tick += 1;
+    }
+
+    s64 timeout = tick*TIMER_TICK - current_time;
+
+    return (int)Max(timeout, 0);
+}
@@ -0,0 +1,60 @@
+#ifndef TIMERS_H_INCLUDED
+#define TIMERS_H_INCLUDED
+
+#include "basic.h"
+
+//
+// A Timer_wheel keeps track of deadlines so that finding the ones that have passed costs time in proportion to how
+// many have passed, not how many there are. Setting and cancelling a timer is O(1).
+//
+// It's a hierarchical wheel: level 0 has a slot for each of the next 64 ticks, level 1 has a slot for each of the
+// next 64 blocks of 64 ticks, and so on. Whenever the wheel turns past the end of a block, the timers in the next
+// higher-level slot are spread out over the level below. A timer fires on the first tick at or after its deadline, so
+// never early and at most TIMER_TICK milliseconds late.
+//
+// Timers are intrusive: embed a Timer in whatever it's the deadline for, and set .data to point back to that.
+//
+//      Timer_wheel wheel;
+//      init_timer_wheel(&wheel, get_monotonic_time());
+//
+//      client->timer.data = client;
+//      set_timer(&wheel, &client->timer, current_time + 15000);
+//
+//      Timer *expired = expire_timers(&wheel, get_monotonic_time());
+//      while (expired) {
+//          Timer *next = expired->next;
+//          close_client(expired->data);
+//          expired = next;
+//      }
+//
+// A wheel isn't threadsafe. The thread that owns it should be the only one that touches it and its timers.
+//
+typedef struct Timer       Timer;
+typedef struct Timer_wheel Timer_wheel;
+
+#define TIMER_TICK          100     // Milliseconds.
+#define TIMER_LEVEL_BITS    6
+#define TIMER_LEVEL_SIZE    (1 << TIMER_LEVEL_BITS)
+#define TIMER_NUM_LEVELS    4       // With 100ms ticks, the wheel covers about 19 days.
+
+struct Timer {
+    Timer  *next;           // The other timers in the same slot. After expire_timers(), the other expired timers.
+    Timer  *prev;           // NULL if the timer isn't set.
+    s64     deadline;       // In milliseconds, like get_monotonic_time().
+    void   *data;           // For the caller. The wheel doesn't touch it.
+};
+
+struct Timer_wheel {
+    s64     next_tick;      // We've fired every timer due before this tick.
+    s64     count;          // The number of timers that are set.
+
+    Timer   slots[TIMER_NUM_LEVELS][TIMER_LEVEL_SIZE]; // Each slot is the head of a circular list of timers.
+};
+
+void init_timer_wheel(Timer_wheel *wheel, s64 current_time);
+void set_timer(Timer_wheel *wheel, Timer *timer, s64 deadline);
+void cancel_timer(Timer_wheel *wheel, Timer *timer);
+Timer *expire_timers(Timer_wheel *wheel, s64 current_time);
+int get_timer_timeout(Timer_wheel *wheel, s64 current_time);
+
+#endif // TIMERS_H_INCLUDED
@@ -0,0 +1,185 @@
+#include <unistd.h>
+
+#include "strings.h"
+#include "trace.h"
+
+__thread Trace *current_trace = NULL;
+
+static s32          num_threads   = 0;
+static __thread s32 thread_number = 0; // 0 until the thread records its first span.
+
+Tracer *create_tracer(Memory_context *context)
+{
+    Tracer *tracer = New(Tracer, context);
+
+    tracer->context = context;
+    tracer->file_no = -1;
+
+    pthread_mutex_init(&tracer->mutex, NULL);
+
+    return tracer;
+}
+
+void set_trace_sampling(Tracer *tracer, s32 sample_every)
+// Trace one request in sample_every, or none if it's 0. Safe to call while other threads are tracing.
+{
+    assert(sample_every >= 0);
+    __atomic_store_n(&tracer->sample_every, sample_every, __ATOMIC_RELAXED);
+}
+
+Trace *maybe_start_trace(Tracer *tracer)
+// Decide whether to trace the request that's about to start. If so, return a new trace. Otherwise return NULL.
+{
+    s32 sample_every = __atomic_load_n(&tracer->sample_every, __ATOMIC_RELAXED);
+    if (!sample_every)  return NULL;
+
+    s64 n = __atomic_fetch_add(&tracer->num_requests, 1, __ATOMIC_RELAXED);
+    if (n % sample_every)  return NULL;
+
+    Memory_context *context = new_context(NULL);
+
+    Trace *trace = New(Trace, context);
+
+    trace->context = context;
+    trace->tracer  = tracer;
+    trace->id      = n+1;
+    trace->start   = get_monotonic_time_ns();
+    trace->events  = (Trace_event_array){.context = context};
+
+    return trace;
+}
+
+void add_span(char *name, s64 start)
+// Add a span from start until now to the current trace. Usually you want EndSpan() instead.
+{
+    Trace *trace = current_trace;
+    if (!trace)  return;
+
+    if (!thread_number)  thread_number = __atomic_add_fetch(&num_threads, 1, __ATOMIC_RELAXED);
+
+    s64 end = get_monotonic_time_ns();
+
+    *Add(&trace->events) = (Trace_event){name, start, end - start, thread_number};
+}
+
+static void append_json_string(char_array *out, char *string)
+// Append a string as a quoted JSON string.
+{
+    append_string(out, "\"");
+    for (char *c = string; *c; c++) {
+        if (*c == '"' || *c == '\\')  append_string(out, "\\%c", *c);
+        else if ((u8)*c < 0x20)       append_string(out, "\\u%04x", (u8)*c);
+        else                          append_string(out, "%c", *c);
+    }
+    append_string(out, "\"");
+}
+
+static void append_trace_events(Trace *trace, char_array *out)
+// Append a trace's events in the Chrome trace-event format, each followed by a comma and a newline. The viewer wants
+// timestamps in microseconds, but it takes fractions, so we keep the nanoseconds.
+{
+    // Name the "process", so the viewer labels the trace with its request.
+    append_string(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,\"args\":{\"name\":", trace->id);
+    append_json_string(out, trace->name);
+    append_string(out, "}},\n");
+
+    // A span for the whole request, on a track of its own.
+    append_string(out, "{\"name\":");
+    append_json_string(out, trace->name);
+    append_string(out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":0},\n",
+                  trace->start/1000.0, trace->duration/1000.0, trace->id);
+
+    for (s64 i = 0; i < trace->events.count; i++) {
+        Trace_event *event = &trace->events.data[i];
+
+        append_string(out, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%d},\n",
+                      event->name, event->start/1000.0, event->duration/1000.0, trace->id, event->thread);
+    }
+}
+
+static void write_trace_to_file(Tracer *tracer, Trace *trace)
+// Append a trace to the tracer's file in the JSON array format. We never write the closing bracket, because the
+// viewers don't need it, so the file is always ready to load. Call this with the tracer's mutex held.
+{
+    char_array out = {.context = trace->context};
+    array_reserve(&out, 4096);
+
+    if (!tracer->started_file) {
+        // If we're appending to a file that already has traces, it already has the bracket.
+        bool at_start = (lseek(tracer->file_no, 0, SEEK_END) <= 0);
+        if (at_start)  append_string(&out, "[\n");
+        tracer->started_file = true;
+    }
+
+    append_trace_events(trace, &out);
+
+    char *data = out.data;
+    s64   size = out.count;
+
+    while (size > 0) {
+        s64 num_written = write(tracer->file_no, data, size);
+        if (num_written < 0) {
+            if (errno == EINTR)  continue;
+
+            log_error("We couldn't write to the trace file (%s).", get_last_error().string);
+            return;
+        }
+        data += num_written;
+        size -= num_written;
+    }
+}
+
+void finish_trace(Trace *trace, char *name)
+// End a trace and hand it over to its tracer, which keeps it until newer traces push it out. The name is copied.
+{
+    Tracer *tracer = trace->tracer;
+
+    trace->name     = get_string(trace->context, "%s", name).data;
+    trace->duration = get_monotonic_time_ns() - trace->start;
+
+    if (current_trace == trace)  current_trace = NULL;
+
+    pthread_mutex_lock(&tracer->mutex);
+    {
+        if (tracer->file_no >= 0)  write_trace_to_file(tracer, trace);
+
+        Trace **slot = &tracer->kept[tracer->num_kept % TRACER_MAX_KEPT];
+        if (*slot)  free_context((*slot)->context);
+
+        *slot = trace;
+        tracer->num_kept += 1;
+    }
+    pthread_mutex_unlock(&tracer->mutex);
+}
+
+void discard_trace(Trace *trace)
+// Throw away a trace we don't want, e.g. because the client went away part way through the request.
+{
+    if (current_trace == trace)  current_trace = NULL;
+
+    free_context(trace->context);
+}
+
+void write_chrome_trace(Tracer *tracer, char_array *out)
+// Append the traces we've kept to out as a Chrome trace-event JSON object, oldest first.
+{
+    append_string(out, "{\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&tracer->mutex);
+    {
+        s64 first = Max(0, tracer->num_kept - TRACER_MAX_KEPT);
+
+        for (s64 i = first; i < tracer->num_kept; i++) {
+            append_trace_events(tracer->kept[i % TRACER_MAX_KEPT], out);
+        }
+    }
+    pthread_mutex_unlock(&tracer->mutex);
+
+    // Every event ends with a comma, but JSON doesn't allow one after the last.
+    if (out->data[out->count-2] == ',') {
+        out->count -= 2;
+        out->data[out->count] = '\0';
+    }
+
+    append_string(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+}
@@ -0,0 +1,85 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <pthread.h>
+
+#include "array.h"
+#include "system.h"
+
+//
+// A Tracer takes a sample of requests and records a Trace of each one: a list of timed spans, with nanosecond
+// timestamps, covering whatever we want to look at. It keeps the last TRACER_MAX_KEPT traces, and can write them
+// out in the Chrome trace-event format for chrome://tracing or ui.perfetto.dev.
+//
+//      Tracer *tracer = create_tracer(context);
+//      set_trace_sampling(tracer, 100); // Trace one request in a hundred. 0 turns tracing off.
+//
+//      Trace *trace = maybe_start_trace(tracer); // NULL unless we're tracing this request.
+//      current_trace = trace;
+//
+//      s64 span = BeginSpan();
+//      do_some_work();
+//      EndSpan("do_some_work", span);
+//
+//      finish_trace(trace, "GET /some/path"); // Hand it to the tracer, or use discard_trace() if it's not wanted.
+//      current_trace = NULL;
+//
+// Spans go into the current thread's current_trace, so code anywhere can add them without being handed a trace.
+// When current_trace is NULL, BeginSpan() and EndSpan() cost a thread-local load and a branch, so it's fine to leave
+// them in hot code. Spans can nest. Only one thread at a time may add to a trace.
+//
+typedef struct Trace       Trace;
+typedef struct Trace_event Trace_event;
+typedef Array(Trace_event) Trace_event_array;
+typedef struct Tracer      Tracer;
+
+#define TRACER_MAX_KEPT     64      // Finished traces we hold on to. When there are more, we drop the oldest.
+
+struct Trace_event {
+    char                   *name;           // Not copied, so it should be a string literal.
+    s64                     start;          // In nanoseconds, from get_monotonic_time_ns().
+    s64                     duration;       // In nanoseconds.
+    s32                     thread;         // A small number for the thread that recorded the span.
+};
+
+struct Trace {
+    Memory_context         *context;        // The trace's own context, so it can outlive the request. Contains the struct itself.
+    Tracer                 *tracer;
+    s64                     id;             // A sequence number. Each trace shows up as its own process in the viewer.
+    char                   *name;           // Set by finish_trace().
+    s64                     start;          // In nanoseconds.
+    s64                     duration;       // In nanoseconds. Set by finish_trace().
+    Trace_event_array       events;
+};
+
+struct Tracer {
+    Memory_context         *context;
+
+    s32                     sample_every;   // Trace one request in this many. 0 means tracing is off. Change it with set_trace_sampling() at any time.
+    s64                     num_requests;   // How many requests maybe_start_trace() has been asked about while tracing was on.
+    s32                     file_no;        // If this is a file descriptor, finish_trace() also appends each trace to it. -1 by default.
+
+    pthread_mutex_t         mutex;          // Protects the fields below.
+    Trace                  *kept[TRACER_MAX_KEPT]; // The last traces we finished, in a ring. The newest is at (num_kept-1) % TRACER_MAX_KEPT.
+    s64                     num_kept;       // How many traces we've ever finished.
+    bool                    started_file;   // Whether we've written the opening bracket to .file_no.
+};
+
+// The trace that spans on this thread go into. NULL when we're not tracing.
+extern __thread Trace *current_trace;
+
+// Start a span. Returns 0 if we're not tracing.
+#define BeginSpan()             (current_trace ? get_monotonic_time_ns() : 0)
+
+// End a span started by BeginSpan(). NAME should be a string literal.
+#define EndSpan(NAME, START)    do { if (START)  add_span((NAME), (START)); } while (0)
+
+Tracer *create_tracer(Memory_context *context);
+void set_trace_sampling(Tracer *tracer, s32 sample_every);
+Trace *maybe_start_trace(Tracer *tracer);
+void add_span(char *name, s64 start);
+void finish_trace(Trace *trace, char *name);
+void discard_trace(Trace *trace);
+void write_chrome_trace(Tracer *tracer, char_array *out);
+
+#endif // TRACE_H_INCLUDED
@@ -0,0 +1,284 @@
+// For syscall() and MAP_POPULATE we need _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "system.h"
+#include "uring.h"
+
+bool init_uring(Uring *ring, u32 num_entries)
+// Set up a ring with room for num_entries submissions. Return false if we can't, because the kernel is too old for the
+// features we use (5.19) or io_uring has been turned off (kernel.io_uring_disabled).
+{
+    *ring = (Uring){.file_no = -1};
+
+    // We're the only thread that will touch the ring, so tell the kernel. With DEFER_TASKRUN, it finishes requests when
+    // we ask for completions, rather than interrupting us whenever it likes. Kernels before 6.1 don't know these flags.
+    struct io_uring_params params = {.flags = IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN};
+
+    s32 file_no = syscall(__NR_io_uring_setup, num_entries, &params);
+    if (file_no < 0 && errno == EINVAL) {
+        params  = (struct io_uring_params){0};
+        file_no = syscall(__NR_io_uring_setup, num_entries, &params);
+    }
+    if (file_no < 0)  return false;
+
+    // We need the queues in one mapping (5.4) and timeouts when we wait (5.11).
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(file_no);
+        return false;
+    }
+
+    u64 sq_size   = params.sq_off.array + params.sq_entries*sizeof(u32);
+    u64 cq_size   = params.cq_off.cqes  + params.cq_entries*sizeof(struct io_uring_cqe);
+    u64 ring_size = Max(sq_size, cq_size);
+
+    u8 *memory = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, file_no, IORING_OFF_SQ_RING);
+    if (memory == MAP_FAILED) {
+        close(file_no);
+        return false;
+    }
+
+    u64 sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    struct io_uring_sqe *sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, file_no, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        munmap(memory, ring_size);
+        close(file_no);
+        return false;
+    }
+
+    ring->file_no          = file_no;
+    ring->ring_memory      = memory;
+    ring->ring_memory_size = ring_size;
+
+    ring->sq_head       = (u32 *)(memory + params.sq_off.head);
+    ring->sq_tail       = (u32 *)(memory + params.sq_off.tail);
+    ring->sq_mask       = *(u32 *)(memory + params.sq_off.ring_mask);
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->sqes          = sqes;
+    ring->num_sqes      = params.sq_entries;
+
+    ring->cq_head = (u32 *)(memory + params.cq_off.head);
+    ring->cq_tail = (u32 *)(memory + params.cq_off.tail);
+    ring->cq_mask = *(u32 *)(memory + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(memory + params.cq_off.cqes);
+
+    // The SQ is a ring of indices into .sqes. We always use them in order, so each slot can point at its own entry.
+    u32 *sq_array = (u32 *)(memory + params.sq_off.array);
+    for (u32 i = 0; i < params.sq_entries; i++)  sq_array[i] = i;
+
+    return true;
+}
+
+bool is_uring_supported()
+// Check that we can set up a ring and lend it buffers, without keeping either.
+{
+    Uring         ring;
+    Uring_buffers buffers;
+
+    if (!init_uring(&ring, 8))  return false;
+
+    bool supported = init_provided_buffers(&buffers, &ring, 0, 1, 64);
+    if (supported)  free_provided_buffers(&buffers);
+
+    free_uring(&ring);
+
+    return supported;
+}
+
+void free_uring(Uring *ring)
+// Close the ring. The kernel cancels whatever is still in flight.
+{
+    munmap(ring->sqes, ring->num_sqes*sizeof(struct io_uring_sqe));
+    munmap(ring->ring_memory, ring->ring_memory_size);
+
+    bool closed = !close(ring->file_no);
+    if (!closed) {
+        Fatal("We couldn't close an io_uring instance (%s).", get_last_error().string);
+    }
+
+    *ring = (Uring){.file_no = -1};
+}
+
+static int enter_uring(Uring *ring, u32 num_to_wait_for, int timeout_ms)
+// Publish the entries we've prepared and hand them to the kernel, and maybe wait for completions. Return 0, or a
+// negative errno value if we were interrupted, timed out or the kernel was too busy to take everything.
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    // The kernel moves the head past whatever it takes, so anything it didn't take last time gets submitted again.
+    u32 num_to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    u32 flags = 0;
+    if (num_to_wait_for)  flags |= IORING_ENTER_GETEVENTS;
+
+    struct __kernel_timespec timeout = {.tv_sec = timeout_ms/1000, .tv_nsec = (timeout_ms%1000)*1000000LL};
+    struct io_uring_getevents_arg arg = {.ts = (timeout_ms >= 0) ? (u64)&timeout : 0};
+
+    int r = syscall(__NR_io_uring_enter, ring->file_no, num_to_submit, num_to_wait_for, flags|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (r >= 0)  return 0;
+
+    int error = errno;
+    if (error == ETIME || error == EINTR || error == EBUSY || error == EAGAIN)  return -error;
+
+    Fatal("io_uring_enter failed (%s).", get_last_error().string);
+}
+
+struct io_uring_sqe *get_sqe(Uring *ring)
+// Return a zeroed submission queue entry for the caller to fill in. If the SQ is full, submit what's in it first.
+{
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->num_sqes) {
+        enter_uring(ring, 0, 0);
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_local_tail += 1;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+void submit_and_wait(Uring *ring, u32 num_to_wait_for, int timeout_ms)
+// Submit everything we've prepared, then wait until there are at least num_to_wait_for completions, the timeout
+// passes (-1 means never) or a signal arrives. Check for completions with peek_cqe() either way.
+{
+    enter_uring(ring, num_to_wait_for, timeout_ms);
+}
+
+struct io_uring_cqe *peek_cqe(Uring *ring)
+// Return the oldest completion we haven't reaped, or NULL if there isn't one. The entry stays valid until advance_cqe().
+{
+    u32 head = *ring->cq_head;
+    u32 tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)  return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void advance_cqe(Uring *ring)
+// Give the entry peek_cqe() returned back to the kernel.
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+bool init_provided_buffers(Uring_buffers *buffers, Uring *ring, u16 group_id, u32 num_buffers, u32 buffer_size)
+// Lend num_buffers buffers of buffer_size bytes to the ring as the buffer group group_id. Return false if the kernel
+// doesn't support buffer rings (before 5.19).
+{
+    assert(num_buffers && !(num_buffers & (num_buffers-1)));
+    assert(num_buffers <= 1<<15);
+
+    *buffers = (Uring_buffers){.ring = ring, .group_id = group_id, .num_buffers = num_buffers, .buffer_size = buffer_size};
+
+    // The descriptor ring has to be page-aligned.
+    u64 buf_ring_size = num_buffers*sizeof(struct io_uring_buf);
+
+    buffers->buf_ring = mmap(NULL, buf_ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buffers->buf_ring == MAP_FAILED)  Fatal("We couldn't map memory for a buffer ring (%s).", get_last_error().string);
+
+    buffers->data = mmap(NULL, (u64)num_buffers*buffer_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (buffers->data == MAP_FAILED)  Fatal("We couldn't map memory for provided buffers (%s).", get_last_error().string);
+
+    struct io_uring_buf_reg reg = {.ring_addr = (u64)buffers->buf_ring, .ring_entries = num_buffers, .bgid = group_id};
+
+    int r = syscall(__NR_io_uring_register, ring->file_no, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (r < 0) {
+        munmap(buffers->buf_ring, buf_ring_size);
+        munmap(buffers->data, (u64)num_buffers*buffer_size);
+        *buffers = (Uring_buffers){0};
+        return false;
+    }
+
+    for (u32 i = 0; i < num_buffers; i++)  give_back_buffer(buffers, i);
+
+    return true;
+}
+
+void free_provided_buffers(Uring_buffers *buffers)
+{
+    struct io_uring_buf_reg reg = {.bgid = buffers->group_id};
+    syscall(__NR_io_uring_register, buffers->ring->file_no, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    munmap(buffers->buf_ring, buffers->num_buffers*sizeof(struct io_uring_buf));
+    munmap(buffers->data, (u64)buffers->num_buffers*buffers->buffer_size);
+
+    *buffers = (Uring_buffers){0};
+}
+
+u8 *get_provided_buffer(Uring_buffers *buffers, u16 buffer_id)
+// Return the start of the buffer a CQE points to. Its buffer ID is cqe->flags >> IORING_CQE_BUFFER_SHIFT.
+{
+    assert(buffer_id < buffers->num_buffers);
+    return buffers->data + (u64)buffer_id*buffers->buffer_size;
+}
+
+void give_back_buffer(Uring_buffers *buffers, u16 buffer_id)
+// Let the kernel use a buffer again.
+{
+    struct io_uring_buf *buf = &buffers->buf_ring->bufs[buffers->tail & (buffers->num_buffers-1)];
+
+    buf->addr = (u64)get_provided_buffer(buffers, buffer_id);
+    buf->len  = buffers->buffer_size;
+    buf->bid  = buffer_id;
+
+    buffers->tail += 1;
+    __atomic_store_n(&buffers->buf_ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+void prep_multishot_accept(struct io_uring_sqe *sqe, s32 socket, int flags, u64 user_data)
+// Accept connections on a listening socket until cancelled. Each one gets its own CQE, with the new socket in .res.
+// While the request is still armed, the CQE has IORING_CQE_F_MORE set. flags are accept4()'s.
+{
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = socket;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    sqe->user_data    = user_data;
+}
+
+void prep_recv_buffer(struct io_uring_sqe *sqe, s32 socket, Uring_buffers *buffers, u64 user_data)
+// Receive into whichever of the provided buffers the kernel picks. If none are left, the CQE has -ENOBUFS.
+{
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = socket;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group_id;
+    sqe->len       = buffers->buffer_size;
+    sqe->user_data = user_data;
+}
+
+void prep_poll(struct io_uring_sqe *sqe, s32 file_no, u32 events, bool multishot, u64 user_data)
+// Wait for poll() events on a file. A multishot poll posts a CQE each time the file becomes ready, until cancelled.
+{
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = file_no;
+    sqe->poll32_events = events;
+    sqe->len           = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data     = user_data;
+}
+
+void prep_read(struct io_uring_sqe *sqe, s32 file_no, void *buffer, u32 size, u64 offset, u64 user_data)
+{
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = file_no;
+    sqe->addr      = (u64)buffer;
+    sqe->len       = size;
+    sqe->off       = offset;
+    sqe->user_data = user_data;
+}
+
+void prep_cancel(struct io_uring_sqe *sqe, u64 user_data_to_cancel, u64 user_data)
+// Cancel the request with the given user data. It completes with -ECANCELED, unless it was already finishing.
+{
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = user_data_to_cancel;
+    sqe->user_data = user_data;
+}
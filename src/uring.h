@@ -0,0 +1,87 @@
+#ifndef URING_H_INCLUDED
+#define URING_H_INCLUDED
+
+#include <linux/io_uring.h>
+
+#include "basic.h"
+
+//
+// A thin wrapper around io_uring, without liburing. A Uring is a submission queue (SQ) that we fill with requests and
+// a completion queue (CQ) that the kernel fills with their results. Many requests go to the kernel with one system
+// call, and we pick up the results without making any.
+//
+//      Uring ring;
+//      bool ok = init_uring(&ring, 256); // False if the kernel is too old or io_uring is turned off.
+//
+//      prep_read(get_sqe(&ring), file_no, buffer, size, 0, user_data);
+//      submit_and_wait(&ring, 1, -1);
+//
+//      struct io_uring_cqe *cqe;
+//      while ((cqe = peek_cqe(&ring))) {
+//          // cqe->user_data says which request this is, and cqe->res is what the system call would have returned,
+//          // except that errors are negative errno values.
+//          advance_cqe(&ring);
+//      }
+//
+//      free_uring(&ring);
+//
+// A ring belongs to the thread that created it: only that thread may submit to it or reap from it.
+//
+// A Uring_buffers is a set of equal-sized buffers that we lend to the kernel. A recv prepared with prep_recv_buffer()
+// doesn't take a buffer; the kernel picks one from the set when data arrives, and says which in the CQE's flags. Hand
+// it back with give_back_buffer() when you've finished with the data. This way a thousand idle connections don't need
+// a thousand receive buffers.
+//
+typedef struct Uring         Uring;
+typedef struct Uring_buffers Uring_buffers;
+
+struct Uring {
+    s32                     file_no;
+
+    u32                    *sq_head;        // The kernel moves the head as it consumes entries, and we move the tail as we add them.
+    u32                    *sq_tail;
+    u32                     sq_mask;
+    u32                     sq_local_tail;  // Entries up to here are ready, but the kernel doesn't see them until we publish the tail.
+    struct io_uring_sqe    *sqes;
+    u32                     num_sqes;
+
+    u32                    *cq_head;        // We move the head as we reap entries, and the kernel moves the tail as it adds them.
+    u32                    *cq_tail;
+    u32                     cq_mask;
+    struct io_uring_cqe    *cqes;
+
+    u8                     *ring_memory;    // The shared memory for both queues, mapped in one go.
+    u64                     ring_memory_size;
+};
+
+struct Uring_buffers {
+    Uring                  *ring;
+    u16                     group_id;       // What prep_recv_buffer() asks for.
+
+    struct io_uring_buf_ring *buf_ring;     // The ring of buffer descriptors the kernel picks from.
+    u16                     tail;
+    u32                     num_buffers;    // A power of two.
+    u32                     buffer_size;
+    u8                     *data;           // num_buffers*buffer_size bytes.
+};
+
+bool init_uring(Uring *ring, u32 num_entries);
+bool is_uring_supported();
+void free_uring(Uring *ring);
+struct io_uring_sqe *get_sqe(Uring *ring);
+void submit_and_wait(Uring *ring, u32 num_to_wait_for, int timeout_ms);
+struct io_uring_cqe *peek_cqe(Uring *ring);
+void advance_cqe(Uring *ring);
+
+bool init_provided_buffers(Uring_buffers *buffers, Uring *ring, u16 group_id, u32 num_buffers, u32 buffer_size);
+void free_provided_buffers(Uring_buffers *buffers);
+u8 *get_provided_buffer(Uring_buffers *buffers, u16 buffer_id);
+void give_back_buffer(Uring_buffers *buffers, u16 buffer_id);
+
+void prep_multishot_accept(struct io_uring_sqe *sqe, s32 socket, int flags, u64 user_data);
+void prep_recv_buffer(struct io_uring_sqe *sqe, s32 socket, Uring_buffers *buffers, u64 user_data);
+void prep_poll(struct io_uring_sqe *sqe, s32 file_no, u32 events, bool multishot, u64 user_data);
+void prep_read(struct io_uring_sqe *sqe, s32 file_no, void *buffer, u32 size, u64 offset, u64 user_data);
+void prep_cancel(struct io_uring_sqe *sqe, u64 user_data_to_cancel, u64 user_data);
+
+#endif // URING_H_INCLUDED
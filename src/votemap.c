@@ -137,32 +137,278 @@ Tile_info parse_tile_request(Request *request)
     return result;
 }
 
-Response serve_vertices(Client *client)
+typedef struct Tile_stream Tile_stream;
+struct Tile_stream {
+    // The state of a /vertices/ response between calls to stream_tile().
+    Tile_info       tile;
+    PG_client       db;             // We keep the connection open for both queries, and close it when the stream finishes or stops.
+    string_array    sql_params;     // The parameters to our SQL queries. They're the same for both queries.
+
+    PG_result      *districts;      // The result of the query for district polygons.
+    PG_result      *boundaries;     // The result of the query for district boundaries. NULL until we've drawn all the districts.
+    s64             row;            // The next row to draw from whichever result we're on.
+
+    Vertex_array    verts;          // We draw into this, then copy it to the output.
+    s64             draw_time;      // How long we've spent drawing so far, in microseconds.
+    s64             last_check;     // When we last asked whether the client had given up on the tile, in microseconds.
+};
+
+// The phases of our handlers' work that we time, on top of the server's own. See add_phase().
+static s32 db_query_phase;
+static s32 triangulate_phase;
+
+static Response make_query_failure_response()
+// For when a query fails, e.g. because the database is down. We don't cache it, because it isn't a 200.
+{
+    char static body[] = "We couldn't get the data from the database.\n";
+    return (Response){500, .body = body, .size = lengthof(body)};
+}
+
+static PG_result *timed_query(Client *client, PG_client *db, char *query, string_array *params)
+// Query the database and record how long it took for the client's route.
+{
+    s64 start = get_monotonic_time_us();
+
+    PG_result *result = query_database(db, query, params, client->context);
+
+    record_phase(client, db_query_phase, get_monotonic_time_us() - start);
+
+    return result;
+}
+
+static void draw_district(Tile_stream *stream, s64 row)
 {
+    Memory_context *ctx    = stream->verts.context;
+    PG_result      *result = stream->districts;
+    Tile_info      *tile   = &stream->tile;
+
+    int district_id_column = *Get(&result->columns, "district_id");  assert(district_id_column >= 0);
+    int polygon_column     = *Get(&result->columns, "polygon");      assert(polygon_column >= 0);
+    int name_column        = *Get(&result->columns, "name");         assert(name_column >= 0);
+    int party_id_column    = *Get(&result->columns, "party_id");     assert(party_id_column >= 0);
+    int colour_column      = *Get(&result->columns, "colour");       assert(colour_column >= 0);
+
+    u8_array *district_id_cell = &result->rows.data[row].data[district_id_column];
+    u8_array *polygon_cell     = &result->rows.data[row].data[polygon_column];
+    u8_array *name_cell        = &result->rows.data[row].data[name_column];
+    u8_array *party_id_cell    = &result->rows.data[row].data[party_id_column];
+    u8_array *colour_cell      = &result->rows.data[row].data[colour_column];
+
+    if (!polygon_cell->count)  return;
+
+    Polygon_array polygons = {.context = ctx};
+    {
+        u8 *end_data = NULL;
+        parse_wkb_polygons(polygon_cell->data, &polygons, &end_data);
+
+        assert(end_data == &polygon_cell->data[polygon_cell->count]);
+    }
+
+    int district_id = (int)get_u32_from_cell(district_id_cell);
+    char_array name = get_char_array_from_cell(name_cell);
+
+    Vector3 colour;
+    if (!party_id_cell->count) {
+        // We don't know the winner. Make it grey.
+        colour = (Vector3){0.5, 0.5, 0.5};
+    } else {
+        int party_id = (int)get_u32_from_cell(party_id_cell);
+
+        if (party_id < 0) {
+            colour = (Vector3){0.3, 0.3, 0.3}; // Independents are dark grey.
+        } else {
+            u32 colour_u32 = get_u32_from_cell(colour_cell);
+
+            if (colour_u32 == 0) {
+                // We know who won, but we haven't got a colour for this party in the database. Make it light grey.
+                colour = (Vector3){0.7, 0.7, 0.7};
+            } else {
+                // We know who won and we have a colour.
+                int r = colour_u32 >> 16 & 0xff;
+                int g = colour_u32 >> 8 & 0xff;
+                int b = colour_u32 & 0xff;
+
+                colour = (Vector3){r/255.0, g/255.0, b/255.0};
+            }
+        }
+    }
+
+    bool dark = (tile->theme == DARK);
+    dark     |= (tile->theme == HIGHLIGHT_DISTRICT && tile->district_id != district_id);
+
+    if (dark)  colour = lerp_rgb(colour, (Vector3){0}, 0.5);
+
+    for (s64 j = 0; j < polygons.count; j++)  draw_polygon(&polygons.data[j], colour, &stream->verts);
+}
+
+static void draw_boundary(Tile_stream *stream, s64 row)
+{
+    Memory_context *ctx    = stream->verts.context;
+    PG_result      *result = stream->boundaries;
+    Tile_info      *tile   = &stream->tile;
+
+    int id_column   = *Get(&result->columns, "id");    assert(id_column >= 0);
+    int path_column = *Get(&result->columns, "path");  assert(path_column >= 0);
+
+    u8_array *id_cell   = &result->rows.data[row].data[id_column];
+    u8_array *path_cell = &result->rows.data[row].data[path_column];
+
+    if (path_cell->count == 0)  return;
+
+    Path_array paths = {.context = ctx};
+
+    u8 *end_data = NULL;
+    parse_wkb_paths(path_cell->data, &paths, &end_data);
+    assert(end_data == path_cell->data + path_cell->count);
+
+    Vector3 colour = {0.8, 0.8, 0.8};
+
+    float line_width = 1.5*tile->upp;
+    if (tile->theme == HIGHLIGHT_DISTRICT) {
+        u32 id = get_u32_from_cell(id_cell);
+        if (id == tile->district_id)  line_width = 4*tile->upp;
+    }
+
+    for (s64 i = 0; i < paths.count; i++) {
+        draw_path(&paths.data[i], line_width, colour, &stream->verts);
+    }
+}
+
+static bool is_tile_cancelled(void *client)
+// For PG_client.is_cancelled, so that we stop querying for a tile that the client has given up on.
+{
+    return is_request_cancelled(client);
+}
+
+static bool stream_tile(Client *client, void *data, u8_array *out)
+// Draw the next batch of districts or boundaries. We draw all the districts first, then the boundaries on top.
+{
+    Tile_stream *stream = data;
     Memory_context *ctx = client->context;
 
-    Vertex_array *verts = NewArray(verts, ctx);
+    s64 CHUNK_SIZE     = 64*1024; // Roughly how many bytes of vertices to draw in each call.
+    s64 CHECK_INTERVAL = 5000;    // How often to check whether the client has given up, in microseconds.
+
+    stream->verts.count = 0;
+
+    bool finished  = false;
+    bool cancelled = is_request_cancelled(client); // If the server stops sending the tile early, it calls us once more to say so.
 
-    PG_client db = {DATABASE_URL, .use_cache = true, .keep_alive = true};
+    while (!cancelled && stream->verts.count*sizeof(Vertex) < CHUNK_SIZE) {
+        // Browsers abort tile requests all the time as the user pans. Check between polygons whether this one has
+        // been abandoned, so we don't draw tiles nobody will see. Checking costs a system call, and a big tile has
+        // thousands of small polygons, so only check every few milliseconds.
+        s64 current_time = get_monotonic_time_us();
+        if (current_time - stream->last_check >= CHECK_INTERVAL) {
+            cancelled = is_request_cancelled(client);
+            if (cancelled)  break;
+            stream->last_check = current_time;
+        }
+
+        if (!stream->boundaries) {
+            if (stream->row < stream->districts->rows.count) {
+                s64 start = get_monotonic_time_us();
+                draw_district(stream, stream->row);
+                stream->draw_time += get_monotonic_time_us() - start;
+
+                stream->row += 1;
+                continue;
+            }
+
+            // We've drawn all the districts. Now get the boundaries.
+            // |Speed: Other than the coastline, boundaries are shared by two districts, and as a result we draw them twice.
+            char *query =
+            " select id, st_asbinary(st_collectionextract(st_makevalid(                                         "
+            "     st_clipbybox2d(                                                                               "
+            "       st_simplify(geom, $1::float),                                                               "
+            "       st_makeenvelope($2::float, $3::float, $4::float, $5::float, 3577)                           "
+            "     )                                                                                             "
+            "   ), 2)) as path                                                                                  "
+            " from (                                                                                            "
+            "     select id, st_collect(st_exteriorring(geom)) as geom                                          "
+            "     from (                                                                                        "
+            "         select id, (st_dump(bounds_clipped)).geom as geom                                         "
+            "         from district                                                                             "
+            "         where election_id = $6::int                                                               "
+            "           and bounds_clipped && st_makeenvelope($2::float, $3::float, $4::float, $5::float, 3577) "
+            "       ) t                                                                                         "
+            "     group by id                                                                                   "
+            "   ) t                                                                                             "
+            ;
+
+            stream->boundaries = timed_query(client, &stream->db, query, &stream->sql_params);
+            stream->row        = 0;
+
+            if (!stream->boundaries) {
+                cancelled = is_request_cancelled(client);
+                if (cancelled)  break;
+
+                // The query failed. We've already sent the districts, so the best we can do is finish the tile
+                // without boundaries.
+                finished = true;
+                break;
+            }
+            continue;
+        }
+
+        if (stream->row < stream->boundaries->rows.count) {
+            s64 start = get_monotonic_time_us();
+            draw_boundary(stream, stream->row);
+            stream->draw_time += get_monotonic_time_us() - start;
+
+            stream->row += 1;
+            continue;
+        }
+
+        finished = true;
+        break;
+    }
+
+    if (finished || cancelled)  close_database(&stream->db); // We won't be called again.
+    if (cancelled)              return false;
+
+    // |Speed: We could save this copy by drawing straight into the output.
+    s64 num_bytes = stream->verts.count*sizeof(Vertex);
+    array_reserve(out, out->count + num_bytes);
+    memcpy(out->data + out->count, stream->verts.data, num_bytes);
+    out->count += num_bytes;
+
+    if (finished)  record_phase(client, triangulate_phase, stream->draw_time);
+
+    return !finished;
+}
+
+Response serve_vertices(Client *client)
+// Query the districts straight away, so we can report errors with a status code. Then stream the vertices with
+// stream_tile(), so the client gets the first districts while we're still triangulating the rest.
+{
+    Memory_context *ctx = client->context;
 
     Tile_info tile = parse_tile_request(&client->request);
     if (!tile.parse_success) {
         return (Response){400, .body = tile.fail_reason, .size = strlen(tile.fail_reason)};
     }
 
+    Tile_stream *stream = New(Tile_stream, ctx);
+    stream->tile  = tile;
+    stream->db    = (PG_client){DATABASE_URL, .keep_alive = true, .use_cache = true, .is_cancelled = &is_tile_cancelled, .cancel_data = client};
+    stream->verts = (Vertex_array){.context = ctx};
+
     // Prepare the parameters to our SQL queries (they are the same for all queries below).
     // Negate the Y values to convert the map units of the browser to the database's coordinate reference system.
-    string_array sql_params = {.context = ctx};
+    string_array *sql_params = &stream->sql_params;
     {
-        *Add(&sql_params) = get_string(ctx, "%f", tile.upp).data;
-        *Add(&sql_params) = get_string(ctx, "%f", tile.x0).data;
-        *Add(&sql_params) = get_string(ctx, "%f", -tile.y0).data;
-        *Add(&sql_params) = get_string(ctx, "%f", tile.x1).data;
-        *Add(&sql_params) = get_string(ctx, "%f", -tile.y1).data;
-        *Add(&sql_params) = get_string(ctx, "%d", tile.election_id).data;
+        *sql_params = (string_array){.context = ctx};
+
+        *Add(sql_params) = get_string(ctx, "%f", tile.upp).data;
+        *Add(sql_params) = get_string(ctx, "%f", tile.x0).data;
+        *Add(sql_params) = get_string(ctx, "%f", -tile.y0).data;
+        *Add(sql_params) = get_string(ctx, "%f", tile.x1).data;
+        *Add(sql_params) = get_string(ctx, "%f", -tile.y1).data;
+        *Add(sql_params) = get_string(ctx, "%d", tile.election_id).data;
     }
 
-    // Draw the electorate districts as polygons.
+    // Get the electorate districts as polygons.
     {
         // Order by the size of the face's bounding box. This is so that larger polygons don't cover smaller ones,
         // because we don't draw inner rings yet.
@@ -185,129 +431,21 @@ Response serve_vertices(Client *client)
         " order by st_area(box2d(d.bounds_clipped)) desc                                                                                               "
         ;
 
-        PG_result *result = query_database(&db, query, &sql_params, ctx);
-
-        int district_id_column = *Get(&result->columns, "district_id");  assert(district_id_column >= 0);
-        int polygon_column     = *Get(&result->columns, "polygon");      assert(polygon_column >= 0);
-        int name_column        = *Get(&result->columns, "name");         assert(name_column >= 0);
-        int party_id_column    = *Get(&result->columns, "party_id");     assert(party_id_column >= 0);
-        int colour_column      = *Get(&result->columns, "colour");       assert(colour_column >= 0);
-
-        for (s64 i = 0; i < result->rows.count; i++) {
-            u8_array *district_id_cell = &result->rows.data[i].data[district_id_column];
-            u8_array *polygon_cell     = &result->rows.data[i].data[polygon_column];
-            u8_array *name_cell        = &result->rows.data[i].data[name_column];
-            u8_array *party_id_cell    = &result->rows.data[i].data[party_id_column];
-            u8_array *colour_cell      = &result->rows.data[i].data[colour_column];
-
-            if (!polygon_cell->count)  continue;
-
-            Polygon_array polygons = {.context = ctx};
-            {
-                u8 *end_data = NULL;
-                parse_wkb_polygons(polygon_cell->data, &polygons, &end_data);
-
-                assert(end_data == &polygon_cell->data[polygon_cell->count]);
-            }
-
-            int district_id = (int)get_u32_from_cell(district_id_cell);
-            char_array name = get_char_array_from_cell(name_cell);
-
-            Vector3 colour;
-            if (!party_id_cell->count) {
-                // We don't know the winner. Make it grey.
-                colour = (Vector3){0.5, 0.5, 0.5};
-            } else {
-                int party_id = (int)get_u32_from_cell(party_id_cell);
-
-                if (party_id < 0) {
-                    colour = (Vector3){0.3, 0.3, 0.3}; // Independents are dark grey.
-                } else {
-                    u32 colour_u32 = get_u32_from_cell(colour_cell);
-
-                    if (colour_u32 == 0) {
-                        // We know who won, but we haven't got a colour for this party in the database. Make it light grey.
-                        colour = (Vector3){0.7, 0.7, 0.7};
-                    } else {
-                        // We know who won and we have a colour.
-                        int r = colour_u32 >> 16 & 0xff;
-                        int g = colour_u32 >> 8 & 0xff;
-                        int b = colour_u32 & 0xff;
-
-                        colour = (Vector3){r/255.0, g/255.0, b/255.0};
-                    }
-                }
-            }
-
-            bool dark = (tile.theme == DARK);
-            dark     |= (tile.theme == HIGHLIGHT_DISTRICT && tile.district_id != district_id);
-
-            if (dark)  colour = lerp_rgb(colour, (Vector3){0}, 0.5);
-
-            for (s64 j = 0; j < polygons.count; j++)  draw_polygon(&polygons.data[j], colour, verts);
-        }
-    }
-
-    // Draw the boundary lines. |Speed: Other than the coastline, boundaries are shared by two districts, and as a result we draw them twice.
-    {
-        char *query =
-        " select id, st_asbinary(st_collectionextract(st_makevalid(                                         "
-        "     st_clipbybox2d(                                                                               "
-        "       st_simplify(geom, $1::float),                                                               "
-        "       st_makeenvelope($2::float, $3::float, $4::float, $5::float, 3577)                           "
-        "     )                                                                                             "
-        "   ), 2)) as path                                                                                  "
-        " from (                                                                                            "
-        "     select id, st_collect(st_exteriorring(geom)) as geom                                          "
-        "     from (                                                                                        "
-        "         select id, (st_dump(bounds_clipped)).geom as geom                                         "
-        "         from district                                                                             "
-        "         where election_id = $6::int                                                               "
-        "           and bounds_clipped && st_makeenvelope($2::float, $3::float, $4::float, $5::float, 3577) "
-        "       ) t                                                                                         "
-        "     group by id                                                                                   "
-        "   ) t                                                                                             "
-        ;
-
-        PG_result *result = query_database(&db, query, &sql_params, ctx);
-
-        int id_column   = *Get(&result->columns, "id");    assert(id_column >= 0);
-        int path_column = *Get(&result->columns, "path");  assert(path_column >= 0);
-
-        Path_array paths = {.context = ctx};
-
-        for (s64 row = 0; row < result->rows.count; row++) {
-            u8_array *id_cell   = &result->rows.data[row].data[id_column];
-            u8_array *path_cell = &result->rows.data[row].data[path_column];
+        stream->districts = timed_query(client, &stream->db, query, sql_params);
 
-            if (path_cell->count == 0)  continue;
+        if (!stream->districts) {
+            close_database(&stream->db);
 
-            u8 *end_data = NULL;
-            parse_wkb_paths(path_cell->data, &paths, &end_data);
-            assert(end_data == path_cell->data + path_cell->count);
-
-            Vector3 colour = {0.8, 0.8, 0.8};
-
-            float line_width = 1.5*tile.upp;
-            if (tile.theme == HIGHLIGHT_DISTRICT) {
-                u32 id = get_u32_from_cell(id_cell);
-                if (id == tile.district_id)  line_width = 4*tile.upp;
-            }
-
-            for (s64 i = 0; i < paths.count; i++) {
-                draw_path(&paths.data[i], line_width, colour, verts);
-            }
-
-            paths.count = 0; // So we can reuse the array for the next loop.
+            // Either the query failed, or the client hung up and we cancelled it, in which case nobody will see this.
+            return make_query_failure_response();
         }
     }
 
-    Response response = {200, .body = verts->data, .size = verts->count*sizeof(Vertex)};
+    Response response = {200, .stream = &stream_tile, .stream_data = stream};
 
     response.headers = (string_dict){.context = ctx};
     *Set(&response.headers, "content-type") = "application/octet-stream";
 
-    close_database(&db);
     return response;
 }
 
@@ -360,7 +498,8 @@ Response serve_districts(Client *client)
     "   ) t                                    "
     ;
 
-    PG_result *result = query_database(&db, query, &sql_params, ctx);
+    PG_result *result = timed_query(client, &db, query, &sql_params);
+    if (!result)  return make_query_failure_response();
 
     assert(*Get(&result->columns, "json") == 0);
     assert(result->rows.count == 1);
@@ -407,7 +546,8 @@ Response serve_seats_won(Client *client)
         *Add(&sql_params) = election;
     }
 
-    PG_result *result = query_database(&db, query, &sql_params, ctx);
+    PG_result *result = timed_query(client, &db, query, &sql_params);
+    if (!result)  return make_query_failure_response();
 
     assert(*Get(&result->columns, "json") == 0);
     assert(result->rows.count == 1); //|Bug: There may be 0 rows if the election ID in the request path does not exist. Currently in this case there's a segfault.
@@ -468,7 +608,8 @@ Response serve_contest_votes(Client *client)
         *Add(&sql_params) = district;
     }
 
-    PG_result *result = query_database(&db, query, &sql_params, ctx);
+    PG_result *result = timed_query(client, &db, query, &sql_params);
+    if (!result)  return make_query_failure_response();
 
     assert(*Get(&result->columns, "json") == 0);
     assert(result->rows.count == 1); //|Bug: There may be 0 rows if the election ID in the request path does not exist. Currently in this case there's a segfault.
@@ -486,23 +627,116 @@ int main(int argc, char **argv)
 {
     u32  address = 0;       // 0.0.0.0  |Todo: Make this configurable with getaddrinfo().
     u16  port    = 6008;
+    bool use_reactors = false;
+    bool use_io_uring = false;
+
+    char *access_log_path = NULL;
+    bool  binary_log      = false;
+    char *trace_path      = NULL;
+    s32   trace_every     = 0;
+
+    int  num_workers          = 0;
+    int  num_blocking_workers = 0;
+    bool pin_workers          = false;
+
+    int  max_connections_per_ip = 0;
+
+    // Take --reactors as a flag, and --io-uring, which runs the reactors on io_uring. --access-log takes a file to
+    // write the access log to, instead of stdout. With --binary-log, it's in the binary format; see
+    // bin/scripts/access-log-dump. --trace-every n traces one request in n, for /debug/trace.json (which can change it
+    // later with ?sample_every=n), and --trace-file takes a file to append the traces to. --workers and
+    // --blocking-workers cap the worker pools (by default they're sized from the CPUs we can use), and --pin-workers
+    // pins each worker to a CPU. --max-connections-per-ip n caps the connections we keep open from one address. If
+    // there is any other command-line argument, take it as a port.
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--reactors")) {
+            use_reactors = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--io-uring")) {
+            use_io_uring = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--access-log") && i+1 < argc) {
+            access_log_path = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--binary-log")) {
+            binary_log = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--trace-every") && i+1 < argc) {
+            trace_every = atoi(argv[++i]);
+            assert(trace_every >= 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "--trace-file") && i+1 < argc) {
+            trace_path = argv[++i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--workers") && i+1 < argc) {
+            num_workers = atoi(argv[++i]);
+            assert(num_workers >= 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "--blocking-workers") && i+1 < argc) {
+            num_blocking_workers = atoi(argv[++i]);
+            assert(num_blocking_workers >= 0);
+            continue;
+        }
+        if (!strcmp(argv[i], "--pin-workers")) {
+            pin_workers = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--max-connections-per-ip") && i+1 < argc) {
+            max_connections_per_ip = atoi(argv[++i]);
+            assert(max_connections_per_ip >= 0);
+            continue;
+        }
 
-    // If there is a command-line argument, take it as a port.
-    if (argc > 1) {
         char *end = NULL;
-        port = strtol(argv[1], &end, 10);
-        assert(end > argv[1]);
+        port = strtol(argv[i], &end, 10);
+        assert(end > argv[i]);
         assert(0 <= port && port <= UINT16_MAX);
     }
 
     Memory_context *top_context = new_context(NULL);
 
     Server *server = create_server(address, port, top_context);
+    server->use_reactors      = use_reactors;
+    server->use_io_uring      = use_io_uring;
+    server->access_log_path   = access_log_path;
+    server->access_log_format = binary_log ? BINARY_LOG : TEXT_LOG;
+    server->trace_path        = trace_path;
+
+    server->num_workers          = num_workers;
+    server->num_blocking_workers = num_blocking_workers;
+    server->pin_workers          = pin_workers;
+
+    server->max_connections_per_ip = max_connections_per_ip;
+
+    set_trace_sampling(server->tracer, trace_every);
+
+    db_query_phase    = add_phase(server, "db_query");
+    triangulate_phase = add_phase(server, "triangulate");
+
+    // Tiles are big and we make them on the fly, so we compress them quickly. See bin/scripts/compression-bench.
+    // Tiles can take seconds to draw, so only let two draw at once. That leaves workers free for everything else.
+    // When several people ask for the same tile at once, one of them draws it and the others share the stream.
+    add_route(server, GET, "/vertices/.+",                                  &serve_vertices,      .compression_level = 3, .max_concurrency = 2, .max_queue = 64, .coalesce = true);
+
+    // The election results hardly ever change, so we keep them in memory and only check the database once a minute,
+    // in the background. Making them is mostly waiting for the database, so it happens on the blocking workers.
+    s64 MINUTE = 60*1000;
+    add_route(server, GET, "/elections/(\\d+)/districts.json",              &serve_districts,     .compression_level = 6, .cache_ttl = MINUTE, .cache_stale_time = 24*60*MINUTE, .blocking = true);
+    add_route(server, GET, "/elections/(\\d+)/seats-won.json",              &serve_seats_won,     .compression_level = 6, .cache_ttl = MINUTE, .cache_stale_time = 24*60*MINUTE, .blocking = true);
+    add_route(server, GET, "/elections/(\\d+)/contests/(\\d+)/votes.json",  &serve_contest_votes, .compression_level = 6, .cache_ttl = MINUTE, .cache_stale_time = 24*60*MINUTE, .blocking = true);
+
+    // These tell anyone who can see them a lot about the server, and /debug/trace.json?sample_every=n changes how
+    // many requests we trace, so only serve them to this machine. See bin/scripts/trace-sampling-test.
+    add_route(server, GET, "/metrics",                                      &serve_metrics,       .compression_level = 1, .local_only = true);
+    add_route(server, GET, "/debug/trace.json",                             &serve_trace,         .compression_level = 1, .local_only = true);
 
-    add_route(server, GET, "/vertices/.+",                                  &serve_vertices);
-    add_route(server, GET, "/elections/(\\d+)/districts.json",              &serve_districts);
-    add_route(server, GET, "/elections/(\\d+)/seats-won.json",              &serve_seats_won);
-    add_route(server, GET, "/elections/(\\d+)/contests/(\\d+)/votes.json",  &serve_contest_votes);
     add_file_route(server, "/.*",                                           "web/");
 
     start_server(server);